@@ -30,7 +30,11 @@
 #include <sys/types.h>
 #include <attr/xattr.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
 #include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <fcntl.h>
 #include <sys/smack.h>
 #include <errno.h>
@@ -38,6 +42,9 @@
 #include <wait.h>
 #include <dirent.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
 
 
 #include "security_smack.h"
@@ -52,74 +59,729 @@
 #include "virstoragefile.h"
 #include "virfile.h"
 #include "configmake.h"
+#include "dirname.h"
 #include "vircommand.h"
 #include "virhash.h"
+#include "virhashcode.h"
+#include "virbuffer.h"
+#include "virtypedparam.h"
 #include "virstring.h"
+#include "virthread.h"
+
+#if HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+#endif
+
+#if WITH_LIBURING
+# include <liburing.h>
+#endif
 
 #define VIR_FROM_THIS VIR_FROM_SECURITY
 #define SECURITY_SMACK_VOID_DOI     "0"
 #define SECURITY_SMACK_NAME         "smack"
+#define SECURITY_SMACK_XATTR        "security.SMACK64"
+/* Used instead of SECURITY_SMACK_XATTR on hosts not running Smack */
+#define SECURITY_SMACK_USER_XATTR   "user.SMACK64"
+#define SECURITY_SMACK_UNUSED_LABEL SMACK_PREFIX "unused"
+/* Label of read-only images shared between domains (backing files).
+ * Dynamically labeled domains get a rule to read it, see
+ * smackDefaultRules; static labels need one from the policy. */
+#define SECURITY_SMACK_SHARED_LABEL SMACK_PREFIX "shared"
+
+/* Upper bound on the number of inodes remembered by the label cache;
+ * each shard is flushed once it grows past its part of this. */
+#define SMACK_LABEL_CACHE_MAX       16384
+#define SMACK_LABEL_CACHE_SHARDS    16
+
+/* Default and upper bound of the per-domain disk relabel fan-out */
+#define SMACK_RELABEL_WORKERS_DEFAULT   4
+#define SMACK_RELABEL_WORKERS_MAX       32
+
+/* Time in ms given to reconcile running domains after Open */
+#define SMACK_RECONCILE_BUDGET_DEFAULT  30000
+
+/* Pending deferred restores, see SmackRestoreQueuePush() */
+#define SMACK_STATE_DIR             LOCALSTATEDIR "/run/libvirt/smack"
+#define SMACK_RESTORE_QUEUE_PREFIX  SMACK_STATE_DIR "/restore-queue-"
+#define SMACK_RESTORE_QUEUE_MAX     (16 * 1024 * 1024)
+/* Files restored by the queue thread between two queue file updates */
+#define SMACK_RESTORE_BATCH         64
+/* Original labels of relabeled files, see SmackJournalAppend() */
+#define SMACK_JOURNAL_FILE          SMACK_STATE_DIR "/labels.journal"
+
+typedef struct _SmackRestoreQueue SmackRestoreQueue;
+typedef SmackRestoreQueue *SmackRestoreQueuePtr;
+
+typedef struct _SmackJournal SmackJournal;
+typedef SmackJournal *SmackJournalPtr;
+
+typedef struct _SmackRelabelPlan SmackRelabelPlan;
+typedef SmackRelabelPlan *SmackRelabelPlanPtr;
+
+typedef struct _SmackHostdevFiles SmackHostdevFiles;
+typedef SmackHostdevFiles *SmackHostdevFilesPtr;
+
+typedef struct _SmackCallbackData SmackCallbackData;
+typedef SmackCallbackData *SmackCallbackDataPtr;
+
+struct _SmackCallbackData {
+    virSecurityManagerPtr manager;
+    virDomainDefPtr def;
+    /* if set, relabels are queued here instead of being executed */
+    SmackRelabelPlanPtr plan;
+};
 
 /*
- *
- *typedef struct _SmackCallbackData SmackCallbackData; 
- *typedef SmackCallbackData *SmackCallbackDataPtr;
- *
- *struct _SmackCallbackData {
- *     virSecurityManagerPtr manager;
- *     virSecurityLabelDefPtr secdef;
- *};
+ * Last label applied by this driver to an inode, together with the
+ * inode ctime observed right after applying it. Any later change to
+ * the inode (including a relabel done by someone else) bumps the
+ * ctime, so a matching ctime means the label is still in place.
  */
+typedef struct _virSmackLabelCacheEntry virSmackLabelCacheEntry;
+typedef virSmackLabelCacheEntry *virSmackLabelCacheEntryPtr;
 
-static char *
-get_label_name(virDomainDefPtr def)
+struct _virSmackLabelCacheEntry {
+    struct timespec ctime;
+    /* interned label, see SmackLabelIntern() */
+    int label;
+};
+
+/*
+ * The cache is split by inode into shards with a lock each, so that
+ * domains started concurrently don't serialize on their relabels.
+ */
+typedef struct _virSmackLabelCacheShard virSmackLabelCacheShard;
+typedef virSmackLabelCacheShard *virSmackLabelCacheShardPtr;
+
+struct _virSmackLabelCacheShard {
+    virMutex lock;
+    /* "dev:ino" -> virSmackLabelCacheEntryPtr */
+    virHashTablePtr entries;
+};
+
+/*
+ * A read-only image (backing file or readonly disk) carrying the host
+ * wide shared label. It is labeled when the first domain starts using
+ * it and restored once the last one is gone.
+ */
+typedef struct _virSmackSharedImage virSmackSharedImage;
+typedef virSmackSharedImage *virSmackSharedImagePtr;
+
+struct _virSmackSharedImage {
+    /* UUIDs of the domains using the image */
+    virHashTablePtr users;
+    /* label being set or restored by a thread which dropped
+     * sharedLock meanwhile */
+    bool busy;
+};
+
+/*
+ * What is known about a mounted filesystem, looked up by device id
+ * instead of walking path components with statfs() every time.
+ */
+typedef struct _virSmackFsInfo virSmackFsInfo;
+typedef virSmackFsInfo *virSmackFsInfoPtr;
+
+struct _virSmackFsInfo {
+    long long type;             /* f_type reported by statfs() */
+    bool shared;                /* NFS, GFS2, OCFS2 or AFS */
+    int xattrs;                 /* labels supported: 1 yes, 0 no, -1 unknown */
+    unsigned int failures;      /* ENOTSUP seen in a row while unknown */
+};
+
+typedef struct _virSmackSecurityData virSmackSecurityData;
+typedef virSmackSecurityData *virSmackSecurityDataPtr;
+
+struct _virSmackSecurityData {
+    virMutex lock;
+
+    virSmackLabelCacheShard labelCache[SMACK_LABEL_CACHE_SHARDS];
+    /* updated atomically */
+    unsigned long long cacheHits;
+    unsigned long long cacheMisses;
+    unsigned long long cacheInvalidations;
+
+    /* number of threads relabeling disks of one domain */
+    unsigned int relabelWorkers;
+    /* number of threads walking one directory tree */
+    unsigned int treeWorkers;
+    /* submit bulk relabels through io_uring when possible */
+    bool useUring;
+
+    /* "dev:ino" -> virSmackSharedImagePtr, guarded by sharedLock;
+     * sharedCond is broadcast whenever an image stops being busy */
+    virMutex sharedLock;
+    virCond sharedCond;
+    virHashTablePtr sharedImages;
+
+    /* st_dev -> virSmackFsInfoPtr, guarded by fsLock and flushed
+     * whenever mountinfoFd reports a change of the mount table */
+    virMutex fsLock;
+    virHashTablePtr fsCache;
+    int mountinfoFd;
+    /* bumped on every mount table change seen by fsCache */
+    unsigned long long fsGeneration;
+    /* number of cached filesystems known to reject labels, and of
+     * those with failures counted against them */
+    unsigned int fsNoLabels;
+    unsigned int fsFailing;
+
+    /* domain UUID -> virHashTablePtr of host device key ->
+     * SmackHostdevFilesPtr, guarded by lock */
+    virHashTablePtr hostdevFiles;
+    /* host device node -> number of host devices using it, guarded
+     * by lock */
+    virHashTablePtr hostdevNodes;
+
+    /* domain UUID -> virHashTablePtr of resource key -> interned id
+     * + 1 of the label applied to it, guarded by lock */
+    virHashTablePtr applied;
+    /* domain UUID -> interned id + 1 of the image label the domain
+     * holds a reference on, guarded by lock */
+    virHashTablePtr domainLabels;
+
+    /* access rules installed for every dynamically labeled domain,
+     * guarded by lock */
+    virSmackRuleTemplatePtr rules;
+    size_t nrules;
+
+    /* reconciliation of running domains after a daemon restart stops
+     * at reconcileDeadline, a CLOCK_MONOTONIC time in ms; both guarded
+     * by lock */
+    unsigned long long reconcileDeadline;
+    virSmackReconcileProgress reconcile;
+
+    /* queue image label restores instead of doing them, guarded by
+     * lock; restoreQueue is NULL if it could not be set up */
+    bool deferRestore;
+    SmackRestoreQueuePtr restoreQueue;
+
+    /* original labels of relabeled files, NULL if the journal could
+     * not be opened; set up by Open and not changed afterwards */
+    SmackJournalPtr journal;
+};
+
+/* Room for SMACK_PREFIX followed by a domain UUID */
+#define SMACK_DOMAIN_LABEL_BUFLEN \
+    (sizeof(SMACK_PREFIX) + VIR_UUID_STRING_BUFLEN)
+
+static void
+get_label_name(virDomainDefPtr def, char *name)
 {
 	char uuidstr[VIR_UUID_STRING_BUFLEN];
-	char *name = NULL;
 
 	virUUIDFormat(def->uuid,uuidstr);
-	if(virAsprintf(&name,"%s%s",SMACK_PREFIX,uuidstr) < 0)
-		return NULL;
+	snprintf(name, SMACK_DOMAIN_LABEL_BUFLEN, "%s%s", SMACK_PREFIX, uuidstr);
+}
+
+
+/*
+ * Interned labels. Each label the driver keeps track of is stored
+ * once, inline in a fixed size slot, and referred to by the slot's
+ * id, so that interned labels are equal if and only if their ids
+ * are. Labels are spread over shards by hash, each with a lock of its
+ * own, and the low bits of an id name the shard. Within a shard slots
+ * are allocated in chunks which never move, keep a count of references
+ * and go back to a free list when the last one is dropped. The name ->
+ * id table uses the slot's storage as key.
+ */
+#define SMACK_LABEL_CHUNK       256
+#define SMACK_LABEL_SHARD_BITS  4
+#define SMACK_LABEL_SHARDS      (1 << SMACK_LABEL_SHARD_BITS)
+
+typedef struct _SmackLabelSlot SmackLabelSlot;
+typedef SmackLabelSlot *SmackLabelSlotPtr;
+
+struct _SmackLabelSlot {
+    unsigned int refs;
+    /* index of the next free slot while this one is free, or -1 */
+    int nextFree;
+    char name[SMACK_LABEL_LEN + 1];
+};
+
+typedef struct _SmackLabelShard SmackLabelShard;
+typedef SmackLabelShard *SmackLabelShardPtr;
+
+struct _SmackLabelShard {
+    virMutex lock;
+    SmackLabelSlotPtr *chunks;
+    size_t nchunks;
+    int free;
+    /* slot name -> id + 1 */
+    virHashTablePtr ids;
+};
+
+static SmackLabelShard smackLabelShards[SMACK_LABEL_SHARDS];
+
+static uint32_t
+SmackLabelKeyCode(const void *name, uint32_t seed)
+{
+    return virHashCodeGen(name, strlen(name), seed);
+}
+
+static bool
+SmackLabelKeyEqual(const void *namea, const void *nameb)
+{
+    return STREQ(namea, nameb);
+}
+
+static void *
+SmackLabelKeyCopy(const void *name)
+{
+    /* Keys live in the slots */
+    return (void *) name;
+}
+
+static void
+SmackLabelKeyFree(void *name ATTRIBUTE_UNUSED)
+{
+}
+
+static int
+SmackLabelsOnceInit(void)
+{
+    size_t i;
+
+    for (i = 0; i < SMACK_LABEL_SHARDS; i++) {
+        SmackLabelShardPtr shard = &smackLabelShards[i];
+
+        if (virMutexInit(&shard->lock) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("unable to initialize smack driver mutex"));
+            return -1;
+        }
+
+        shard->free = -1;
+        if (!(shard->ids = virHashCreateFull(64, NULL,
+                                             SmackLabelKeyCode,
+                                             SmackLabelKeyEqual,
+                                             SmackLabelKeyCopy,
+                                             SmackLabelKeyFree)))
+            return -1;
+    }
+
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(SmackLabels)
+
+
+static SmackLabelShardPtr
+SmackLabelShardOf(const char *label)
+{
+    return &smackLabelShards[virHashCodeGen(label, strlen(label), 0) %
+                             SMACK_LABEL_SHARDS];
+}
+
+
+static SmackLabelSlotPtr
+SmackLabelSlotGet(SmackLabelShardPtr shard, int idx)
+{
+    return &shard->chunks[idx / SMACK_LABEL_CHUNK][idx % SMACK_LABEL_CHUNK];
+}
+
+
+/*
+ * Take a reference on @label, interning it if needed. Returns its id,
+ * or -1 with errno set if it is too long or memory ran out.
+ */
+static int
+SmackLabelIntern(const char *label)
+{
+    SmackLabelShardPtr shard;
+    SmackLabelSlotPtr slot;
+    void *ref;
+    int idx;
+    int id = -1;
+
+    if (SmackLabelsInitialize() < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (strlen(label) > SMACK_LABEL_LEN) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    shard = SmackLabelShardOf(label);
+
+    virMutexLock(&shard->lock);
+    if ((ref = virHashLookup(shard->ids, label))) {
+        id = (intptr_t) ref - 1;
+        SmackLabelSlotGet(shard, id >> SMACK_LABEL_SHARD_BITS)->refs++;
+        goto cleanup;
+    }
+
+    if (shard->free < 0) {
+        size_t i;
+
+        if (VIR_EXPAND_N_QUIET(shard->chunks, shard->nchunks, 1) < 0 ||
+            VIR_ALLOC_N_QUIET(shard->chunks[shard->nchunks - 1],
+                              SMACK_LABEL_CHUNK) < 0) {
+            if (shard->nchunks && !shard->chunks[shard->nchunks - 1])
+                shard->nchunks--;
+            errno = ENOMEM;
+            goto cleanup;
+        }
+
+        for (i = SMACK_LABEL_CHUNK; i > 0; i--) {
+            int freeidx = (shard->nchunks - 1) * SMACK_LABEL_CHUNK + i - 1;
+
+            SmackLabelSlotGet(shard, freeidx)->nextFree = shard->free;
+            shard->free = freeidx;
+        }
+    }
+
+    idx = shard->free;
+    slot = SmackLabelSlotGet(shard, idx);
+    strcpy(slot->name, label);
+    id = (idx << SMACK_LABEL_SHARD_BITS) | (shard - smackLabelShards);
+    if (virHashAddEntry(shard->ids, slot->name,
+                        (void *) (intptr_t) (id + 1)) < 0) {
+        virResetLastError();
+        errno = ENOMEM;
+        id = -1;
+        goto cleanup;
+    }
+
+    shard->free = slot->nextFree;
+    slot->refs = 1;
+
+cleanup:
+    virMutexUnlock(&shard->lock);
+    return id;
+}
+
+
+/*
+ * Whether the id @id, which the caller holds a reference on, is that
+ * of @label. Unlike comparing against an id looked up earlier, this
+ * can't be fooled by that id having been released and recycled.
+ */
+static bool
+SmackLabelIs(int id, const char *label)
+{
+    SmackLabelShardPtr shard;
+    bool ret;
+
+    shard = &smackLabelShards[id & (SMACK_LABEL_SHARDS - 1)];
+
+    virMutexLock(&shard->lock);
+    ret = STREQ(SmackLabelSlotGet(shard, id >> SMACK_LABEL_SHARD_BITS)->name,
+                label);
+    virMutexUnlock(&shard->lock);
+
+    return ret;
+}
+
+
+static void
+SmackLabelRelease(int id)
+{
+    SmackLabelShardPtr shard;
+    SmackLabelSlotPtr slot;
+    int idx;
+
+    if (id < 0)
+        return;
+
+    shard = &smackLabelShards[id & (SMACK_LABEL_SHARDS - 1)];
+    idx = id >> SMACK_LABEL_SHARD_BITS;
+
+    virMutexLock(&shard->lock);
+    slot = SmackLabelSlotGet(shard, idx);
+    if (--slot->refs == 0) {
+        ignore_value(virHashRemoveEntry(shard->ids, slot->name));
+        slot->name[0] = '\0';
+        slot->nextFree = shard->free;
+        shard->free = idx;
+    }
+    virMutexUnlock(&shard->lock);
+}
+
+
+/*
+ * Name of the extended attribute holding labels. Only an explicit
+ * virSmackSecuritySetXattrName() switches it to
+ * SECURITY_SMACK_USER_XATTR, so that the label primitives can be
+ * exercised on a host where Smack is not the active LSM; labels
+ * stored there are ignored by the kernel.
+ */
+static const char *smackXattrName = SECURITY_SMACK_XATTR;
+
+
+typedef struct _SmackFileHandle SmackFileHandle;
+typedef SmackFileHandle *SmackFileHandlePtr;
+
+/*
+ * What a label is read from or written to: a resolved file handle if
+ * @fh is set, else the descriptor @fd if it is not -1, else @path,
+ * whose last component is not followed if @nofollow is set.
+ */
+typedef struct _SmackLabelTarget SmackLabelTarget;
+
+struct _SmackLabelTarget {
+    SmackFileHandlePtr fh;
+    int fd;
+    const char *path;
+    bool nofollow;
+};
+
+static ssize_t SmackLabelSize(const SmackLabelTarget *target);
+static ssize_t SmackLabelGet(const SmackLabelTarget *target,
+                             char *buf, size_t buflen);
+static int SmackLabelSet(const SmackLabelTarget *target, const char *label);
+
+
+/*
+ * Optional instrumentation of the label primitives and driver entry
+ * points. While enabled each call accounts its wall clock time, in
+ * total and in a log2 histogram, and the syscalls and allocations made
+ * by this file on its behalf, from which callers derive ns/op,
+ * syscalls/op and allocations/op. Calls nested in one another each
+ * account for everything done below them. Allocations
+ * made inside libc, libsmack or the hash tables are not seen. A few
+ * events of interest are counted on their own. Disabled, the cost is a
+ * flag test per syscall.
+ *
+ * This is only the measurement side: no benchmark program or bench
+ * target ships with this driver, so whoever drives these primitives
+ * against tmpfs or ext4 images (with virSmackSecuritySetXattrName
+ * pointing at user.SMACK64 where Smack is not the active LSM) brings
+ * their own harness and reads the figures back from here.
+ */
+VIR_ENUM_IMPL(virSmackPrimitive, VIR_SMACK_PRIMITIVE_LAST,
+              "getfilelabel",
+              "setfilelabel",
+              "fgetfilelabel",
+              "fsetfilelabel",
+              "setsockcreate",
+              "set-file-label",
+              "restore-file-label",
+              "set-all-label",
+              "restore-all-label",
+              "set-hostdev-label",
+              "restore-hostdev-label",
+              "set-socket-label",
+              "clear-socket-label",
+              "get-process-label")
+
+VIR_ENUM_IMPL(virSmackCounter, VIR_SMACK_COUNTER_LAST,
+              "setxattr",
+              "getxattr",
+              "enotsup-fallback",
+              "shared-fs-probe")
+
+typedef struct _SmackStatsProbe SmackStatsProbe;
+typedef SmackStatsProbe *SmackStatsProbePtr;
+
+struct _SmackStatsProbe {
+    bool active;
+    /* probe of the call this one is nested in */
+    SmackStatsProbePtr parent;
+    struct timespec start;
+    unsigned long long syscalls;
+    unsigned long long allocs;
+};
+
+/* Off by default, see virSmackSecuritySetPrimitiveStats(); read and
+ * written through SMACK_STATS_ENABLED() and __atomic_store_n() only */
+static bool smackStatsEnabled;
+#define SMACK_STATS_ENABLED()                                   \
+    __atomic_load_n(&smackStatsEnabled, __ATOMIC_ACQUIRE)
+static virSmackPrimitiveStats smackPrimitiveStats[VIR_SMACK_PRIMITIVE_LAST];
+static unsigned long long smackCounters[VIR_SMACK_COUNTER_LAST];
+/* innermost probe of the calling thread */
+static virThreadLocal smackStatsProbe;
+
+static int
+SmackStatsOnceInit(void)
+{
+    if (virThreadLocalInit(&smackStatsProbe, NULL) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize thread local variable"));
+        return -1;
+    }
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(SmackStats)
+
+
+static void
+SmackStatsCount(bool alloc)
+{
+    SmackStatsProbePtr probe;
+
+    for (probe = virThreadLocalGet(&smackStatsProbe); probe;
+         probe = probe->parent) {
+        if (alloc)
+            probe->allocs++;
+        else
+            probe->syscalls++;
+    }
+}
+
+#define SMACK_COUNT_SYSCALL()                                   \
+    do {                                                        \
+        if (SMACK_STATS_ENABLED())                              \
+            SmackStatsCount(false);                             \
+    } while (0)
+
+#define SMACK_COUNT_ALLOC()                                     \
+    do {                                                        \
+        if (SMACK_STATS_ENABLED())                              \
+            SmackStatsCount(true);                              \
+    } while (0)
+
+/* Evaluates to the result of @call, counting it as one syscall */
+#define SMACK_SYSCALL(call)                                     \
+    ((SMACK_STATS_ENABLED() ? SmackStatsCount(false) : (void) 0), (call))
+
+#define SMACK_COUNT_EVENT(counter)                              \
+    do {                                                        \
+        if (SMACK_STATS_ENABLED())                              \
+            __sync_fetch_and_add(&smackCounters[counter], 1);   \
+    } while (0)
+
+
+/*
+ * USDT tracepoints of the libvirt_smack provider, a single nop each
+ * until a tracer attaches:
+ *
+ *   callback__entry(name, uuid, path), callback__return(name, uuid,
+ *   ret, errno) around every domain callback of the driver, uuid being
+ *   the raw 16 bytes and path NULL when there is none;
+ *   label__get(path, fd, ret, errno), label__set(path, fd, label, ret,
+ *   errno) around each label read or write, fd being -1 for paths;
+ *   attr__get(pid, ret, errno), attr__set(attr, label, ret, errno)
+ *   around each /proc attr access.
+ */
+#if HAVE_SYS_SDT_H
+# define SMACK_PROBE3(name, a, b, c)                             \
+    DTRACE_PROBE3(libvirt_smack, name, a, b, c)
+# define SMACK_PROBE4(name, a, b, c, d)                          \
+    DTRACE_PROBE4(libvirt_smack, name, a, b, c, d)
+# define SMACK_PROBE5(name, a, b, c, d, e)                       \
+    DTRACE_PROBE5(libvirt_smack, name, a, b, c, d, e)
+#else
+# define SMACK_PROBE3(name, a, b, c) do { } while (0)
+# define SMACK_PROBE4(name, a, b, c, d) do { } while (0)
+# define SMACK_PROBE5(name, a, b, c, d, e) do { } while (0)
+#endif
+
+#define SMACK_TRACE_ENTRY(cb, def, path)                        \
+    SMACK_PROBE3(callback__entry, cb, (def)->uuid,              \
+                 (const char *) (path))
+#define SMACK_TRACE_RETURN(cb, def, ret)                        \
+    SMACK_PROBE4(callback__return, cb, (def)->uuid, ret, errno)
+
+
+static void
+SmackStatsBegin(SmackStatsProbePtr probe)
+{
+    memset(probe, 0, sizeof(*probe));
+
+    if (!SMACK_STATS_ENABLED())
+        return;
 
-	return name;
+    probe->parent = virThreadLocalGet(&smackStatsProbe);
+    if (virThreadLocalSet(&smackStatsProbe, probe) < 0)
+        return;
+
+    probe->active = true;
+    clock_gettime(CLOCK_MONOTONIC, &probe->start);
+}
+
+
+static void
+SmackStatsEnd(virSmackPrimitive prim,
+              SmackStatsProbePtr probe)
+{
+    virSmackPrimitiveStatsPtr stats = &smackPrimitiveStats[prim];
+    int saved_errno = errno;
+    struct timespec now;
+    unsigned long long ns;
+    unsigned long long us;
+    size_t bucket;
+
+    if (!probe->active)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ignore_value(virThreadLocalSet(&smackStatsProbe, probe->parent));
+
+    ns = (now.tv_sec - probe->start.tv_sec) * 1000000000ULL +
+        now.tv_nsec - probe->start.tv_nsec;
+    /* Bucket i > 0 holds calls of [2^(i-1), 2^i) us, the last one
+     * everything longer */
+    us = ns / 1000;
+    bucket = us ? MIN(64 - __builtin_clzll(us),
+                      VIR_SMACK_STATS_HIST_BUCKETS - 1) : 0;
+
+    __sync_fetch_and_add(&stats->calls, 1);
+    __sync_fetch_and_add(&stats->ns, ns);
+    __sync_fetch_and_add(&stats->hist[bucket], 1);
+    __sync_fetch_and_add(&stats->syscalls, probe->syscalls);
+    __sync_fetch_and_add(&stats->allocs, probe->allocs);
+
+    errno = saved_errno;
+}
+
+
+/*
+ * The *_r variants read a label into a caller supplied buffer of
+ * @buflen bytes, typically char[SMACK_LABEL_LEN + 1] on the stack.
+ * The result is always NUL terminated. They return the label length,
+ * or -1 with errno set; a label not fitting in @buflen gives ERANGE.
+ */
+ssize_t getfilelabel_r(const char *path, char *buf, size_t buflen)
+{
+    SmackLabelTarget target = { .fd = -1, .path = path };
+
+    return SmackLabelGet(&target, buf, buflen);
+}
+
+ssize_t fgetfilelabel_r(int fd, char *buf, size_t buflen)
+{
+    SmackLabelTarget target = { .fd = fd };
+
+    return SmackLabelGet(&target, buf, buflen);
 }
 
 
-int getfilelabel(const char *path, char ** label)
+static int getfilelabelInt(const char *path, char ** label)
 {
 	char *buf;
 	ssize_t size;
 	ssize_t ret;
 
 	size = SMACK_LABEL_LEN + 1;
+	SMACK_COUNT_ALLOC();
 	buf = malloc(size);
         if(!buf)
 		return -1;
-	memset(buf,0,size);
 
-	ret = getxattr(path,"security.SMACK64", buf, size - 1);
+	ret = getfilelabel_r(path, buf, size);
 	if (ret < 0 && errno == ERANGE) {
+		SmackLabelTarget target = { .fd = -1, .path = path };
 		char *newbuf;
 
-		size = getxattr(path,"security.SMACK64", NULL, 0);
+		size = SmackLabelSize(&target);
 		if(size < 0)
 			goto out;
 
 		size++;
+		SMACK_COUNT_ALLOC();
 		newbuf = realloc(buf,size);
 		if(!newbuf)
 			goto out;
 
 		buf = newbuf;
-		memset(buf,0,size);
-		ret = getxattr(path,"security.SMACK64",buf,size - 1);
+		ret = getfilelabel_r(path, buf, size);
 	}
      out:
-	if (ret == 0) {
-		 /* Re-map empty attribute values to errors. */
-                  errno = ENOTSUP;
-                  ret = -1;
-	}
 	if (ret < 0)
 		free(buf);
 	else
@@ -127,61 +789,79 @@ int getfilelabel(const char *path, char ** label)
 	return ret;
 }
 
-int setfilelabel(const char *path,const char * label)
+int getfilelabel(const char *path, char **label)
 {
-  int ret = setxattr(path,"security.SMACK64",label,strlen(label)+ 1,0);
-   
+    SmackStatsProbe probe;
+    int ret;
+
+    SmackStatsBegin(&probe);
+    ret = getfilelabelInt(path, label);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_GETFILELABEL, &probe);
+    return ret;
+}
+
+static int setfilelabelInt(const char *path,const char * label)
+{
+  SmackLabelTarget target = { .fd = -1, .path = path };
+  int ret = SmackLabelSet(&target, label);
+
   if (ret < 0 && errno == ENOTSUP) {
-	  char * clabel = NULL;
+	  char clabel[SMACK_LABEL_LEN + 1];
 	  int err = errno;
-	  if ((getfilelabel(path,&clabel) >= 0) &&
+	  if ((getfilelabel_r(path, clabel, sizeof(clabel)) >= 0) &&
 	      (strcmp(label,clabel) == 0)) {
 		  ret = 0;
 	  }else{
 		  errno = err;
 	  }
-	  free(clabel);
   }
   return ret;
  
 }
 
+int setfilelabel(const char *path, const char *label)
+{
+    SmackStatsProbe probe;
+    int ret;
+
+    SmackStatsBegin(&probe);
+    ret = setfilelabelInt(path, label);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_SETFILELABEL, &probe);
+    return ret;
+}
+
 
-int fgetfilelabel(int fd,char ** label)
+static int fgetfilelabelInt(int fd,char ** label)
 {
 	char *buf;
 	ssize_t size;
 	ssize_t ret;
 
 	size = SMACK_LABEL_LEN + 1;
+	SMACK_COUNT_ALLOC();
 	buf = malloc(size);
         if(!buf)
 		return -1;
-	memset(buf,0,size);
 
-	ret = fgetxattr(fd,"security.SMACK64", buf, size - 1);
+	ret = fgetfilelabel_r(fd, buf, size);
 	if (ret < 0 && errno == ERANGE) {
+		SmackLabelTarget target = { .fd = fd };
 		char *newbuf;
 
-		size = fgetxattr(fd,"security.SMACK64", NULL, 0);
+		size = SmackLabelSize(&target);
 		if(size < 0)
 			goto out;
 
 		size++;
+		SMACK_COUNT_ALLOC();
 		newbuf = realloc(buf,size);
 		if(!newbuf)
 			goto out;
 
 		buf = newbuf;
-		memset(buf,0,size);
-		ret = fgetxattr(fd,"security.SMACK64",buf,size - 1);
+		ret = fgetfilelabel_r(fd, buf, size);
 	}
      out:
-	if (ret == 0) {
-		 /* Re-map empty attribute values to errors. */
-                  errno = ENOTSUP;
-                  ret = -1;
-	}
 	if (ret < 0)
 		free(buf);
 	else
@@ -189,100 +869,418 @@ int fgetfilelabel(int fd,char ** label)
 	return ret;
 }
 
-int fsetfilelabel(int fd,const char * label)
+int fgetfilelabel(int fd, char **label)
 {
-  int ret = fsetxattr(fd,"security.SMACK64",label,strlen(label)+ 1,0);
-   
+    SmackStatsProbe probe;
+    int ret;
+
+    SmackStatsBegin(&probe);
+    ret = fgetfilelabelInt(fd, label);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_FGETFILELABEL, &probe);
+    return ret;
+}
+
+static int fsetfilelabelInt(int fd,const char * label)
+{
+  SmackLabelTarget target = { .fd = fd };
+  int ret = SmackLabelSet(&target, label);
+
   if (ret < 0 && errno == ENOTSUP) {
-	  char * clabel = NULL;
+	  char clabel[SMACK_LABEL_LEN + 1];
 	  int err = errno;
-	  if ((fgetfilelabel(fd,&clabel) >= 0) &&
+	  if ((fgetfilelabel_r(fd, clabel, sizeof(clabel)) >= 0) &&
 	      (strcmp(label,clabel) == 0)) {
 		  ret = 0;
 	  }else{
 		  errno = err;
 	  }
-	  free(clabel);
   }
   return ret;
 }
 
-static int getpidlabel(pid_t pid,char **label)
+int fsetfilelabel(int fd, const char *label)
 {
+    SmackStatsProbe probe;
+    int ret;
 
-        char *result;
-        int fd;
-        int ret;
-        char *path;
+    SmackStatsBegin(&probe);
+    ret = fsetfilelabelInt(fd, label);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_FSETFILELABEL, &probe);
+    return ret;
+}
 
-        result = calloc(SMACK_LABEL_LEN + 1,1);
-        if(result == NULL)
-	    return -1;
-        ret = virAsprintf(&path,"/proc/%d/attr/current",pid);
-        if (ret < 0)
-	    return -1;
-        fd = open(path,O_RDONLY);
-        VIR_FREE(path);
-        if (fd < 0){
-	    free(result);
-	    return -1;
+/*
+ * Read the start time of @pid, in clock ticks since boot, from its
+ * stat file under @procfd, or the absolute /proc path if @procfd is
+ * AT_FDCWD.
+ */
+static int
+SmackProcessStartTime(int procfd, pid_t pid, unsigned long long *starttime)
+{
+    char path[sizeof("/proc//stat") + VIR_INT64_STR_BUFLEN];
+    char buf[1024];
+    char *p;
+    ssize_t len;
+    size_t i;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%lld/stat",
+             procfd == AT_FDCWD ? "/proc/" : "", (long long) pid);
+
+    if ((fd = openat(procfd, path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    len = saferead(fd, buf, sizeof(buf) - 1);
+    VIR_FORCE_CLOSE(fd);
+    if (len < 0)
+        return -1;
+    buf[len] = '\0';
+
+    /* The command name may contain anything, so fields are counted
+     * from its closing parenthesis; starttime is field 22 */
+    if (!(p = strrchr(buf, ')')))
+        goto error;
+    for (i = 0; i < 20; i++) {
+        if (!(p = strchr(p + 1, ' ')))
+            goto error;
+    }
+
+    if (virStrToLong_ull(p + 1, &p, 10, starttime) < 0)
+        goto error;
+    return 0;
+
+error:
+    errno = EINVAL;
+    return -1;
+}
+
+
+/*
+ * Read the label of @pid through the /proc directory @procfd, or the
+ * absolute /proc path if @procfd is AT_FDCWD. Unless @starttime is 0,
+ * the process must have been started at @starttime, as recorded by
+ * the caller, or ESRCH is returned: the attr file is opened first and
+ * the start time read afterwards, so a PID recycled at any point can't
+ * hand back the label of an unrelated process.
+ */
+static ssize_t
+getpidlabelat(int procfd, pid_t pid, unsigned long long starttime,
+              char *buf, size_t buflen)
+{
+    char path[sizeof("/proc//attr/current") + VIR_INT64_STR_BUFLEN];
+    unsigned long long started;
+    int fd = -1;
+    ssize_t ret = -1;
+
+    if (buflen < 2) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s%lld/attr/current",
+             procfd == AT_FDCWD ? "/proc/" : "", (long long) pid);
+
+    if ((fd = openat(procfd, path, O_RDONLY | O_CLOEXEC)) < 0)
+        goto cleanup;
+
+    if (starttime) {
+        if (SmackProcessStartTime(procfd, pid, &started) < 0) {
+            if (errno == ENOENT)
+                errno = ESRCH;
+            goto cleanup;
         }
-        ret = read(fd,result,SMACK_LABEL_LEN);
-        close(fd);
-        if(ret < 0){
-	    free(result);
-	    return -1;
+        if (started != starttime) {
+            errno = ESRCH;
+            goto cleanup;
         }
-        *label = result;
-        return ret;
+    }
 
+    if ((ret = saferead(fd, buf, buflen - 1)) >= 0)
+        buf[ret] = '\0';
+
+cleanup:
+    SMACK_PROBE3(attr__get, (long long) pid, ret, errno);
+    VIR_FORCE_CLOSE(fd);
+    return ret;
 }
-	 
-	 
 
-int setsockcreate(const char *label,const char *attr)
+
+static ssize_t
+getpidlabel_r(pid_t pid, char *buf, size_t buflen)
 {
-        int fd;
-        int ret = -1;
-	long int tid;
-        char *path;
-	tid = syscall(SYS_gettid);
-        ret = virAsprintf(&path,"/proc/self/task/%ld/attr/%s",tid,attr);
-        if (ret < 0)
-	    return -1;
+    return getpidlabelat(AT_FDCWD, pid, 0, buf, buflen);
+}
 
-    VIR_DEBUG("setsockcreate pid is in %d",getpid());
-    VIR_DEBUG("real user ID is in %d",getuid());
-    VIR_DEBUG("effective user ID is in %d",geteuid());
-    VIR_DEBUG("label from self %s",label);
-    VIR_DEBUG("location /proc/self/attr/%s",attr);
-       
-        if (label){
-                    fd = open(path,O_WRONLY | O_CLOEXEC);
-		    VIR_DEBUG("open file %s",path);
-                    VIR_FREE(path);
-                    if (fd < 0)
-		    {
-		    VIR_DEBUG("open faile");
-	                  return -1;
-		    }
-		    VIR_DEBUG("open success");
-		do {
-                      ret = write(fd,label,strlen(label) + 1);
-		}while(ret < 0 && errno == EINTR);
-	}
-	else { 
-                    fd = open(path,O_TRUNC);
-                    VIR_FREE(path);
-                    if (fd < 0)
-	                  return -1;
-		    ret = 0;
-	}
-  
-        close(fd);
 
-        return (ret < 0) ? -1 : 0;
 
+/*
+ * Self attributes. Kernels with the LSM syscalls (lsm_get_self_attr
+ * and lsm_set_self_attr, Linux 6.8) let the "current" label of the
+ * calling thread be read and written without any /proc round-trip.
+ * They only cover the generic LSM attributes though, so the Smack
+ * specific sockincreate/sockoutcreate go through per-thread
+ * descriptors of /proc/self/task/<tid>/attr/, opened once per thread.
+ */
+#if defined(SYS_lsm_get_self_attr) && defined(SYS_lsm_set_self_attr)
+# define SMACK_HAVE_LSM_SYSCALLS 1
+# define SMACK_LSM_ID_SMACK         102
+# define SMACK_LSM_ATTR_CURRENT     100
+# define SMACK_LSM_FLAG_SINGLE      0x0001
+
+/* struct lsm_ctx of the LSM syscalls */
+struct SmackLsmCtx {
+    uint64_t id;
+    uint64_t flags;
+    uint64_t len;
+    uint64_t ctx_len;
+    char ctx[SMACK_LABEL_LEN + 1];
+};
+
+/* Whether the running kernel has the LSM syscalls, see
+ * SmackSyscallsOnceInit() */
+static bool smackHaveLsmSyscalls;
+#endif
+
+
+static void
+SmackLsmSyscallsProbe(void)
+{
+#ifdef SMACK_HAVE_LSM_SYSCALLS
+    uint32_t size = 0;
+
+    /* Asking for the size only: E2BIG means the syscall is there */
+    smackHaveLsmSyscalls =
+        syscall(SYS_lsm_get_self_attr, SMACK_LSM_ATTR_CURRENT,
+                NULL, &size, 0) >= 0 || errno == E2BIG;
+    VIR_DEBUG("LSM self attr syscalls %savailable",
+              smackHaveLsmSyscalls ? "" : "not ");
+#endif
+}
+
+
+static int
+SmackSetSelfLabel(const char *label)
+{
+#ifdef SMACK_HAVE_LSM_SYSCALLS
+    if (smackHaveLsmSyscalls) {
+        struct SmackLsmCtx ctx;
+
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.id = SMACK_LSM_ID_SMACK;
+        if (virStrcpyStatic(ctx.ctx, label) == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        ctx.ctx_len = strlen(label) + 1;
+        ctx.len = offsetof(struct SmackLsmCtx, ctx) + ctx.ctx_len;
+
+        return SMACK_SYSCALL(syscall(SYS_lsm_set_self_attr,
+                                     SMACK_LSM_ATTR_CURRENT,
+                                     &ctx, (uint32_t) ctx.len, 0));
+    }
+#endif
+
+    return smack_set_label_for_self(label);
+}
+
+
+/*
+ * Read the label of the calling thread into @buf of @buflen bytes.
+ */
+static int
+SmackGetSelfLabel(char *buf, size_t buflen)
+{
+    char *label = NULL;
+
+#ifdef SMACK_HAVE_LSM_SYSCALLS
+    if (smackHaveLsmSyscalls) {
+        struct SmackLsmCtx ctx;
+        uint32_t size = sizeof(ctx);
+
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.id = SMACK_LSM_ID_SMACK;
+        if (syscall(SYS_lsm_get_self_attr, SMACK_LSM_ATTR_CURRENT,
+                    &ctx, &size, SMACK_LSM_FLAG_SINGLE) < 0)
+            return -1;
+
+        ctx.ctx[MIN(ctx.ctx_len, sizeof(ctx.ctx) - 1)] = '\0';
+        if (virStrcpy(buf, ctx.ctx, buflen) == NULL) {
+            errno = ERANGE;
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    if (smack_new_label_from_self(&label) < 0)
+        return -1;
+
+    if (virStrcpy(buf, label, buflen) == NULL) {
+        free(label);
+        errno = ERANGE;
+        return -1;
+    }
+
+    free(label);
+    return 0;
+}
+
+
+typedef struct _SmackThreadAttrFds SmackThreadAttrFds;
+typedef SmackThreadAttrFds *SmackThreadAttrFdsPtr;
+
+struct _SmackThreadAttrFds {
+    /* thread the descriptors belong to, they are stale in a child
+     * forked off this thread; opened O_CLOEXEC so exec drops them */
+    pid_t tid;
+    int sockincreate;
+    int sockoutcreate;
+};
+
+static virThreadLocal smackThreadAttrFds;
+
+static void
+SmackThreadAttrFdsFree(void *opaque)
+{
+    SmackThreadAttrFdsPtr fds = opaque;
+
+    if (!fds)
+        return;
+
+    VIR_FORCE_CLOSE(fds->sockincreate);
+    VIR_FORCE_CLOSE(fds->sockoutcreate);
+    VIR_FREE(fds);
+}
+
+static int
+SmackThreadAttrOnceInit(void)
+{
+    if (virThreadLocalInit(&smackThreadAttrFds, SmackThreadAttrFdsFree) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize thread local variable"));
+        return -1;
+    }
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(SmackThreadAttr)
+
+
+static int
+SmackOpenThreadAttr(pid_t tid, const char *attr, int flags)
+{
+    char path[sizeof("/proc/self/task//attr/sockoutcreate") +
+              VIR_INT64_STR_BUFLEN];
+
+    if (snprintf(path, sizeof(path), "/proc/self/task/%lld/attr/%s",
+                 (long long) tid, attr) >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return SMACK_SYSCALL(open(path, flags | O_CLOEXEC));
+}
+
+
+/*
+ * Return this thread's cached descriptor for @attr, opening it on
+ * first use, or -2 if @attr is not one that is cached.
+ */
+static int
+SmackGetThreadAttrFd(const char *attr)
+{
+    SmackThreadAttrFdsPtr fds;
+    pid_t tid = SMACK_SYSCALL(syscall(SYS_gettid));
+    int *fdp;
+
+    if (SmackThreadAttrInitialize() < 0)
+        return -1;
+
+    if (!(fds = virThreadLocalGet(&smackThreadAttrFds)) ||
+        fds->tid != tid) {
+        /* Forked children inherit the parent thread's descriptors,
+         * which point to the parent's task; closing the child's copies
+         * leaves the parent's alone */
+        if (!fds) {
+            SMACK_COUNT_ALLOC();
+            if (VIR_ALLOC(fds) < 0)
+                return -1;
+        } else {
+            VIR_FORCE_CLOSE(fds->sockincreate);
+            VIR_FORCE_CLOSE(fds->sockoutcreate);
+        }
+        fds->tid = tid;
+        fds->sockincreate = -1;
+        fds->sockoutcreate = -1;
+        if (virThreadLocalSet(&smackThreadAttrFds, fds) < 0) {
+            SmackThreadAttrFdsFree(fds);
+            return -1;
+        }
+    }
+
+    if (STREQ(attr, "sockincreate"))
+        fdp = &fds->sockincreate;
+    else if (STREQ(attr, "sockoutcreate"))
+        fdp = &fds->sockoutcreate;
+    else
+        return -2;
+
+    if (*fdp < 0)
+        *fdp = SmackOpenThreadAttr(tid, attr, O_WRONLY);
+
+    return *fdp;
+}
+
+
+/* Written to a socket label attribute to reset it; procfs attr files
+ * ignore truncation */
+#define SMACK_ATTR_CLEAR "-"
+
+static int setsockcreateInt(const char *label,const char *attr)
+{
+    const char *value = label ? label : SMACK_ATTR_CLEAR;
+    ssize_t ret;
+    int fd;
+
+    VIR_DEBUG("label=%s attr=%s", NULLSTR(label), attr);
+
+    if (label && STREQ(attr, "current"))
+        return SmackSetSelfLabel(label);
+
+    if ((fd = SmackGetThreadAttrFd(attr)) == -1)
+        return -1;
+
+    if (fd == -2) {
+        /* Not a cached attribute, open it just for this call */
+        if ((fd = SmackOpenThreadAttr(SMACK_SYSCALL(syscall(SYS_gettid)),
+                                      attr, O_WRONLY)) < 0)
+            return -1;
+
+        do {
+            ret = SMACK_SYSCALL(write(fd, value, strlen(value) + 1));
+        } while (ret < 0 && errno == EINTR);
+        SMACK_COUNT_SYSCALL();
+        VIR_FORCE_CLOSE(fd);
+        return (ret < 0) ? -1 : 0;
+    }
+
+    /* procfs refuses attr writes at a non-zero offset */
+    do {
+        ret = SMACK_SYSCALL(pwrite(fd, value, strlen(value) + 1, 0));
+    } while (ret < 0 && errno == EINTR);
+
+    return (ret < 0) ? -1 : 0;
+}
+
+int setsockcreate(const char *label, const char *attr)
+{
+    SmackStatsProbe probe;
+    int ret;
+
+    SmackStatsBegin(&probe);
+    ret = setsockcreateInt(label, attr);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_SETSOCKCREATE, &probe);
+    SMACK_PROBE4(attr__set, attr, label, ret, errno);
+    return ret;
 }
 
 
@@ -331,553 +1329,4569 @@ int setsockcreate(const char *label,const char *attr)
  */
 
 
-static int
-SmackSetFileLabelHelper(const char *path, const char *tlabel)
+#define SMACK_INODE_KEY_BUFLEN (2 * VIR_INT64_STR_BUFLEN + 2)
+
+static void
+SmackFormatDevInoKey(unsigned long long dev,
+                     unsigned long long ino,
+                     char *key)
 {
-   char * elabel = NULL;
-   
-   VIR_INFO("Setting Smack label on '%s' to '%s'", path, tlabel);
+    snprintf(key, SMACK_INODE_KEY_BUFLEN, "%llx:%llx", dev, ino);
+}
 
-       if (setfilelabel(path, tlabel) < 0) {
-	   int setfilelabel_errno = errno;
+static void
+SmackFormatInodeKey(const struct stat *sb, char *key)
+{
+    SmackFormatDevInoKey(sb->st_dev, sb->st_ino, key);
+}
 
-	   if (getfilelabel(path, &elabel) >= 0) {
-	       if (STREQ(tlabel, elabel)) {
-	           free(elabel);
-       /* It's alright, there's nothing to change anyway. */
-		   return 0;
-	   }
-	   free(elabel);
-       }
 
-       /* if the error complaint is related to an image hosted on
-        * an nfs mount, or a usbfs/sysfs filesystem not supporting
-        * labelling, then just ignore it & hope for the best.
-        */
+static void
+SmackLabelCacheEntryFree(void *payload, const void *name ATTRIBUTE_UNUSED)
+{
+    virSmackLabelCacheEntryPtr entry = payload;
 
-       if (setfilelabel_errno != EOPNOTSUPP && setfilelabel_errno != ENOTSUP) {
-	   virReportSystemError(setfilelabel_errno,
-	                        _("unable to set security context '%s' on '%s'"),
-	                        tlabel, path);
-	       return -1;
+    SmackLabelRelease(entry->label);
+    VIR_FREE(entry);
+}
 
-       } else {
-	        const char *msg;
-		if ((virStorageFileIsSharedFSType(path, VIR_STORAGE_FILE_SHFS_NFS) == 1)) { 
-                    msg = _("Setting security context '%s' on '%s' not supported. ");
-                    VIR_WARN(msg, tlabel, path);
-        	} else { 
-                    VIR_INFO("Setting security context '%s' on '%s' not supported",tlabel,path );
 
-         	} 
+static int
+SmackLabelCacheInit(virSmackSecurityDataPtr priv)
+{
+    size_t i;
 
-      }
+    for (i = 0; i < SMACK_LABEL_CACHE_SHARDS; i++) {
+        virSmackLabelCacheShardPtr shard = &priv->labelCache[i];
 
-   }
-   return 0;
+        if (virMutexInit(&shard->lock) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("unable to initialize label cache mutex"));
+            goto error;
+        }
 
-}
+        if (!(shard->entries = virHashCreate(32, SmackLabelCacheEntryFree))) {
+            virMutexDestroy(&shard->lock);
+            goto error;
+        }
+    }
 
-static int
-SmackSetFileLabel(const char *path,const char *label)
-{
-   return SmackSetFileLabelHelper(path,label);
-}
+    return 0;
 
+error:
+    while (i-- > 0) {
+        virHashFree(priv->labelCache[i].entries);
+        priv->labelCache[i].entries = NULL;
+        virMutexDestroy(&priv->labelCache[i].lock);
+    }
+    return -1;
+}
 
 
-static int
-SmackSetSecurityHostdevLabelHelper(const char *file,void *opaque)
+static void
+SmackLabelCacheFree(virSmackSecurityDataPtr priv)
 {
-    virSecurityLabelDefPtr seclabel;
-    virDomainDefPtr def = opaque;
+    size_t i;
 
-    seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
-    if (seclabel == NULL)
-	return -1;
-    return SmackSetFileLabel(file, seclabel->imagelabel);
+    for (i = 0; i < SMACK_LABEL_CACHE_SHARDS; i++) {
+        virSmackLabelCacheShardPtr shard = &priv->labelCache[i];
+
+        if (!shard->entries)
+            continue;
+        virHashFree(shard->entries);
+        shard->entries = NULL;
+        virMutexDestroy(&shard->lock);
+    }
 }
 
 
-static int
-SmackSetSecurityUSBLabel(virUSBDevicePtr dev ATTRIBUTE_UNUSED,
-		         const char *file, void *opaque)
+static virSmackLabelCacheShardPtr
+SmackLabelCacheShard(virSmackSecurityDataPtr priv,
+                     const struct stat *sb)
 {
-    return SmackSetSecurityHostdevLabelHelper(file,opaque);
+    return &priv->labelCache[(sb->st_ino ^ sb->st_dev) %
+                             SMACK_LABEL_CACHE_SHARDS];
 }
 
 
-static int
-SmackSetSecurityPCILabel(virPCIDevicePtr dev ATTRIBUTE_UNUSED,
-		         const char *file, void *opaque)
+/*
+ * Returns true if @label is known to be the current label of the
+ * inode described by @sb, i.e. relabeling it would be a no-op.
+ */
+static bool
+SmackLabelCacheLookup(virSmackSecurityDataPtr priv,
+                      const struct stat *sb,
+                      const char *label)
 {
-    return SmackSetSecurityHostdevLabelHelper(file, opaque);
+    virSmackLabelCacheShardPtr shard = SmackLabelCacheShard(priv, sb);
+    char key[SMACK_INODE_KEY_BUFLEN];
+    virSmackLabelCacheEntryPtr entry;
+    bool hit = false;
+
+    SmackFormatInodeKey(sb, key);
+
+    virMutexLock(&shard->lock);
+    if (!(entry = virHashLookup(shard->entries, key)))
+        goto cleanup;
+
+    if (entry->ctime.tv_sec != sb->st_ctim.tv_sec ||
+        entry->ctime.tv_nsec != sb->st_ctim.tv_nsec) {
+        /* Inode changed behind our back, the cached label is stale */
+        virHashRemoveEntry(shard->entries, key);
+        __sync_fetch_and_add(&priv->cacheInvalidations, 1);
+        goto cleanup;
+    }
+
+    /* The entry holds a reference, so its label can't go away */
+    hit = SmackLabelIs(entry->label, label);
+
+cleanup:
+    virMutexUnlock(&shard->lock);
+    __sync_fetch_and_add(hit ? &priv->cacheHits : &priv->cacheMisses, 1);
+    return hit;
 }
 
-static int
-SmackSetSecuritySCSILabel(virSCSIDevicePtr dev ATTRIBUTE_UNUSED,
-		          const char *file, void *opaque)
+
+static void
+SmackLabelCacheUpdate(virSmackSecurityDataPtr priv,
+                      const struct stat *sb,
+                      const char *label)
 {
-    return SmackSetSecurityHostdevLabelHelper(file, opaque);
+    virSmackLabelCacheShardPtr shard = SmackLabelCacheShard(priv, sb);
+    char key[SMACK_INODE_KEY_BUFLEN];
+    virSmackLabelCacheEntryPtr entry;
+
+    SMACK_COUNT_ALLOC();
+    if (VIR_ALLOC(entry) < 0)
+        return;
+    if ((entry->label = SmackLabelIntern(label)) < 0) {
+        VIR_FREE(entry);
+        return;
+    }
+    entry->ctime = sb->st_ctim;
+
+    SmackFormatInodeKey(sb, key);
+
+    virMutexLock(&shard->lock);
+    if (virHashSize(shard->entries) >=
+        SMACK_LABEL_CACHE_MAX / SMACK_LABEL_CACHE_SHARDS) {
+        __sync_fetch_and_add(&priv->cacheInvalidations,
+                             virHashSize(shard->entries));
+        virHashRemoveAll(shard->entries);
+    }
+    if (virHashUpdateEntry(shard->entries, key, entry) < 0)
+        SmackLabelCacheEntryFree(entry, NULL);
+    virMutexUnlock(&shard->lock);
 }
 
 
-static int
-SmackRestoreSecurityFileLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-		              const char *path)
+static void
+SmackLabelCacheInvalidate(virSmackSecurityDataPtr priv,
+                          const struct stat *sb)
 {
-      struct stat buf;
-      int ret = -1;
-      char *newpath = NULL;
-      char ebuf[1024];
+    virSmackLabelCacheShardPtr shard = SmackLabelCacheShard(priv, sb);
+    char key[SMACK_INODE_KEY_BUFLEN];
 
-      VIR_INFO("Restoring Smack label on '%s'", path);
+    SmackFormatInodeKey(sb, key);
 
-      if (virFileResolveLink(path, &newpath) < 0) {
-             VIR_WARN("cannot resolve symlink %s: %s", path,
-                      virStrerror(errno, ebuf, sizeof(ebuf)));
-             goto err;
-     }
+    virMutexLock(&shard->lock);
+    if (virHashRemoveEntry(shard->entries, key) == 0)
+        __sync_fetch_and_add(&priv->cacheInvalidations, 1);
+    virMutexUnlock(&shard->lock);
+}
 
-      if (stat(newpath, &buf) != 0) {
-          VIR_WARN("cannot stat %s: %s", newpath,
-                   virStrerror(errno, ebuf, sizeof(ebuf)));
-          goto err;
-     }
 
-      ret = SmackSetFileLabel(newpath,"smack-unused");
+/*
+ * Files are resolved exactly once into an O_PATH descriptor, every
+ * later stat and label operation then runs on that descriptor so that
+ * deep NFS or device-mapper paths are not walked over and over, and a
+ * path swapped in the meantime can't redirect a relabel. O_PATH
+ * descriptors can't be used with f*xattr(), so labels are accessed
+ * through the descriptor's /proc/self/fd entry, relative to a cached
+ * directory descriptor with *xattrat() if the kernel has them.
+ */
 
-	  /*
-           *ret = setxattr(def->disks[i]->src,"security.SMACK64","smack-unused",strlen("smack-unused") + 1,0);
-	   */
-err:
-     VIR_FREE(newpath);
-     return ret;
-}
+#ifndef NFS_SUPER_MAGIC
+# define NFS_SUPER_MAGIC 0x6969
+#endif
 
+#ifdef SYS_openat2
+/* struct open_how of openat2(2), kept local to not need new headers */
+struct SmackOpenHow {
+    uint64_t flags;
+    uint64_t mode;
+    uint64_t resolve;
+};
+# define SMACK_RESOLVE_NO_MAGICLINKS 0x02
 
-static int
-SmackRestoreSecurityUSBLabel(virUSBDevicePtr dev ATTRIBUTE_UNUSED,
-		             const char *file,
-			     void *opaque)
-{
-    virSecurityManagerPtr mgr = opaque;
+/* Whether the running kernel has openat2, see SmackSyscallsOnceInit() */
+static bool smackHaveOpenat2;
+#endif
 
-    return SmackRestoreSecurityFileLabel(mgr,file);
-}
+#if defined(SYS_setxattrat) && defined(SYS_getxattrat)
+# define SMACK_HAVE_XATTRAT 1
+/* struct xattr_args of setxattrat(2) and getxattrat(2) */
+struct SmackXattrArgs {
+    uint64_t value;
+    uint32_t size;
+    uint32_t flags;
+};
 
-static int
-SmackRestoreSecurityPCILabel(virPCIDevicePtr dev ATTRIBUTE_UNUSED,
-		             const char *file,
-			     void *opaque)
-{
-    virSecurityManagerPtr mgr = opaque;
+static bool smackHaveXattrat;
+#endif
 
-    return SmackRestoreSecurityFileLabel(mgr,file);
-}
 
+/*
+ * Optional syscalls are probed once per process, before any thread can
+ * use them, and the flags are only read afterwards. A syscall failing
+ * with ENOSYS later on (e.g. filtered by seccomp) just takes the
+ * fallback for that call.
+ */
 static int
-SmackRestoreSecuritySCSILabel(virSCSIDevicePtr dev ATTRIBUTE_UNUSED,
-		              const char *file,
-			      void *opaque)
+SmackSyscallsOnceInit(void)
 {
-     virSecurityManagerPtr mgr = opaque;
+    SmackLsmSyscallsProbe();
+
+#ifdef SYS_openat2
+    {
+        struct SmackOpenHow how = {
+            .flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC,
+        };
+        int fd = syscall(SYS_openat2, AT_FDCWD, "/", &how, sizeof(how));
+
+        smackHaveOpenat2 = fd >= 0 || errno != ENOSYS;
+        VIR_FORCE_CLOSE(fd);
+        VIR_DEBUG("openat2 %savailable", smackHaveOpenat2 ? "" : "not ");
+    }
+#endif
 
-    return SmackRestoreSecurityFileLabel(mgr,file);
-}
+#ifdef SMACK_HAVE_XATTRAT
+    {
+        struct SmackXattrArgs args = { .value = 0, .size = 0 };
 
+        /* Asking for the size only */
+        smackHaveXattrat =
+            syscall(SYS_getxattrat, AT_FDCWD, "/", 0, smackXattrName,
+                    &args, sizeof(args)) >= 0 || errno != ENOSYS;
+        VIR_DEBUG("xattrat syscalls %savailable",
+                  smackHaveXattrat ? "" : "not ");
+    }
+#endif
 
+    return 0;
+}
 
+VIR_ONCE_GLOBAL_INIT(SmackSyscalls)
 
 
-static int
-SmackRestoreSecurityImageLabelInt(virSecurityManagerPtr mgr,
-		                  virDomainDefPtr def,
-				  virDomainDiskDefPtr disk,
-				  int migrated)
+/*
+ * Whether @path goes through a /proc/<pid>/fd (or /dev/fd) magic link,
+ * as passed for stdin or tap devices.
+ */
+static bool
+SmackPathIsProcFd(const char *path)
 {
-	virSecurityLabelDefPtr seclabel;
+    const char *p;
+
+    if (STRPREFIX(path, "/dev/fd/"))
+        return true;
+    if (!STRPREFIX(path, "/proc/"))
+        return false;
+    p = strchr(path + strlen("/proc/"), '/');
+    return p && STRPREFIX(p, "/fd/");
+}
 
-	seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
 
-        if (seclabel == NULL)
-		return -1;
+struct _SmackFileHandle {
+    const char *path;
+    /* O_PATH descriptor, or -1 if the kernel can't provide one and
+     * @path has to be used directly */
+    int fd;
+    char procpath[sizeof("/proc/self/fd/") + VIR_INT64_STR_BUFLEN];
+    struct stat sb;
+};
 
-	if (seclabel->norelabel) 
-		return 0;
 
-	if (disk->readonly || disk->shared)
-		return 0;
+static void
+SmackFileClose(SmackFileHandlePtr fh)
+{
+    if (fh->fd >= 0)
+        SMACK_COUNT_SYSCALL();
+    VIR_FORCE_CLOSE(fh->fd);
+}
 
-	if (!disk->src || disk->type == VIR_DOMAIN_DISK_TYPE_NETWORK)
-		return 0;
 
-	if (migrated) {
-	    int ret = virStorageFileIsSharedFS(disk->src);
-	    if (ret < 0)
-	        return -1;
-	    if (ret == 1) {
-	        VIR_DEBUG("Skipping image label restore on %s because FS is shared",disk->src);
-                return 0;
-            }
+/*
+ * Resolve @path once. Returns 0 on success, -1 with errno set
+ * otherwise.
+ */
+static int
+SmackFileOpen(const char *path,
+              SmackFileHandlePtr fh)
+{
+    memset(fh, 0, sizeof(*fh));
+    fh->path = path;
+    fh->fd = -1;
+
+#ifdef O_PATH
+# ifdef SYS_openat2
+    if (smackHaveOpenat2) {
+        struct SmackOpenHow how = {
+            .flags = O_PATH | O_CLOEXEC,
+            .resolve = SMACK_RESOLVE_NO_MAGICLINKS,
+        };
+
+        fh->fd = SMACK_SYSCALL(syscall(SYS_openat2, AT_FDCWD, path,
+                                       &how, sizeof(how)));
+        /* Magic links are only expected in /proc/<pid>/fd/N paths,
+         * which plain open() resolves */
+        if (fh->fd < 0 && errno != ENOSYS &&
+            (errno != ELOOP || !SmackPathIsProcFd(path)))
+            return -1;
+    }
+# endif
+
+    if (fh->fd < 0 &&
+        (fh->fd = SMACK_SYSCALL(open(path, O_PATH | O_CLOEXEC))) < 0 &&
+        errno != EINVAL)
+        return -1;
 
+    if (fh->fd >= 0) {
+        if (SMACK_SYSCALL(fstat(fh->fd, &fh->sb)) < 0) {
+            int saved_errno = errno;
+            SmackFileClose(fh);
+            errno = saved_errno;
+            return -1;
         }
+        snprintf(fh->procpath, sizeof(fh->procpath),
+                 "/proc/self/fd/%d", fh->fd);
+        return 0;
+    }
+#endif
 
-	return SmackRestoreSecurityFileLabel(mgr,disk->src);
+    return SMACK_SYSCALL(stat(path, &fh->sb));
+}
 
-      /*
-       *return setxattr(def->disks[i]->src,"security.SMACK64","smack-unused",strlen("smack-unused") + 1,0);
-       */
 
+static int
+SmackFileRestat(SmackFileHandlePtr fh)
+{
+    if (fh->fd >= 0)
+        return SMACK_SYSCALL(fstat(fh->fd, &fh->sb));
+    return SMACK_SYSCALL(stat(fh->path, &fh->sb));
 }
 
 
+/*
+ * Label storage backends. All label I/O of the driver goes through the
+ * active backend: the kernel one keeps labels in extended attributes,
+ * the memory one in a hash table keyed by inode, so that the driver's
+ * own overhead can be measured apart from kernel and filesystem cost,
+ * and the fault one wraps either of them to add latency and fail
+ * operations, e.g. to replay a slow or flaky NFS server. Backends
+ * behave like getxattr(2)/setxattr(2): get returns the raw value size
+ * and a zero @buflen only asks for that size.
+ */
+typedef struct _SmackLabelBackend SmackLabelBackend;
+typedef SmackLabelBackend *SmackLabelBackendPtr;
 
-static int
-SmackFSetFileLabel(int fd,char *tlabel)
+/*
+ * @get behaves like getxattr(2) on a Smack label: it stores the label
+ * without a trailing NUL in @buf of @buflen bytes and returns its
+ * length, or the length alone when @buflen is 0.
+ */
+struct _SmackLabelBackend {
+    const char *name;
+    ssize_t (*get)(const SmackLabelTarget *target, char *buf, size_t buflen);
+    int (*set)(const SmackLabelTarget *target, const char *label);
+};
+
+
+static ssize_t
+SmackKernelGetLabel(const SmackLabelTarget *target,
+                    char *buf,
+                    size_t buflen)
 {
-     char *elabel = NULL;
+    SmackFileHandlePtr fh = target->fh;
+
+    SMACK_COUNT_EVENT(VIR_SMACK_COUNTER_GETXATTR);
+
+    if (!fh) {
+        if (target->fd >= 0)
+            return SMACK_SYSCALL(fgetxattr(target->fd, smackXattrName,
+                                           buf, buflen));
+        if (target->nofollow)
+            return SMACK_SYSCALL(lgetxattr(target->path, smackXattrName,
+                                           buf, buflen));
+        return SMACK_SYSCALL(getxattr(target->path, smackXattrName,
+                                      buf, buflen));
+    }
 
-     VIR_INFO("Setting Smack label on fd %d to '%s'",fd,tlabel);
+    if (fh->fd < 0)
+        return SMACK_SYSCALL(getxattr(fh->path, smackXattrName,
+                                      buf, buflen));
+
+#ifdef SMACK_HAVE_XATTRAT
+    /* On the O_PATH descriptor itself, nothing is resolved */
+    if (smackHaveXattrat) {
+        struct SmackXattrArgs args = {
+            .value = (uintptr_t) buf,
+            .size = buflen,
+        };
+        ssize_t ret;
+
+        ret = SMACK_SYSCALL(syscall(SYS_getxattrat, fh->fd, "",
+                                    AT_EMPTY_PATH, smackXattrName,
+                                    &args, sizeof(args)));
+        if (ret >= 0 || errno != ENOSYS)
+            return ret;
+    }
+#endif
 
-     if (fsetfilelabel(fd,tlabel) < 0) {
-	 int fsetfilelabel_errno = errno;
-      
-         if (fgetfilelabel(fd,&elabel) >= 0) {
-	     if(STREQ(tlabel,elabel)) {
-		     free(elabel);
-                  /* It's alright, there's nothing to change anyway. */
-		  
-		     return 0;
-	     }
-
-	     free(elabel);
-	 }
-       /* if the error complaint is related to an image hosted on
-        * an nfs mount, or a usbfs/sysfs filesystem not supporting
-        * labelling, then just ignore it & hope for the best.
-        */
-        if (fsetfilelabel_errno != EOPNOTSUPP) {
-             virReportSystemError(fsetfilelabel_errno,
-   		                  _("unable to set security context '%s' on fd %d"), tlabel, fd);
-               return -1;
-         } else {
-            VIR_INFO("Setting security label '%s' on fd %d not supported",
-	              tlabel, fd);
-         }
-     }
-     return 0;
+    return SMACK_SYSCALL(getxattr(fh->procpath, smackXattrName,
+                                  buf, buflen));
 }
 
 
 static int
-SmackSetSecurityHostdevSubsysLabel(virDomainDefPtr def,
-		                   virDomainHostdevDefPtr dev,
-				   const char *vroot)
+SmackKernelSetLabel(const SmackLabelTarget *target,
+                    const char *label)
 {
-    int ret = -1;
+    SmackFileHandlePtr fh = target->fh;
+    size_t len = strlen(label) + 1;
+
+    SMACK_COUNT_EVENT(VIR_SMACK_COUNTER_SETXATTR);
+
+    if (!fh) {
+        if (target->fd >= 0)
+            return SMACK_SYSCALL(fsetxattr(target->fd, smackXattrName,
+                                           label, len, 0));
+        if (target->nofollow)
+            return SMACK_SYSCALL(lsetxattr(target->path, smackXattrName,
+                                           label, len, 0));
+        return SMACK_SYSCALL(setxattr(target->path, smackXattrName,
+                                      label, len, 0));
+    }
 
-    switch (dev->source.subsys.type) {
-    case VIR_DOMAIN_HOSTDEV_SUBSYS_TYPE_USB: {
-        virUSBDevicePtr usb;
+    if (fh->fd < 0)
+        return SMACK_SYSCALL(setxattr(fh->path, smackXattrName,
+                                      label, len, 0));
 
-        if (dev->missing)
+#ifdef SMACK_HAVE_XATTRAT
+    if (smackHaveXattrat) {
+        struct SmackXattrArgs args = {
+            .value = (uintptr_t) label,
+            .size = len,
+        };
+
+        if (SMACK_SYSCALL(syscall(SYS_setxattrat, fh->fd, "",
+                                  AT_EMPTY_PATH, smackXattrName,
+                                  &args, sizeof(args))) == 0)
             return 0;
+        if (errno != ENOSYS)
+            return -1;
+    }
+#endif
 
-        usb = virUSBDeviceNew(dev->source.subsys.u.usb.bus,
-                              dev->source.subsys.u.usb.device,
-                              vroot);
-        if (!usb)
-            goto done;
+    return SMACK_SYSCALL(setxattr(fh->procpath, smackXattrName,
+                                  label, len, 0));
+}
 
-        ret = virUSBDeviceFileIterate(usb, SmackSetSecurityUSBLabel, def);
-        virUSBDeviceFree(usb);
+static const SmackLabelBackend smackKernelBackend = {
+    .name = "kernel",
+    .get = SmackKernelGetLabel,
+    .set = SmackKernelSetLabel,
+};
 
-        break;
+
+/* "dev:ino" -> label, for the memory backend */
+static virMutex smackMemoryLock;
+static virHashTablePtr smackMemoryLabels;
+
+static void
+SmackMemoryLabelFree(void *payload, const void *name ATTRIBUTE_UNUSED)
+{
+    VIR_FREE(payload);
+}
+
+static int
+SmackMemoryBackendOnceInit(void)
+{
+    if (virMutexInit(&smackMemoryLock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize smack driver mutex"));
+        return -1;
     }
 
-    case VIR_DOMAIN_HOSTDEV_SUBSYS_TYPE_PCI: {
-        virPCIDevicePtr pci =
-            virPCIDeviceNew(dev->source.subsys.u.pci.addr.domain,
-                            dev->source.subsys.u.pci.addr.bus,
-                            dev->source.subsys.u.pci.addr.slot,
-                            dev->source.subsys.u.pci.addr.function);
+    if (!(smackMemoryLabels = virHashCreate(256, SmackMemoryLabelFree)))
+        return -1;
 
-        if (!pci)
-            goto done;
+    return 0;
+}
 
-        if (dev->source.subsys.u.pci.backend
-            == VIR_DOMAIN_HOSTDEV_PCI_BACKEND_VFIO) {
-            char *vfioGroupDev = virPCIDeviceGetIOMMUGroupDev(pci);
+VIR_ONCE_GLOBAL_INIT(SmackMemoryBackend)
 
-            if (!vfioGroupDev) {
-                virPCIDeviceFree(pci);
-                goto done;
-            }
-            ret = SmackRestoreSecurityPCILabel(pci, vfioGroupDev, def);
-            VIR_FREE(vfioGroupDev);
-        } else {
-            ret = virPCIDeviceFileIterate(pci, SmackSetSecurityPCILabel, def);
-        }
-        virPCIDeviceFree(pci);
-        break;
+
+static int
+SmackMemoryTargetKey(const SmackLabelTarget *target,
+                     char *key)
+{
+    struct stat sb;
+    int rc;
+
+    if (target->fh) {
+        SmackFormatInodeKey(&target->fh->sb, key);
+        return 0;
     }
 
-    case VIR_DOMAIN_HOSTDEV_SUBSYS_TYPE_SCSI: {
-        virSCSIDevicePtr scsi =
-            virSCSIDeviceNew(dev->source.subsys.u.scsi.adapter,
-                             dev->source.subsys.u.scsi.bus,
-                             dev->source.subsys.u.scsi.target,
-                             dev->source.subsys.u.scsi.unit,
-                             dev->readonly);
+    if (target->fd >= 0)
+        rc = SMACK_SYSCALL(fstat(target->fd, &sb));
+    else if (target->nofollow)
+        rc = SMACK_SYSCALL(lstat(target->path, &sb));
+    else
+        rc = SMACK_SYSCALL(stat(target->path, &sb));
+    if (rc < 0)
+        return -1;
 
-            if (!scsi)
-                goto done;
+    SmackFormatInodeKey(&sb, key);
+    return 0;
+}
 
-            ret = virSCSIDeviceFileIterate(scsi, SmackSetSecuritySCSILabel, def);
-            virSCSIDeviceFree(scsi);
 
-            break;
-       }
+static ssize_t
+SmackMemoryGetLabel(const SmackLabelTarget *target,
+                    char *buf,
+                    size_t buflen)
+{
+    char key[SMACK_INODE_KEY_BUFLEN];
+    const char *label;
+    ssize_t ret = -1;
 
-    default:
-        ret = 0;
-        break;
+    if (SmackMemoryTargetKey(target, key) < 0)
+        return -1;
+
+    virMutexLock(&smackMemoryLock);
+    if (!(label = virHashLookup(smackMemoryLabels, key))) {
+        errno = ENODATA;
+        goto cleanup;
     }
 
-done:
+    /* Like the kernel: the label without its NUL, which the caller
+     * adds; see SmackLabelGet() */
+    ret = strlen(label);
+    if (buflen == 0)
+        goto cleanup;
+    if (buflen < ret) {
+        errno = ERANGE;
+        ret = -1;
+        goto cleanup;
+    }
+    memcpy(buf, label, ret);
+
+cleanup:
+    virMutexUnlock(&smackMemoryLock);
     return ret;
 }
 
+
 static int
-SmackSetSecurityHostdevCapsLabel(virDomainDefPtr def,
-		                 virDomainHostdevDefPtr dev,
-				 const char *vroot)
+SmackMemorySetLabel(const SmackLabelTarget *target,
+                    const char *label)
 {
-    int ret = -1;
-    virSecurityLabelDefPtr seclabel;
-    char *path;
+    char key[SMACK_INODE_KEY_BUFLEN];
+    char *copy;
+    int ret;
 
-    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
-    if (seclabel == NULL)
+    /* The kernel refuses over-long labels too */
+    if (strlen(label) > SMACK_LABEL_LEN) {
+        errno = EINVAL;
         return -1;
-
-    switch (dev->source.caps.type) {
-    case VIR_DOMAIN_HOSTDEV_CAPS_TYPE_STORAGE: {
-        if (vroot) {
-            if (virAsprintf(&path, "%s/%s", vroot,
-                            dev->source.caps.u.storage.block) < 0)
-                return -1;
-        } else {
-            if (VIR_STRDUP(path, dev->source.caps.u.storage.block) < 0)
-                return -1;
-        }
-        ret = SmackSetFileLabel(path, seclabel->imagelabel);
-        VIR_FREE(path);
-        break;
     }
 
-    case VIR_DOMAIN_HOSTDEV_CAPS_TYPE_MISC: {
-        if (vroot) {
-            if (virAsprintf(&path, "%s/%s", vroot,
-                            dev->source.caps.u.misc.chardev) < 0)
-                return -1;
-        } else {
-            if (VIR_STRDUP(path, dev->source.caps.u.misc.chardev) < 0)
-                return -1;
-        }
-        ret = SmackSetFileLabel(path, seclabel->imagelabel);
-        VIR_FREE(path);
-        break;
+    if (SmackMemoryTargetKey(target, key) < 0)
+        return -1;
+
+    SMACK_COUNT_ALLOC();
+    if (VIR_STRDUP_QUIET(copy, label) < 0) {
+        errno = ENOMEM;
+        return -1;
     }
 
-    default:
-        ret = 0;
-        break;
+    virMutexLock(&smackMemoryLock);
+    if ((ret = virHashUpdateEntry(smackMemoryLabels, key, copy)) < 0) {
+        VIR_FREE(copy);
+        errno = ENOMEM;
     }
+    virMutexUnlock(&smackMemoryLock);
 
     return ret;
-
 }
 
-static int
-SmackRestoreSecurityHostdevSubsysLabel(virSecurityManagerPtr mgr,
-		                       virDomainHostdevDefPtr dev,
-				       const char *vroot)
-{
-    int ret = -1;
+static const SmackLabelBackend smackMemoryBackend = {
+    .name = "memory",
+    .get = SmackMemoryGetLabel,
+    .set = SmackMemorySetLabel,
+};
 
-    switch (dev->source.subsys.type) {
-    case VIR_DOMAIN_HOSTDEV_SUBSYS_TYPE_USB: {
-        virUSBDevicePtr usb;
 
-        if (dev->missing)
-            return 0;
+enum {
+    SMACK_FAULT_GET,
+    SMACK_FAULT_SET,
 
-        usb = virUSBDeviceNew(dev->source.subsys.u.usb.bus,
-                              dev->source.subsys.u.usb.device,
-                              vroot);
-        if (!usb)
-            goto done;
+    SMACK_FAULT_LAST
+};
 
-        ret = virUSBDeviceFileIterate(usb, SmackRestoreSecurityUSBLabel, mgr);
-        virUSBDeviceFree(usb);
+/* Backend wrapped by the fault backend, and what to inject */
+static const SmackLabelBackend *smackFaultInner;
+static virSmackLabelFault smackFaults[SMACK_FAULT_LAST];
+static unsigned long long smackFaultOps[SMACK_FAULT_LAST];
 
-        break;
-    }
+static int
+SmackFaultInject(int op)
+{
+    const virSmackLabelFault *fault = &smackFaults[op];
 
-    case VIR_DOMAIN_HOSTDEV_SUBSYS_TYPE_PCI: {
-        virPCIDevicePtr pci =
-            virPCIDeviceNew(dev->source.subsys.u.pci.addr.domain,
-                            dev->source.subsys.u.pci.addr.bus,
-                            dev->source.subsys.u.pci.addr.slot,
-                            dev->source.subsys.u.pci.addr.function);
+    if (fault->latencyUs)
+        usleep(fault->latencyUs);
 
-        if (!pci)
-            goto done;
+    if (fault->error && fault->errorEvery &&
+        __sync_add_and_fetch(&smackFaultOps[op], 1) %
+        fault->errorEvery == 0) {
+        errno = fault->error;
+        return -1;
+    }
 
-        if (dev->source.subsys.u.pci.backend
-            == VIR_DOMAIN_HOSTDEV_PCI_BACKEND_VFIO) {
-            char *vfioGroupDev = virPCIDeviceGetIOMMUGroupDev(pci);
+    return 0;
+}
 
-            if (!vfioGroupDev) {
-                virPCIDeviceFree(pci);
-                goto done;
-            }
-            ret = SmackRestoreSecurityPCILabel(pci, vfioGroupDev, mgr);
-            VIR_FREE(vfioGroupDev);
-        } else {
-            ret = virPCIDeviceFileIterate(pci, SmackRestoreSecurityPCILabel, mgr);
-        }
-        virPCIDeviceFree(pci);
-        break;
-    }
 
-    case VIR_DOMAIN_HOSTDEV_SUBSYS_TYPE_SCSI: {
-        virSCSIDevicePtr scsi =
-            virSCSIDeviceNew(dev->source.subsys.u.scsi.adapter,
-                             dev->source.subsys.u.scsi.bus,
-                             dev->source.subsys.u.scsi.target,
-                             dev->source.subsys.u.scsi.unit,
-                             dev->readonly);
+static ssize_t
+SmackFaultGetLabel(const SmackLabelTarget *target,
+                   char *buf,
+                   size_t buflen)
+{
+    if (SmackFaultInject(SMACK_FAULT_GET) < 0)
+        return -1;
+    return smackFaultInner->get(target, buf, buflen);
+}
 
-            if (!scsi)
-                goto done;
 
-            ret = virSCSIDeviceFileIterate(scsi, SmackRestoreSecuritySCSILabel, mgr);
-            virSCSIDeviceFree(scsi);
+static int
+SmackFaultSetLabel(const SmackLabelTarget *target,
+                   const char *label)
+{
+    if (SmackFaultInject(SMACK_FAULT_SET) < 0)
+        return -1;
+    return smackFaultInner->set(target, label);
+}
 
-            break;
-       }
+static const SmackLabelBackend smackFaultBackend = {
+    .name = "fault",
+    .get = SmackFaultGetLabel,
+    .set = SmackFaultSetLabel,
+};
 
-    default:
-        ret = 0;
-        break;
-    }
 
-done:
-    return ret;
+/* Backend in use, chosen when the driver is opened */
+static const SmackLabelBackend *smackBackend = &smackKernelBackend;
 
-}
+/* Backend and faults requested for the next driver open */
+static int smackBackendType = VIR_SMACK_LABEL_BACKEND_KERNEL;
+static bool smackFaultsWanted;
+static virSmackLabelFault smackFaultsWant[SMACK_FAULT_LAST];
 
+VIR_ENUM_IMPL(virSmackLabelBackend, VIR_SMACK_LABEL_BACKEND_LAST,
+              "kernel",
+              "memory")
 
 
 static int
-SmackRestoreSecurityHostdevCapsLabel(virSecurityManagerPtr mgr,
-				     virDomainHostdevDefPtr dev,
-				     const char *vroot)
+SmackLabelBackendActivate(void)
 {
-    int ret = -1;
-    char *path;
+    const SmackLabelBackend *backend = &smackKernelBackend;
 
-    switch (dev->source.caps.type) {
-    case VIR_DOMAIN_HOSTDEV_CAPS_TYPE_STORAGE: {
-        if (vroot) {
-            if (virAsprintf(&path, "%s/%s", vroot,
-                            dev->source.caps.u.storage.block) < 0)
-                return -1;
-        } else {
-            if (VIR_STRDUP(path, dev->source.caps.u.storage.block) < 0)
-                return -1;
-        }
-        ret = SmackRestoreSecurityFileLabel(mgr, path);
-        VIR_FREE(path);
-        break;
+    if (smackBackendType == VIR_SMACK_LABEL_BACKEND_MEMORY) {
+        if (SmackMemoryBackendInitialize() < 0)
+            return -1;
+        backend = &smackMemoryBackend;
     }
 
-    case VIR_DOMAIN_HOSTDEV_CAPS_TYPE_MISC: {
-        if (vroot) {
-            if (virAsprintf(&path, "%s/%s", vroot,
-                            dev->source.caps.u.misc.chardev) < 0)
-                return -1;
-        } else {
-            if (VIR_STRDUP(path, dev->source.caps.u.misc.chardev) < 0)
-                return -1;
-        }
-        ret = SmackRestoreSecurityFileLabel(mgr, path);
-        VIR_FREE(path);
-        break;
+    if (smackFaultsWanted) {
+        memcpy(smackFaults, smackFaultsWant, sizeof(smackFaults));
+        memset(smackFaultOps, 0, sizeof(smackFaultOps));
+        smackFaultInner = backend;
+        backend = &smackFaultBackend;
     }
 
-    default:
-        ret = 0;
-        break;
-    }
+    smackBackend = backend;
+    VIR_DEBUG("Using %s label backend%s",
+              virSmackLabelBackendTypeToString(smackBackendType),
+              smackFaultsWanted ? " with fault injection" : "");
+    return 0;
+}
 
-    return ret;
+
+static ssize_t
+SmackLabelSize(const SmackLabelTarget *target)
+{
+    return smackBackend->get(target, NULL, 0);
 }
 
 
-/*Called on libvirtd startup to see if Smack is available*/
-static int
-SmackSecurityDriverProbe(const char *virtDriver)
+/*
+ * Read the label of @target into @buf of @buflen bytes, which is
+ * always NUL terminated on success. Returns the label length, or -1
+ * with errno set. Empty labels are reported as ENOTSUP.
+ */
+static ssize_t
+SmackLabelGet(const SmackLabelTarget *target,
+              char *buf,
+              size_t buflen)
 {
-	if(!smack_smackfs_path())
-		return SECURITY_DRIVER_DISABLE;
-        if (virtDriver && STREQ(virtDriver, "LXC")) {
-#if HAVE_SELINUX_LXC_CONTEXTS_PATH
-           if (!virFileExists(selinux_lxc_contexts_path()))
-#endif
-        return SECURITY_DRIVER_DISABLE;
-        }
+    ssize_t ret;
 
-	return SECURITY_DRIVER_ENABLE;
+    if (buflen < 2) {
+        errno = ERANGE;
+        return -1;
+    }
 
+    ret = smackBackend->get(target, buf, buflen - 1);
+    if (ret == 0) {
+        /* Re-map empty attribute values to errors. */
+        errno = ENOTSUP;
+        ret = -1;
+    }
+    if (ret >= 0)
+        buf[ret] = '\0';
+    SMACK_PROBE4(label__get,
+                 target->fh ? target->fh->path : target->path,
+                 target->fd, ret, errno);
+    return ret;
 }
 
-/*Security dirver initialization .*/
+
 static int
-SmackSecurityDriverOpen(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED)
+SmackLabelSet(const SmackLabelTarget *target,
+              const char *label)
 {
-	return 0;
+    int ret = smackBackend->set(target, label);
+
+    SMACK_PROBE5(label__set,
+                 target->fh ? target->fh->path : target->path,
+                 target->fd, label, ret, errno);
+    return ret;
 }
 
+
 static int
-SmackSecurityDriverClose(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED)
+SmackFileSetXattr(SmackFileHandlePtr fh,
+                  const char *label)
 {
-	return 0;
-}
+    SmackLabelTarget target = { .fh = fh, .fd = -1, .path = fh->path };
 
-static const char *
-SmackSecurityDriverGetModel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED)
-{
-	return SECURITY_SMACK_NAME;
+    return SmackLabelSet(&target, label);
 }
 
-static const char *
-SmackSecurityDriverGetDOI(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED)
-{
-	return SECURITY_SMACK_VOID_DOI;
-}
 
-static int
-SmackSecurityVerify(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-		    virDomainDefPtr def)
+static ssize_t
+SmackFileGetXattr(SmackFileHandlePtr fh,
+                  char *buf,
+                  size_t buflen)
 {
-        virSecurityLabelDefPtr seclabel;        
-        seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
-	if (seclabel == NULL)
-		return -1;
+    SmackLabelTarget target = { .fh = fh, .fd = -1, .path = fh->path };
+
+    return SmackLabelGet(&target, buf, buflen);
+}
+
+
+#ifndef GFS2_MAGIC
+# define GFS2_MAGIC 0x01161970
+#endif
+#ifndef OCFS2_SUPER_MAGIC
+# define OCFS2_SUPER_MAGIC 0x7461636f
+#endif
+#ifndef AFS_FS_MAGIC
+# define AFS_FS_MAGIC 0x6B414653
+#endif
+
+#ifndef MSDOS_SUPER_MAGIC
+# define MSDOS_SUPER_MAGIC 0x4d44
+#endif
+#ifndef ISOFS_SUPER_MAGIC
+# define ISOFS_SUPER_MAGIC 0x9660
+#endif
+#ifndef USBDEVICE_SUPER_MAGIC
+# define USBDEVICE_SUPER_MAGIC 0x9fa2
+#endif
+
+/* Filesystems without any xattr support at all */
+static bool
+SmackFsTypeHasNoXattrs(long long type)
+{
+    switch (type) {
+    case MSDOS_SUPER_MAGIC:
+    case ISOFS_SUPER_MAGIC:
+    case USBDEVICE_SUPER_MAGIC:
+        return true;
+    }
+    return false;
+}
+
+
+/* Same set of filesystems as virStorageFileIsSharedFS() */
+static bool
+SmackFsTypeIsShared(long long type)
+{
+    switch (type) {
+    case NFS_SUPER_MAGIC:
+    case GFS2_MAGIC:
+    case OCFS2_SUPER_MAGIC:
+    case AFS_FS_MAGIC:
+        return true;
+    }
+    return false;
+}
+
+
+/*
+ * Flush the filesystem cache if the mount table changed since the last
+ * check. The kernel flags mountinfo with POLLPRI on every mount or
+ * unmount and clears it again when polled. Without a mountinfo
+ * descriptor nothing can be trusted, so the cache is always flushed.
+ * Called with fsLock held.
+ */
+static void
+SmackFsCacheCheckMounts(virSmackSecurityDataPtr priv)
+{
+    struct pollfd pfd = { .fd = priv->mountinfoFd, .events = POLLPRI };
+
+    if (priv->mountinfoFd >= 0 &&
+        (SMACK_SYSCALL(poll(&pfd, 1, 0)) <= 0 ||
+         !(pfd.revents & (POLLPRI | POLLERR))))
+        return;
+
+    priv->fsGeneration++;
+    if (virHashSize(priv->fsCache) > 0) {
+        VIR_DEBUG("Mount table changed, flushing filesystem cache");
+        virHashRemoveAll(priv->fsCache);
+        priv->fsNoLabels = 0;
+        priv->fsFailing = 0;
+    }
+}
+
+
+static void
+SmackFormatDevKey(const struct stat *sb, char *key)
+{
+    snprintf(key, VIR_INT64_STR_BUFLEN, "%llx",
+             (unsigned long long) sb->st_dev);
+}
+
+
+/*
+ * Fill @info for the filesystem holding the inode described by @sb,
+ * statfs()ing @fd, or @path if @fd is -1, only if that filesystem is
+ * not known yet. Returns 0 on success, -1 with errno set otherwise.
+ */
+static int
+SmackFsClassify(virSecurityManagerPtr mgr,
+                const struct stat *sb,
+                int fd,
+                const char *path,
+                virSmackFsInfoPtr info)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char key[VIR_INT64_STR_BUFLEN];
+    virSmackFsInfoPtr entry;
+    unsigned long long generation;
+    struct statfs fs;
+
+    SmackFormatDevKey(sb, key);
+
+    virMutexLock(&priv->fsLock);
+    SmackFsCacheCheckMounts(priv);
+    if ((entry = virHashLookup(priv->fsCache, key))) {
+        *info = *entry;
+        virMutexUnlock(&priv->fsLock);
+        return 0;
+    }
+    generation = priv->fsGeneration;
+    virMutexUnlock(&priv->fsLock);
+
+    SMACK_COUNT_EVENT(VIR_SMACK_COUNTER_SHARED_FS_PROBE);
+    if ((fd >= 0 ? SMACK_SYSCALL(fstatfs(fd, &fs)) :
+         SMACK_SYSCALL(statfs(path, &fs))) < 0)
+        return -1;
+
+    info->type = fs.f_type;
+    info->shared = SmackFsTypeIsShared(fs.f_type);
+    info->xattrs = -1;
+
+    /* Don't cache what was seen through a mount table that has changed
+     * in the meantime, st_dev may name another filesystem by now */
+    virMutexLock(&priv->fsLock);
+    SmackFsCacheCheckMounts(priv);
+    if (priv->fsGeneration == generation &&
+        !virHashLookup(priv->fsCache, key) &&
+        VIR_ALLOC_QUIET(entry) == 0) {
+        *entry = *info;
+        if (virHashAddEntry(priv->fsCache, key, entry) < 0)
+            VIR_FREE(entry);
+    }
+    virMutexUnlock(&priv->fsLock);
+
+    return 0;
+}
+
+
+/* Failures in a row after which a filesystem is taken to reject labels */
+#define SMACK_FS_NOLABEL_FAILURES 8
+
+/*
+ * Note that setting a label on the inode described by @sb, reachable
+ * through @fd or @path as for SmackFsClassify(), failed with ENOTSUP.
+ * The filesystem is only taken to reject labels when statfs() says it
+ * has no xattrs at all, or after SMACK_FS_NOLABEL_FAILURES failures
+ * without a success in between, as single inodes such as the sysfs
+ * ones may refuse labels on an otherwise fine filesystem. Pipes and
+ * sockets never count, they all share one pseudo filesystem. Returns
+ * true if the filesystem was marked just now, i.e. the caller is the
+ * one to log it.
+ */
+static bool
+SmackFsNoteNoLabels(virSecurityManagerPtr mgr,
+                    const struct stat *sb,
+                    int fd,
+                    const char *path)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char key[VIR_INT64_STR_BUFLEN];
+    virSmackFsInfo info;
+    virSmackFsInfoPtr entry;
+    bool first = false;
+
+    if (S_ISFIFO(sb->st_mode) || S_ISSOCK(sb->st_mode))
+        return false;
+
+    if (SmackFsClassify(mgr, sb, fd, path, &info) < 0)
+        return false;
+
+    SmackFormatDevKey(sb, key);
+
+    virMutexLock(&priv->fsLock);
+    if (!(entry = virHashLookup(priv->fsCache, key)) ||
+        entry->xattrs == 0)
+        goto cleanup;
+
+    if (entry->failures++ == 0)
+        priv->fsFailing++;
+    if (SmackFsTypeHasNoXattrs(entry->type) ||
+        (entry->xattrs < 0 &&
+         entry->failures >= SMACK_FS_NOLABEL_FAILURES)) {
+        entry->xattrs = 0;
+        entry->failures = 0;
+        priv->fsFailing--;
+        priv->fsNoLabels++;
+        first = true;
+    }
+
+cleanup:
+    virMutexUnlock(&priv->fsLock);
+    return first;
+}
+
+
+/*
+ * Note that the filesystem holding @sb, or @fd if @sb is NULL, accepted
+ * a label, which resets the failures counted by SmackFsNoteNoLabels().
+ * This is free as long as no filesystem has failures counted against it.
+ */
+static void
+SmackFsNoteLabels(virSecurityManagerPtr mgr,
+                  const struct stat *sb,
+                  int fd)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char key[VIR_INT64_STR_BUFLEN];
+    virSmackFsInfoPtr entry;
+    struct stat fdsb;
+
+    if (!__sync_fetch_and_add(&priv->fsFailing, 0))
+        return;
+
+    if (!sb) {
+        if (SMACK_SYSCALL(fstat(fd, &fdsb)) < 0)
+            return;
+        sb = &fdsb;
+    }
+
+    SmackFormatDevKey(sb, key);
+
+    virMutexLock(&priv->fsLock);
+    if ((entry = virHashLookup(priv->fsCache, key)) &&
+        entry->failures > 0) {
+        entry->failures = 0;
+        priv->fsFailing--;
+    }
+    virMutexUnlock(&priv->fsLock);
+}
+
+
+/*
+ * Whether the filesystem holding @sb, or @fd if @sb is NULL, is known
+ * to reject labels, in which case trying to set one is pointless. This
+ * is free as long as no such filesystem was met.
+ */
+static bool
+SmackFsLabelsUnsupported(virSecurityManagerPtr mgr,
+                         const struct stat *sb,
+                         int fd)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char key[VIR_INT64_STR_BUFLEN];
+    virSmackFsInfoPtr entry;
+    struct stat fdsb;
+    bool ret = false;
+
+    virMutexLock(&priv->fsLock);
+    if (priv->fsNoLabels == 0)
+        goto cleanup;
+
+    if (!sb) {
+        if (SMACK_SYSCALL(fstat(fd, &fdsb)) < 0)
+            goto cleanup;
+        sb = &fdsb;
+    }
+
+    SmackFsCacheCheckMounts(priv);
+    SmackFormatDevKey(sb, key);
+    if ((entry = virHashLookup(priv->fsCache, key)))
+        ret = entry->xattrs == 0;
+
+cleanup:
+    virMutexUnlock(&priv->fsLock);
+    return ret;
+}
+
+
+/*
+ * Like virStorageFileIsSharedFS(), but answered from the filesystem
+ * cache whenever @path exists.
+ */
+static int
+SmackFsIsShared(virSecurityManagerPtr mgr,
+                const char *path)
+{
+    virSmackFsInfo info;
+    struct stat sb;
+
+    /* Paths not there (yet) are classified by their parents */
+    if (SMACK_SYSCALL(stat(path, &sb)) < 0 ||
+        SmackFsClassify(mgr, &sb, -1, path, &info) < 0)
+        return virStorageFileIsSharedFS(path);
+
+    return info.shared ? 1 : 0;
+}
+
+
+static bool
+SmackFileIsNFS(virSecurityManagerPtr mgr,
+               SmackFileHandlePtr fh)
+{
+    virSmackFsInfo info;
+
+    if (SmackFsClassify(mgr, &fh->sb, fh->fd, fh->path, &info) < 0)
+        return false;
+
+    return info.type == NFS_SUPER_MAGIC;
+}
+
+
+static int
+SmackSetFileLabelHandle(virSecurityManagerPtr mgr,
+                        SmackFileHandlePtr fh,
+                        const char *tlabel)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char elabel[SMACK_LABEL_LEN + 1];
+
+    if (SmackLabelCacheLookup(priv, &fh->sb, tlabel)) {
+        VIR_DEBUG("Smack label on '%s' is already '%s'", fh->path, tlabel);
+        return 0;
+    }
+
+    if (SmackFsLabelsUnsupported(mgr, &fh->sb, -1)) {
+        VIR_DEBUG("Not labeling '%s', its filesystem does not support it",
+                  fh->path);
+        return 0;
+    }
+
+    VIR_INFO("Setting Smack label on '%s' to '%s'", fh->path, tlabel);
+
+    if (SmackFileSetXattr(fh, tlabel) < 0) {
+        int setfilelabel_errno = errno;
+
+        /* It's alright if there's nothing to change anyway. */
+        if (SmackFileGetXattr(fh, elabel, sizeof(elabel)) >= 0 &&
+            STREQ(tlabel, elabel))
+            goto cache;
+
+        SmackLabelCacheInvalidate(priv, &fh->sb);
+
+        /* if the error complaint is related to an image hosted on
+         * an nfs mount, or a usbfs/sysfs filesystem not supporting
+         * labelling, then just ignore it & hope for the best.
+         */
+        if (setfilelabel_errno != EOPNOTSUPP && setfilelabel_errno != ENOTSUP) {
+            virReportSystemError(setfilelabel_errno,
+                                 _("unable to set security context '%s' on '%s'"),
+                                 tlabel, fh->path);
+            return -1;
+        }
+
+        SMACK_COUNT_EVENT(VIR_SMACK_COUNTER_ENOTSUP_FALLBACK);
+
+        /* Log once per filesystem, further files on it are skipped */
+        if (!SmackFsNoteNoLabels(mgr, &fh->sb, fh->fd, fh->path)) {
+            VIR_DEBUG("Setting security context '%s' on '%s' not supported",
+                      tlabel, fh->path);
+            return 0;
+        }
+
+        if (SmackFileIsNFS(mgr, fh))
+            VIR_WARN("Setting security context '%s' on '%s' not supported, "
+                     "not labeling device %u:%u any more",
+                     tlabel, fh->path,
+                     major(fh->sb.st_dev), minor(fh->sb.st_dev));
+        else
+            VIR_INFO("Setting security context '%s' on '%s' not supported, "
+                     "not labeling device %u:%u any more",
+                     tlabel, fh->path,
+                     major(fh->sb.st_dev), minor(fh->sb.st_dev));
+        return 0;
+    }
+
+cache:
+    SmackFsNoteLabels(mgr, &fh->sb, -1);
+    /* setxattr bumps the ctime, so record the post-relabel value */
+    if (SmackFileRestat(fh) == 0)
+        SmackLabelCacheUpdate(priv, &fh->sb, tlabel);
+    return 0;
+}
+
+
+/*
+ * Original label journal. The label a file carries before it is first
+ * labeled for a domain is appended to a host wide journal, a file under
+ * /run mapped shared, and restoring puts that label back instead of
+ * SECURITY_SMACK_UNUSED_LABEL. The journal outlives the daemon, so
+ * restores after a crash are exact without looking at the images.
+ * Records are found through an index built when the journal is opened.
+ * Restored records are marked dead, and the journal is rewritten with
+ * the live ones only once dead records outnumber them.
+ *
+ * The file is shared by every manager of the process through a single
+ * SmackJournal, and held with an exclusive flock() against other
+ * processes, so the record count and index derived from the file when
+ * it is opened stay true to it. Inode numbers get reused, so records
+ * carry the generation of their file too, see SmackJournalGeneration().
+ */
+#define SMACK_JOURNAL_MAGIC         "SMKJRNL1"
+#define SMACK_JOURNAL_VERSION       2
+/* Records the journal starts with; it isn't compacted below this */
+#define SMACK_JOURNAL_CHUNK         1024
+
+/* Record states, a record never written ends the journal */
+#define SMACK_JOURNAL_LIVE          0x4556494cU
+#define SMACK_JOURNAL_DEAD          0x44414544U
+
+typedef struct _SmackJournalHeader SmackJournalHeader;
+typedef SmackJournalHeader *SmackJournalHeaderPtr;
+
+struct _SmackJournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recsize;
+};
+
+typedef struct _SmackJournalRecord SmackJournalRecord;
+typedef SmackJournalRecord *SmackJournalRecordPtr;
+
+struct _SmackJournalRecord {
+    uint64_t dev;
+    uint64_t ino;
+    /* see SmackJournalGeneration(), 0 if unknown */
+    uint64_t gen;
+    /* stored last, once the rest of the record is in place */
+    uint32_t state;
+    /* empty if the file had no label */
+    char label[SMACK_LABEL_LEN + 1];
+};
+
+#define SMACK_JOURNAL_SIZE(nrecords) \
+    (sizeof(SmackJournalHeader) + (nrecords) * sizeof(SmackJournalRecord))
+
+struct _SmackJournal {
+    /* managers using it, guarded by smackJournalLock */
+    size_t refs;
+    virMutex lock;
+    int fd;
+    void *map;
+    size_t mapsize;
+    SmackJournalRecordPtr records;
+    /* records there is room for, records appended, live records */
+    size_t capacity;
+    size_t nrecords;
+    size_t nlive;
+    /* "dev:ino" -> index + 1 of the live record of the inode */
+    virHashTablePtr index;
+};
+
+
+/* Size the file of @journal for @capacity records and map it */
+static int
+SmackJournalMap(SmackJournalPtr journal,
+                size_t capacity)
+{
+    size_t size = SMACK_JOURNAL_SIZE(capacity);
+    void *map;
+
+    if (ftruncate(journal->fd, size) < 0)
+        return -1;
+
+    if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    journal->fd, 0)) == MAP_FAILED)
+        return -1;
+
+    if (journal->map)
+        munmap(journal->map, journal->mapsize);
+    journal->map = map;
+    journal->mapsize = size;
+    journal->records = (SmackJournalRecordPtr)
+        ((char *) map + sizeof(SmackJournalHeader));
+    journal->capacity = capacity;
+    return 0;
+}
+
+
+/*
+ * Count the records of @journal and index the live ones. Returns -1
+ * if the index can't be allocated, leaving the old one in place.
+ */
+static int
+SmackJournalIndex(SmackJournalPtr journal)
+{
+    virHashTablePtr index;
+    char key[SMACK_INODE_KEY_BUFLEN];
+    size_t nlive = 0;
+    size_t i;
+
+    if (!(index = virHashCreate(256, NULL)))
+        return -1;
+
+    for (i = 0; i < journal->capacity; i++) {
+        SmackJournalRecordPtr rec = &journal->records[i];
+
+        if (rec->state == 0)
+            break;
+        if (rec->state != SMACK_JOURNAL_LIVE)
+            continue;
+
+        rec->label[SMACK_LABEL_LEN] = '\0';
+        SmackFormatDevInoKey(rec->dev, rec->ino, key);
+
+        /* Only the oldest record knows the original label */
+        if (virHashLookup(index, key)) {
+            rec->state = SMACK_JOURNAL_DEAD;
+            continue;
+        }
+
+        if (virHashAddEntry(index, key, (void *) (intptr_t) (i + 1)) < 0) {
+            virHashFree(index);
+            return -1;
+        }
+        nlive++;
+    }
+
+    virHashFree(journal->index);
+    journal->index = index;
+    journal->nrecords = i;
+    journal->nlive = nlive;
+    return 0;
+}
+
+
+static void
+SmackJournalDispose(SmackJournalPtr journal)
+{
+    if (!journal)
+        return;
+
+    /* The file stays for the next Open */
+    if (journal->map)
+        munmap(journal->map, journal->mapsize);
+    VIR_FORCE_CLOSE(journal->fd);
+    virHashFree(journal->index);
+    virMutexDestroy(&journal->lock);
+    VIR_FREE(journal);
+}
+
+
+static SmackJournalPtr
+SmackJournalOpenFile(void)
+{
+    SmackJournalPtr journal;
+    SmackJournalHeaderPtr header;
+    struct stat sb;
+    size_t capacity = 0;
+
+    if (VIR_ALLOC(journal) < 0)
+        return NULL;
+    journal->fd = -1;
+
+    if (virMutexInit(&journal->lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize label journal mutex"));
+        VIR_FREE(journal);
+        return NULL;
+    }
+
+    if (virFileMakePath(SMACK_STATE_DIR) < 0) {
+        virReportSystemError(errno, _("unable to create directory '%s'"),
+                             SMACK_STATE_DIR);
+        goto error;
+    }
+
+    if ((journal->fd = open(SMACK_JOURNAL_FILE,
+                            O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 ||
+        fstat(journal->fd, &sb) < 0) {
+        virReportSystemError(errno, _("unable to open label journal '%s'"),
+                             SMACK_JOURNAL_FILE);
+        goto error;
+    }
+
+    if (flock(journal->fd, LOCK_EX | LOCK_NB) < 0) {
+        virReportSystemError(errno,
+                             _("label journal '%s' is used by another "
+                               "process"), SMACK_JOURNAL_FILE);
+        goto error;
+    }
+
+    if (sb.st_size > (off_t) sizeof(SmackJournalHeader))
+        capacity = (sb.st_size - sizeof(SmackJournalHeader)) /
+                   sizeof(SmackJournalRecord);
+
+    if (SmackJournalMap(journal, MAX(capacity, SMACK_JOURNAL_CHUNK)) < 0) {
+        virReportSystemError(errno, _("unable to map label journal '%s'"),
+                             SMACK_JOURNAL_FILE);
+        goto error;
+    }
+
+    header = journal->map;
+    if (capacity > 0 &&
+        (memcmp(header->magic, SMACK_JOURNAL_MAGIC,
+                sizeof(header->magic)) != 0 ||
+         header->version != SMACK_JOURNAL_VERSION ||
+         header->recsize != sizeof(SmackJournalRecord))) {
+        VIR_WARN("Discarding label journal %s of unknown format",
+                 SMACK_JOURNAL_FILE);
+        memset(journal->map, 0, journal->mapsize);
+        capacity = 0;
+    }
+
+    if (capacity == 0) {
+        memcpy(header->magic, SMACK_JOURNAL_MAGIC, sizeof(header->magic));
+        header->version = SMACK_JOURNAL_VERSION;
+        header->recsize = sizeof(SmackJournalRecord);
+    }
+
+    if (SmackJournalIndex(journal) < 0)
+        goto error;
+
+    VIR_INFO("Label journal %s holds %zu original labels",
+             SMACK_JOURNAL_FILE, journal->nlive);
+    return journal;
+
+error:
+    SmackJournalDispose(journal);
+    return NULL;
+}
+
+
+static virMutex smackJournalLock;
+static SmackJournalPtr smackJournal;
+
+static int
+SmackJournalsOnceInit(void)
+{
+    if (virMutexInit(&smackJournalLock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize label journal mutex"));
+        return -1;
+    }
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(SmackJournals)
+
+
+/* Take a reference on the journal of the process, opening it first */
+static SmackJournalPtr
+SmackJournalOpen(void)
+{
+    SmackJournalPtr journal;
+
+    if (SmackJournalsInitialize() < 0)
+        return NULL;
+
+    virMutexLock(&smackJournalLock);
+    if (!smackJournal)
+        smackJournal = SmackJournalOpenFile();
+    if ((journal = smackJournal))
+        journal->refs++;
+    virMutexUnlock(&smackJournalLock);
+
+    return journal;
+}
+
+
+static void
+SmackJournalFree(SmackJournalPtr journal)
+{
+    if (!journal)
+        return;
+
+    virMutexLock(&smackJournalLock);
+    if (--journal->refs == 0) {
+        SmackJournalDispose(journal);
+        smackJournal = NULL;
+    }
+    virMutexUnlock(&smackJournalLock);
+}
+
+
+/*
+ * Identify the file behind @fh beyond its inode number: a hash of its
+ * file handle, which embeds the inode generation on filesystems that
+ * have one. Returns 0 if the filesystem can't tell.
+ */
+static uint64_t
+SmackJournalGeneration(SmackFileHandlePtr fh)
+{
+#ifdef MAX_HANDLE_SZ
+    union {
+        struct file_handle handle;
+        char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    } u;
+    uint64_t gen;
+    int mntid;
+    int rc;
+
+    u.handle.handle_bytes = MAX_HANDLE_SZ;
+    if (fh->fd >= 0)
+        rc = name_to_handle_at(fh->fd, "", &u.handle, &mntid, AT_EMPTY_PATH);
+    else
+        rc = name_to_handle_at(AT_FDCWD, fh->path, &u.handle, &mntid, 0);
+    if (rc < 0)
+        return 0;
+
+    gen = ((uint64_t) (uint32_t) u.handle.handle_type << 32) |
+          virHashCodeGen(u.handle.f_handle, u.handle.handle_bytes, 0);
+    return gen ? gen : 1;
+#else
+    return 0;
+#endif
+}
+
+
+/*
+ * Find the live record of the inode @sb of generation @gen, with the
+ * lock of @journal held. A record left by an earlier file that had the
+ * same inode number is dropped. Returns its index + 1, or 0.
+ */
+static intptr_t
+SmackJournalFindLocked(SmackJournalPtr journal,
+                       const char *key,
+                       uint64_t gen)
+{
+    SmackJournalRecordPtr rec;
+    intptr_t idx;
+
+    if (!(idx = (intptr_t) virHashLookup(journal->index, key)))
+        return 0;
+
+    rec = &journal->records[idx - 1];
+    if (!gen || !rec->gen || rec->gen == gen)
+        return idx;
+
+    VIR_DEBUG("Dropping original label of %s, the inode was reused", key);
+    rec->state = SMACK_JOURNAL_DEAD;
+    virHashRemoveEntry(journal->index, key);
+    journal->nlive--;
+    return 0;
+}
+
+
+/*
+ * Copy the original label of the file @fh into @label, if not NULL.
+ * Returns true if it is journaled.
+ */
+static bool
+SmackJournalLookup(SmackJournalPtr journal,
+                   SmackFileHandlePtr fh,
+                   char *label)
+{
+    char key[SMACK_INODE_KEY_BUFLEN];
+    uint64_t gen = SmackJournalGeneration(fh);
+    intptr_t idx;
+
+    SmackFormatInodeKey(&fh->sb, key);
+
+    virMutexLock(&journal->lock);
+    idx = SmackJournalFindLocked(journal, key, gen);
+    if (idx && label)
+        memcpy(label, journal->records[idx - 1].label, SMACK_LABEL_LEN + 1);
+    virMutexUnlock(&journal->lock);
+
+    return idx != 0;
+}
+
+
+/*
+ * Record @label as the original label of the file @fh unless one is
+ * journaled already. Failing is not fatal, the file is then restored
+ * to SECURITY_SMACK_UNUSED_LABEL.
+ */
+static void
+SmackJournalAppend(SmackJournalPtr journal,
+                   SmackFileHandlePtr fh,
+                   const char *label)
+{
+    SmackJournalRecordPtr rec;
+    char key[SMACK_INODE_KEY_BUFLEN];
+    uint64_t gen = SmackJournalGeneration(fh);
+    char ebuf[1024];
+    size_t idx;
+
+    SmackFormatInodeKey(&fh->sb, key);
+
+    virMutexLock(&journal->lock);
+
+    if (SmackJournalFindLocked(journal, key, gen))
+        goto cleanup;
+
+    if (journal->nrecords == journal->capacity &&
+        SmackJournalMap(journal, journal->capacity * 2) < 0) {
+        VIR_WARN("Unable to grow label journal %s: %s", SMACK_JOURNAL_FILE,
+                 virStrerror(errno, ebuf, sizeof(ebuf)));
+        goto cleanup;
+    }
+
+    idx = journal->nrecords;
+    rec = &journal->records[idx];
+    rec->dev = fh->sb.st_dev;
+    rec->ino = fh->sb.st_ino;
+    rec->gen = gen;
+    memset(rec->label, 0, sizeof(rec->label));
+    memcpy(rec->label, label, MIN(strlen(label), SMACK_LABEL_LEN));
+
+    /* A crash must not leave a live record with a torn label */
+    __sync_synchronize();
+    rec->state = SMACK_JOURNAL_LIVE;
+    journal->nrecords++;
+
+    if (virHashAddEntry(journal->index, key,
+                        (void *) (intptr_t) (idx + 1)) < 0) {
+        VIR_WARN("Unable to index original label of %s", key);
+        virResetLastError();
+        rec->state = SMACK_JOURNAL_DEAD;
+        goto cleanup;
+    }
+    journal->nlive++;
+
+cleanup:
+    virMutexUnlock(&journal->lock);
+}
+
+
+/*
+ * Rewrite @journal with its live records only, with its lock held. The
+ * new file is renamed over the old one, so a crash leaves either.
+ */
+static void
+SmackJournalCompact(SmackJournalPtr journal)
+{
+    SmackJournal next = { .fd = -1 };
+    const char *tmp = SMACK_JOURNAL_FILE ".new";
+    char ebuf[1024];
+    size_t n = 0;
+    size_t i;
+
+    if ((next.fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0600)) < 0 ||
+        SmackJournalMap(&next, MAX(journal->nlive * 2,
+                                   SMACK_JOURNAL_CHUNK)) < 0) {
+        VIR_WARN("Unable to compact label journal %s: %s",
+                 SMACK_JOURNAL_FILE, virStrerror(errno, ebuf, sizeof(ebuf)));
+        goto cleanup;
+    }
+
+    memcpy(next.map, journal->map, sizeof(SmackJournalHeader));
+    for (i = 0; i < journal->nrecords; i++) {
+        if (journal->records[i].state == SMACK_JOURNAL_LIVE)
+            next.records[n++] = journal->records[i];
+    }
+
+    if (SmackJournalIndex(&next) < 0) {
+        virResetLastError();
+        goto cleanup;
+    }
+
+    /* Other processes must find the new file locked as well */
+    if (flock(next.fd, LOCK_EX | LOCK_NB) < 0 ||
+        rename(tmp, SMACK_JOURNAL_FILE) < 0) {
+        VIR_WARN("Unable to compact label journal %s: %s",
+                 SMACK_JOURNAL_FILE, virStrerror(errno, ebuf, sizeof(ebuf)));
+        goto cleanup;
+    }
+
+    VIR_DEBUG("Compacted label journal from %zu to %zu records",
+              journal->nrecords, next.nrecords);
+
+    munmap(journal->map, journal->mapsize);
+    VIR_FORCE_CLOSE(journal->fd);
+    virHashFree(journal->index);
+    journal->fd = next.fd;
+    journal->map = next.map;
+    journal->mapsize = next.mapsize;
+    journal->records = next.records;
+    journal->capacity = next.capacity;
+    journal->nrecords = next.nrecords;
+    journal->nlive = next.nlive;
+    journal->index = next.index;
+    return;
+
+cleanup:
+    if (next.map)
+        munmap(next.map, next.mapsize);
+    if (next.fd >= 0)
+        ignore_value(unlink(tmp));
+    VIR_FORCE_CLOSE(next.fd);
+    virHashFree(next.index);
+}
+
+
+/* Drop the record of the inode @sb once its original label is back */
+static void
+SmackJournalForget(SmackJournalPtr journal,
+                   const struct stat *sb)
+{
+    char key[SMACK_INODE_KEY_BUFLEN];
+    intptr_t idx;
+
+    SmackFormatInodeKey(sb, key);
+
+    virMutexLock(&journal->lock);
+
+    if (!(idx = (intptr_t) virHashLookup(journal->index, key)))
+        goto cleanup;
+
+    journal->records[idx - 1].state = SMACK_JOURNAL_DEAD;
+    virHashRemoveEntry(journal->index, key);
+    journal->nlive--;
+
+    if (journal->nrecords >= SMACK_JOURNAL_CHUNK &&
+        journal->nrecords - journal->nlive > journal->nlive)
+        SmackJournalCompact(journal);
+
+cleanup:
+    virMutexUnlock(&journal->lock);
+}
+
+
+/* Journal the label @fh carries before it is first set to @tlabel */
+static void
+SmackJournalNote(virSecurityManagerPtr mgr,
+                 SmackFileHandlePtr fh,
+                 const char *tlabel)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char cur[SMACK_LABEL_LEN + 1];
+
+    if (!priv->journal || STREQ(tlabel, SECURITY_SMACK_UNUSED_LABEL) ||
+        SmackJournalLookup(priv->journal, fh, NULL))
+        return;
+
+    if (SmackFileGetXattr(fh, cur, sizeof(cur)) < 0) {
+        /* Files which can't carry a label fail when setting it */
+        if (errno != ENODATA)
+            return;
+        cur[0] = '\0';
+    }
+
+    /* Labeled before the journal got lost, e.g. with /run at reboot;
+     * the original label is gone too */
+    if (STREQ(cur, tlabel))
+        return;
+
+    SmackJournalAppend(priv->journal, fh, cur);
+}
+
+
+static int
+SmackSetFileLabelHelperInt(virSecurityManagerPtr mgr,
+                           const char *path,
+                           const char *tlabel)
+{
+    SmackFileHandle fh;
+    int ret;
+
+    if (SmackFileOpen(path, &fh) < 0) {
+        virReportSystemError(errno,
+                             _("unable to set security context '%s' on '%s'"),
+                             tlabel, path);
+        return -1;
+    }
+
+    SmackJournalNote(mgr, &fh, tlabel);
+    ret = SmackSetFileLabelHandle(mgr, &fh, tlabel);
+    SmackFileClose(&fh);
+    return ret;
+}
+
+
+static int
+SmackSetFileLabelHelper(virSecurityManagerPtr mgr,
+                        const char *path,
+                        const char *tlabel)
+{
+    SmackStatsProbe probe;
+    int ret;
+
+    SmackStatsBegin(&probe);
+    ret = SmackSetFileLabelHelperInt(mgr, path, tlabel);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_SET_FILE_LABEL, &probe);
+    return ret;
+}
+
+static int
+SmackSetFileLabel(virSecurityManagerPtr mgr,
+                  const char *path,
+                  const char *label)
+{
+    return SmackSetFileLabelHelper(mgr, path, label);
+}
+
+
+
+static int SmackRestoreSecurityFileLabel(virSecurityManagerPtr mgr,
+                                         const char *path);
+
+/*
+ * Relabel plans collect plain "set this label on that path" operations
+ * of a bulk operation (restoring all disks, iterating the files of a
+ * host device) and run them in one go. With liburing and a kernel
+ * supporting IORING_OP_FSETXATTR and IORING_OP_STATX, regular files and
+ * directories are opened once, and the label write of each, linked to
+ * a statx of the same descriptor for the label cache, is submitted to
+ * an io_uring and reaped as it completes. Nothing is resolved by path
+ * again after the open. Other files (device nodes may react to being
+ * opened), or all of them if the ring can't be set up (e.g. blocked by
+ * seccomp), take the synchronous helper. Any operation the ring failed
+ * is replayed synchronously too, so errors are classified and
+ * reported exactly like for single files.
+ */
+
+/* Plans smaller than this are not worth setting up a ring for */
+#define SMACK_URING_MIN_BATCH       4
+#define SMACK_URING_DEPTH           256
+
+#if WITH_LIBURING
+/* Whether the kernel has io_uring with IORING_OP_FSETXATTR and
+ * IORING_OP_STATX, probed once per process and only read afterwards */
+static bool smackHaveUring;
+
+static int
+SmackUringOnceInit(void)
+{
+    struct io_uring ring;
+    struct io_uring_probe *probe;
+    int rc;
+
+    if ((rc = io_uring_queue_init(1, &ring, 0)) < 0) {
+        VIR_DEBUG("io_uring unavailable, using synchronous relabel: %d", rc);
+        return 0;
+    }
+
+    if ((probe = io_uring_get_probe_ring(&ring))) {
+        smackHaveUring =
+            io_uring_opcode_supported(probe, IORING_OP_FSETXATTR) &&
+            io_uring_opcode_supported(probe, IORING_OP_STATX);
+        io_uring_free_probe(probe);
+    }
+    io_uring_queue_exit(&ring);
+
+    VIR_DEBUG("io_uring fsetxattr %savailable", smackHaveUring ? "" : "not ");
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(SmackUring)
+#endif
+
+typedef struct _SmackRelabelItem SmackRelabelItem;
+typedef SmackRelabelItem *SmackRelabelItemPtr;
+
+struct _SmackRelabelItem {
+    char *path;
+    const char *label;
+    bool done;
+    /* label found in the label cache, nothing submitted */
+    bool cached;
+    /* restore of a journaled original label, kept in @orig */
+    bool journaled;
+    char orig[SMACK_LABEL_LEN + 1];
+#if WITH_LIBURING
+    /* descriptor the ring labels, or -1 */
+    int fd;
+    struct stat sb;
+    struct statx stx;
+    /* result of the linked statx, 0 or -errno */
+    int stxres;
+#endif
+    /* result of the asynchronous setxattr, 0 or -errno */
+    int res;
+};
+
+struct _SmackRelabelPlan {
+    virMutex lock;
+    SmackRelabelItemPtr items;
+    size_t nitems;
+    size_t nitems_max;
+};
+
+
+/*
+ * Whether bulk operations of @mgr should be collected into a plan
+ * rather than executed file by file.
+ */
+static bool
+SmackRelabelPlanWanted(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED)
+{
+#if WITH_LIBURING
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    bool ret;
+
+    /* The ring talks to the kernel directly */
+    if (smackBackend != &smackKernelBackend)
+        return false;
+
+    if (SmackUringInitialize() < 0 || !smackHaveUring)
+        return false;
+
+    virMutexLock(&priv->lock);
+    ret = priv->useUring;
+    virMutexUnlock(&priv->lock);
+    return ret;
+#else
+    return false;
+#endif
+}
+
+
+static SmackRelabelPlanPtr
+SmackRelabelPlanNew(void)
+{
+    SmackRelabelPlanPtr plan;
+
+    if (VIR_ALLOC(plan) < 0)
+        return NULL;
+
+    if (virMutexInit(&plan->lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize relabel plan mutex"));
+        VIR_FREE(plan);
+        return NULL;
+    }
+
+    return plan;
+}
+
+
+static void
+SmackRelabelPlanFree(SmackRelabelPlanPtr plan)
+{
+    size_t i;
+
+    if (!plan)
+        return;
+
+    for (i = 0; i < plan->nitems; i++)
+        VIR_FREE(plan->items[i].path);
+    VIR_FREE(plan->items);
+    virMutexDestroy(&plan->lock);
+    VIR_FREE(plan);
+}
+
+
+/* @label must outlive the plan */
+static int
+SmackRelabelPlanAdd(SmackRelabelPlanPtr plan,
+                    const char *path,
+                    const char *label)
+{
+    SmackRelabelItemPtr item;
+    int ret = -1;
+
+    virMutexLock(&plan->lock);
+
+    if (VIR_RESIZE_N(plan->items, plan->nitems_max, plan->nitems, 1) < 0)
+        goto cleanup;
+
+    item = &plan->items[plan->nitems];
+    memset(item, 0, sizeof(*item));
+    if (VIR_STRDUP(item->path, path) < 0)
+        goto cleanup;
+    item->label = label;
+    plan->nitems++;
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&plan->lock);
+    return ret;
+}
+
+
+#if WITH_LIBURING
+/* Completions carry the item index, doubled, plus one for the statx */
+static void
+SmackRelabelPlanReap(SmackRelabelPlanPtr plan,
+                     struct io_uring_cqe *cqe)
+{
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    SmackRelabelItemPtr item = &plan->items[data / 2];
+
+    if (data % 2) {
+        item->stxres = cqe->res;
+    } else {
+        item->res = cqe->res;
+        item->done = true;
+    }
+}
+
+
+/*
+ * Open the file of @item for the ring. fsetxattr(2) needs a real
+ * descriptor, which is reopened from the O_PATH one rather than from
+ * the path so that it is the very inode just examined.
+ */
+static void
+SmackRelabelItemOpen(SmackRelabelItemPtr item,
+                     SmackFileHandlePtr fh)
+{
+    if (fh->fd < 0 ||
+        !(S_ISREG(fh->sb.st_mode) || S_ISDIR(fh->sb.st_mode)))
+        return;
+
+    item->fd = SMACK_SYSCALL(open(fh->procpath, O_RDONLY | O_NONBLOCK |
+                                  O_NOCTTY | O_CLOEXEC));
+    item->sb = fh->sb;
+}
+
+
+/*
+ * Submit the label write of every item of @plan not known from the
+ * label cache to carry its label already to an io_uring. Original
+ * labels are journaled before anything is submitted, and restores put
+ * back the journaled ones, exactly as the synchronous path does. Items
+ * the ring did not complete are left with done == false. Returns -1
+ * if the ring can't be set up.
+ */
+static int
+SmackRelabelPlanRunUring(virSecurityManagerPtr mgr,
+                         SmackRelabelPlanPtr plan)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    struct io_uring ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    size_t next = 0;
+    size_t unsubmitted = 0;
+    size_t inflight = 0;
+    size_t i;
+    int ret = -1;
+    int rc;
+
+    for (i = 0; i < plan->nitems; i++) {
+        SmackRelabelItemPtr item = &plan->items[i];
+        SmackFileHandle fh;
+
+        item->fd = -1;
+
+        /* Left for the synchronous path to report */
+        if (SmackFileOpen(item->path, &fh) < 0)
+            continue;
+
+        if (STREQ(item->label, SECURITY_SMACK_UNUSED_LABEL)) {
+            if (priv->journal &&
+                SmackJournalLookup(priv->journal, &fh, item->orig)) {
+                item->journaled = true;
+                /* Files which had no label get the unused one */
+                if (item->orig[0])
+                    item->label = item->orig;
+            }
+        } else {
+            SmackJournalNote(mgr, &fh, item->label);
+        }
+
+        if (SmackLabelCacheLookup(priv, &fh.sb, item->label)) {
+            item->cached = true;
+            item->done = true;
+        } else {
+            SmackRelabelItemOpen(item, &fh);
+        }
+        SmackFileClose(&fh);
+    }
+
+    if ((rc = io_uring_queue_init(MIN(plan->nitems * 2, SMACK_URING_DEPTH),
+                                  &ring, 0)) < 0) {
+        VIR_DEBUG("io_uring unavailable, using synchronous relabel: %d", rc);
+        goto cleanup;
+    }
+
+    while (next < plan->nitems || inflight > 0) {
+        while (next < plan->nitems) {
+            SmackRelabelItemPtr item = &plan->items[next];
+
+            if (item->done || item->fd < 0) {
+                next++;
+                continue;
+            }
+            if (io_uring_sq_space_left(&ring) < 2)
+                break;
+
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_fsetxattr(sqe, item->fd, smackXattrName,
+                                    item->label, 0, strlen(item->label) + 1);
+            io_uring_sqe_set_data64(sqe, next * 2);
+            /* setxattr bumps the ctime, fetch the post-relabel value */
+            sqe->flags |= IOSQE_IO_LINK;
+
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_statx(sqe, item->fd, "", AT_EMPTY_PATH,
+                                STATX_CTIME, &item->stx);
+            io_uring_sqe_set_data64(sqe, next * 2 + 1);
+
+            unsubmitted += 2;
+            next++;
+        }
+
+        if (unsubmitted > 0) {
+            if ((rc = io_uring_submit(&ring)) < 0) {
+                VIR_DEBUG("io_uring submission failed: %d", rc);
+                break;
+            }
+            unsubmitted -= rc;
+            inflight += rc;
+        }
+
+        if (inflight == 0)
+            break;
+
+        if ((rc = io_uring_wait_cqe(&ring, &cqe)) < 0) {
+            if (rc == -EINTR)
+                continue;
+            VIR_DEBUG("io_uring completion failed: %d", rc);
+            break;
+        }
+        SmackRelabelPlanReap(plan, cqe);
+        io_uring_cqe_seen(&ring, cqe);
+        inflight--;
+    }
+
+    /* The kernel may still write to statx buffers of submitted items */
+    while (inflight > 0) {
+        if ((rc = io_uring_wait_cqe(&ring, &cqe)) < 0) {
+            if (rc == -EINTR)
+                continue;
+            break;
+        }
+        SmackRelabelPlanReap(plan, cqe);
+        io_uring_cqe_seen(&ring, cqe);
+        inflight--;
+    }
+
+    io_uring_queue_exit(&ring);
+
+    for (i = 0; i < plan->nitems; i++) {
+        SmackRelabelItemPtr item = &plan->items[i];
+
+        if (item->fd < 0 || !item->done || item->res != 0)
+            continue;
+
+        if (item->stxres == 0) {
+            item->sb.st_ctim.tv_sec = item->stx.stx_ctime.tv_sec;
+            item->sb.st_ctim.tv_nsec = item->stx.stx_ctime.tv_nsec;
+            SmackLabelCacheUpdate(priv, &item->sb, item->label);
+        }
+        if (item->journaled)
+            SmackJournalForget(priv->journal, &item->sb);
+    }
+
+    ret = 0;
+
+cleanup:
+    for (i = 0; i < plan->nitems; i++) {
+        if (plan->items[i].fd >= 0)
+            SMACK_COUNT_SYSCALL();
+        VIR_FORCE_CLOSE(plan->items[i].fd);
+    }
+    return ret;
+}
+#endif /* WITH_LIBURING */
+
+
+/*
+ * Execute all operations of @plan. Every operation is attempted; if
+ * some fail the error of the first one is reported and -1 returned.
+ */
+static int
+SmackRelabelPlanRun(virSecurityManagerPtr mgr,
+                    SmackRelabelPlanPtr plan)
+{
+    virErrorPtr firstErr = NULL;
+    size_t nasync = 0;
+    size_t i;
+    int ret = 0;
+    int rc;
+
+    if (!plan || plan->nitems == 0)
+        return 0;
+
+#if WITH_LIBURING
+    if (plan->nitems >= SMACK_URING_MIN_BATCH && SmackRelabelPlanWanted(mgr))
+        ignore_value(SmackRelabelPlanRunUring(mgr, plan));
+#endif
+
+    for (i = 0; i < plan->nitems; i++) {
+        SmackRelabelItemPtr item = &plan->items[i];
+
+        if (item->done && item->res == 0) {
+            nasync++;
+            continue;
+        }
+
+        /* Restores put journaled original labels back */
+        if (item->journaled ||
+            STREQ(item->label, SECURITY_SMACK_UNUSED_LABEL))
+            rc = SmackRestoreSecurityFileLabel(mgr, item->path);
+        else
+            rc = SmackSetFileLabelHelper(mgr, item->path, item->label);
+
+        if (rc < 0) {
+            if (!firstErr)
+                firstErr = virSaveLastError();
+            ret = -1;
+        }
+    }
+
+    VIR_DEBUG("Relabel plan of %zu files, %zu completed asynchronously",
+              plan->nitems, nasync);
+
+    if (firstErr) {
+        virSetError(firstErr);
+        virFreeError(firstErr);
+    }
+    return ret;
+}
+
+
+static unsigned long long
+SmackNowMs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000ull + now.tv_nsec / 1000000;
+}
+
+
+/*
+ * Deferred restores. In deferred mode, the top layer restores of a
+ * domain's disks are handed to a queue drained by a thread of its own,
+ * so that destroying a domain doesn't wait for slow storage. Pending
+ * paths are mirrored to a file under /run named after the virt driver
+ * of the manager and queued again at Open, and labeling an image first
+ * drops any restore still queued for it. Only one manager per virt
+ * driver may own a queue file at a time.
+ */
+typedef struct _SmackRestoreEntry SmackRestoreEntry;
+typedef SmackRestoreEntry *SmackRestoreEntryPtr;
+
+struct _SmackRestoreEntry {
+    /* SmackNowMs() when queued */
+    unsigned long long queued;
+    /* being restored by the queue thread */
+    bool busy;
+};
+
+struct _SmackRestoreQueue {
+    virSecurityManagerPtr mgr;
+    /* queue file, and the one it is rewritten through */
+    char *path;
+    char *tmppath;
+    virMutex lock;
+    /* broadcast whenever entries are added or done */
+    virCond cond;
+    virThread thread;
+    bool quit;
+
+    /* path -> SmackRestoreEntryPtr */
+    virHashTablePtr entries;
+    /* size of entries, also read without lock */
+    size_t npending;
+    virSmackDeferredRestoreStats stats;
+};
+
+
+static void
+SmackRestoreQueueFormat(void *payload ATTRIBUTE_UNUSED,
+                        const void *name,
+                        void *opaque)
+{
+    virBufferAsprintf(opaque, "%s\n", (const char *) name);
+}
+
+
+/* Mirror the pending paths of @queue to its file, with its lock held */
+static void
+SmackRestoreQueueSave(SmackRestoreQueuePtr queue)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char ebuf[1024];
+
+    if (queue->npending == 0) {
+        if (unlink(queue->path) < 0 && errno != ENOENT)
+            VIR_WARN("Unable to remove %s: %s", queue->path,
+                     virStrerror(errno, ebuf, sizeof(ebuf)));
+        return;
+    }
+
+    virHashForEach(queue->entries, SmackRestoreQueueFormat, &buf);
+    if (virBufferError(&buf)) {
+        VIR_WARN("Unable to save %zu deferred restores: out of memory",
+                 queue->npending);
+        goto cleanup;
+    }
+
+    if (virFileWriteStr(queue->tmppath, virBufferCurrentContent(&buf),
+                        0600) < 0 ||
+        rename(queue->tmppath, queue->path) < 0) {
+        VIR_WARN("Unable to save %zu deferred restores to %s: %s",
+                 queue->npending, queue->path,
+                 virStrerror(errno, ebuf, sizeof(ebuf)));
+        ignore_value(unlink(queue->tmppath));
+    }
+
+cleanup:
+    virBufferFreeAndReset(&buf);
+}
+
+
+/* Queue @path, with the lock of @queue held */
+static int
+SmackRestoreQueueAddLocked(SmackRestoreQueuePtr queue,
+                           const char *path,
+                           unsigned long long now)
+{
+    SmackRestoreEntryPtr entry;
+
+    /* Newlines would break the queue file */
+    if (strchr(path, '\n')) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("cannot defer restoring label of '%s'"), path);
+        return -1;
+    }
+
+    if (virHashLookup(queue->entries, path))
+        return 0;
+
+    if (VIR_ALLOC(entry) < 0)
+        return -1;
+    entry->queued = now;
+
+    if (virHashAddEntry(queue->entries, path, entry) < 0) {
+        VIR_FREE(entry);
+        return -1;
+    }
+
+    __sync_add_and_fetch(&queue->npending, 1);
+    queue->stats.queued++;
+    return 0;
+}
+
+
+static void
+SmackRestoreQueueRemoveLocked(SmackRestoreQueuePtr queue,
+                              const char *path)
+{
+    if (virHashRemoveEntry(queue->entries, path) == 0)
+        __sync_sub_and_fetch(&queue->npending, 1);
+}
+
+
+/*
+ * Queue the operations of @plan, all of them restores, for the queue
+ * thread to do. On failure the caller is expected to run @plan.
+ */
+static int
+SmackRestoreQueuePush(virSecurityManagerPtr mgr,
+                      SmackRelabelPlanPtr plan)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    SmackRestoreQueuePtr queue = priv->restoreQueue;
+    unsigned long long now = SmackNowMs();
+    size_t i;
+    int ret = 0;
+
+    if (!plan || plan->nitems == 0)
+        return 0;
+
+    virMutexLock(&queue->lock);
+    for (i = 0; i < plan->nitems && ret == 0; i++)
+        ret = SmackRestoreQueueAddLocked(queue, plan->items[i].path, now);
+    SmackRestoreQueueSave(queue);
+    virCondBroadcast(&queue->cond);
+    virMutexUnlock(&queue->lock);
+
+    if (ret == 0)
+        VIR_DEBUG("Deferred %zu label restores", plan->nitems);
+    return ret;
+}
+
+
+/*
+ * Make sure no restore queued for @path undoes a label about to be
+ * set on it: a queued restore is dropped, one in progress waited for.
+ */
+static void
+SmackRestoreQueueBarrier(virSecurityManagerPtr mgr,
+                         const char *path)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    SmackRestoreQueuePtr queue = priv->restoreQueue;
+    SmackRestoreEntryPtr entry;
+
+    if (!queue || __sync_add_and_fetch(&queue->npending, 0) == 0)
+        return;
+
+    virMutexLock(&queue->lock);
+    while ((entry = virHashLookup(queue->entries, path)) && entry->busy)
+        ignore_value(virCondWait(&queue->cond, &queue->lock));
+
+    if (entry) {
+        VIR_DEBUG("Dropping deferred restore of %s", path);
+        SmackRestoreQueueRemoveLocked(queue, path);
+        queue->stats.cancelled++;
+        SmackRestoreQueueSave(queue);
+    }
+    virMutexUnlock(&queue->lock);
+}
+
+
+typedef struct _SmackRestoreBatch SmackRestoreBatch;
+typedef SmackRestoreBatch *SmackRestoreBatchPtr;
+
+struct _SmackRestoreBatch {
+    char *paths[SMACK_RESTORE_BATCH];
+    size_t npaths;
+};
+
+
+static void
+SmackRestoreQueueTake(void *payload,
+                      const void *name,
+                      void *opaque)
+{
+    SmackRestoreEntryPtr entry = payload;
+    SmackRestoreBatchPtr batch = opaque;
+
+    if (entry->busy || batch->npaths == SMACK_RESTORE_BATCH ||
+        VIR_STRDUP_QUIET(batch->paths[batch->npaths], name) < 0)
+        return;
+
+    entry->busy = true;
+    batch->npaths++;
+}
+
+
+static void
+SmackRestoreQueueThread(void *opaque)
+{
+    SmackRestoreQueuePtr queue = opaque;
+    SmackRestoreBatch batch;
+    size_t i;
+
+    virMutexLock(&queue->lock);
+    while (!queue->quit) {
+        memset(&batch, 0, sizeof(batch));
+        virHashForEach(queue->entries, SmackRestoreQueueTake, &batch);
+        if (batch.npaths == 0) {
+            ignore_value(virCondWait(&queue->cond, &queue->lock));
+            continue;
+        }
+        virMutexUnlock(&queue->lock);
+
+        for (i = 0; i < batch.npaths; i++) {
+            const char *path = batch.paths[i];
+            SmackRestoreEntryPtr entry;
+            unsigned long long latency;
+            int rc;
+
+            rc = SmackRestoreSecurityFileLabel(queue->mgr, path);
+            if (rc < 0)
+                virResetLastError();
+
+            virMutexLock(&queue->lock);
+            entry = virHashLookup(queue->entries, path);
+            latency = SmackNowMs() - entry->queued;
+            VIR_DEBUG("Deferred restore of %s %s after %llu ms", path,
+                      rc < 0 ? "failed" : "done", latency);
+
+            if (rc < 0)
+                queue->stats.failed++;
+            else
+                queue->stats.completed++;
+            queue->stats.latencyMs += latency;
+            queue->stats.maxLatencyMs = MAX(queue->stats.maxLatencyMs,
+                                            latency);
+            SmackRestoreQueueRemoveLocked(queue, path);
+            virCondBroadcast(&queue->cond);
+            virMutexUnlock(&queue->lock);
+
+            VIR_FREE(batch.paths[i]);
+        }
+
+        virMutexLock(&queue->lock);
+        SmackRestoreQueueSave(queue);
+    }
+    virMutexUnlock(&queue->lock);
+}
+
+
+/* Queue the restores left pending by a previous daemon */
+static void
+SmackRestoreQueueLoad(SmackRestoreQueuePtr queue)
+{
+    unsigned long long now = SmackNowMs();
+    char *buf = NULL;
+    char *path;
+    char *next;
+    size_t n = 0;
+
+    if (!virFileExists(queue->path))
+        return;
+
+    if (virFileReadAll(queue->path, SMACK_RESTORE_QUEUE_MAX, &buf) < 0) {
+        VIR_WARN("Unable to load deferred restores from %s", queue->path);
+        virResetLastError();
+        return;
+    }
+
+    virMutexLock(&queue->lock);
+    for (path = buf; *path; path = next) {
+        if ((next = strchr(path, '\n')))
+            *next++ = '\0';
+        else
+            next = path + strlen(path);
+
+        if (!*path)
+            continue;
+
+        if (SmackRestoreQueueAddLocked(queue, path, now) < 0)
+            virResetLastError();
+        else
+            n++;
+    }
+    virMutexUnlock(&queue->lock);
+
+    VIR_INFO("Resuming %zu deferred label restores", n);
+    VIR_FREE(buf);
+}
+
+
+/* Queue files owned by a queue of this process, guarded by
+ * smackRestoreQueuesLock */
+static virMutex smackRestoreQueuesLock;
+static virHashTablePtr smackRestoreQueues;
+
+static int
+SmackRestoreQueuesOnceInit(void)
+{
+    if (virMutexInit(&smackRestoreQueuesLock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize smack driver mutex"));
+        return -1;
+    }
+
+    if (!(smackRestoreQueues = virHashCreate(4, NULL)))
+        return -1;
+
+    return 0;
+}
+
+VIR_ONCE_GLOBAL_INIT(SmackRestoreQueues)
+
+
+/* Claim the queue file @path for this process, or fail if it is
+ * already owned by another manager */
+static int
+SmackRestoreQueueClaim(const char *path)
+{
+    int ret = -1;
+
+    if (SmackRestoreQueuesInitialize() < 0)
+        return -1;
+
+    virMutexLock(&smackRestoreQueuesLock);
+    if (virHashLookup(smackRestoreQueues, path)) {
+        virReportError(VIR_ERR_OPERATION_INVALID,
+                       _("restore queue '%s' is already in use"), path);
+        goto cleanup;
+    }
+    ret = virHashAddEntry(smackRestoreQueues, path, (void *) 1);
+
+cleanup:
+    virMutexUnlock(&smackRestoreQueuesLock);
+    return ret;
+}
+
+
+static void
+SmackRestoreQueueUnclaim(const char *path)
+{
+    virMutexLock(&smackRestoreQueuesLock);
+    ignore_value(virHashRemoveEntry(smackRestoreQueues, path));
+    virMutexUnlock(&smackRestoreQueuesLock);
+}
+
+
+static void
+SmackRestoreQueueFree(SmackRestoreQueuePtr queue)
+{
+    if (!queue)
+        return;
+
+    /* Whatever is left stays in the queue file */
+    virMutexLock(&queue->lock);
+    queue->quit = true;
+    virCondBroadcast(&queue->cond);
+    virMutexUnlock(&queue->lock);
+    virThreadJoin(&queue->thread);
+
+    SmackRestoreQueueUnclaim(queue->path);
+    virHashFree(queue->entries);
+    virCondDestroy(&queue->cond);
+    virMutexDestroy(&queue->lock);
+    VIR_FREE(queue->tmppath);
+    VIR_FREE(queue->path);
+    VIR_FREE(queue);
+}
+
+
+static SmackRestoreQueuePtr
+SmackRestoreQueueNew(virSecurityManagerPtr mgr)
+{
+    const char *driver = virSecurityManagerGetDriver(mgr);
+    SmackRestoreQueuePtr queue;
+    bool claimed = false;
+
+    if (VIR_ALLOC(queue) < 0)
+        return NULL;
+    queue->mgr = mgr;
+
+    if (virMutexInit(&queue->lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize restore queue mutex"));
+        VIR_FREE(queue);
+        return NULL;
+    }
+
+    if (virCondInit(&queue->cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize restore queue condition"));
+        virMutexDestroy(&queue->lock);
+        VIR_FREE(queue);
+        return NULL;
+    }
+
+    if (virAsprintf(&queue->path, "%s%s", SMACK_RESTORE_QUEUE_PREFIX,
+                    driver ? driver : "default") < 0 ||
+        virAsprintf(&queue->tmppath, "%s.new", queue->path) < 0)
+        goto error;
+
+    if (SmackRestoreQueueClaim(queue->path) < 0)
+        goto error;
+    claimed = true;
+
+    if (!(queue->entries = virHashCreate(64, virHashValueFree)))
+        goto error;
+
+    if (virFileMakePath(SMACK_STATE_DIR) < 0) {
+        virReportSystemError(errno, _("unable to create directory '%s'"),
+                             SMACK_STATE_DIR);
+        goto error;
+    }
+
+    SmackRestoreQueueLoad(queue);
+
+    if (virThreadCreate(&queue->thread, true,
+                        SmackRestoreQueueThread, queue) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to create restore queue thread"));
+        goto error;
+    }
+
+    return queue;
+
+error:
+    if (claimed)
+        SmackRestoreQueueUnclaim(queue->path);
+    virHashFree(queue->entries);
+    virCondDestroy(&queue->cond);
+    virMutexDestroy(&queue->lock);
+    VIR_FREE(queue->tmppath);
+    VIR_FREE(queue->path);
+    VIR_FREE(queue);
+    return NULL;
+}
+
+
+/*
+ * Host device files cache. The device nodes and sysfs files of a host
+ * device are enumerated once, when it is labeled, and kept per domain
+ * until its labels are restored, so that restoring doesn't have to
+ * look the device up and walk sysfs again.
+ */
+struct _SmackHostdevFiles {
+    char **files;
+    size_t nfiles;
+    size_t nfiles_max;
+};
+
+
+static void
+SmackHostdevFilesFree(SmackHostdevFilesPtr files)
+{
+    size_t i;
+
+    if (!files)
+        return;
+
+    for (i = 0; i < files->nfiles; i++)
+        VIR_FREE(files->files[i]);
+    VIR_FREE(files->files);
+    VIR_FREE(files);
+}
+
+
+static int
+SmackHostdevFilesAdd(SmackHostdevFilesPtr files,
+                     const char *file)
+{
+    char *copy;
+
+    if (VIR_STRDUP(copy, file) < 0)
+        return -1;
+
+    if (VIR_RESIZE_N(files->files, files->nfiles_max,
+                     files->nfiles, 1) < 0) {
+        VIR_FREE(copy);
+        return -1;
+    }
+
+    files->files[files->nfiles++] = copy;
+    return 0;
+}
+
+
+static void
+SmackHostdevFilesHashFree(void *payload,
+                          const void *name ATTRIBUTE_UNUSED,
+                          void *opaque ATTRIBUTE_UNUSED)
+{
+    SmackHostdevFilesFree(payload);
+}
+
+
+/* The per-domain tables have no free function, so that entries can be
+ * taken out of them; this frees one with everything left in it */
+static void
+SmackDomainHostdevsFree(void *payload,
+                        const void *name ATTRIBUTE_UNUSED)
+{
+    virHashTablePtr table = payload;
+
+    if (!table)
+        return;
+
+    virHashForEach(table, SmackHostdevFilesHashFree, NULL);
+    virHashFree(table);
+}
+
+
+/*
+ * Identify the host device @dev as seen below @vroot.
+ */
+static char *
+SmackHostdevKey(virDomainHostdevDefPtr dev,
+                const char *vroot)
+{
+    const char *root = vroot ? vroot : "";
+    char *key = NULL;
+
+    switch (dev->source.subsys.type) {
+    case VIR_DOMAIN_HOSTDEV_SUBSYS_TYPE_USB:
+        ignore_value(virAsprintf(&key, "%s:usb:%u:%u", root,
+                                 dev->source.subsys.u.usb.bus,
+                                 dev->source.subsys.u.usb.device));
+        break;
+
+    case VIR_DOMAIN_HOSTDEV_SUBSYS_TYPE_PCI:
+        ignore_value(virAsprintf(&key, "%s:pci:%04x:%02x:%02x.%x:%d",
+                                 root,
+                                 dev->source.subsys.u.pci.addr.domain,
+                                 dev->source.subsys.u.pci.addr.bus,
+                                 dev->source.subsys.u.pci.addr.slot,
+                                 dev->source.subsys.u.pci.addr.function,
+                                 dev->source.subsys.u.pci.backend));
+        break;
+
+    case VIR_DOMAIN_HOSTDEV_SUBSYS_TYPE_SCSI:
+        ignore_value(virAsprintf(&key, "%s:scsi:%s:%u:%u:%u",
+                                 root,
+                                 dev->source.subsys.u.scsi.adapter,
+                                 dev->source.subsys.u.scsi.bus,
+                                 dev->source.subsys.u.scsi.target,
+                                 dev->source.subsys.u.scsi.unit));
+        break;
+
+    default:
+        ignore_value(virAsprintf(&key, "%s:%d", root,
+                                 dev->source.subsys.type));
+        break;
+    }
+
+    return key;
+}
+
+
+/*
+ * Remember @files of the host device @key of @def, taking ownership of
+ * them. A failure only means restoring will enumerate them again.
+ */
+static void
+SmackHostdevFilesStore(virSecurityManagerPtr mgr,
+                       virDomainDefPtr def,
+                       const char *key,
+                       SmackHostdevFilesPtr files)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    virHashTablePtr table;
+
+    virUUIDFormat(def->uuid, uuidstr);
+
+    virMutexLock(&priv->lock);
+    if (!(table = virHashLookup(priv->hostdevFiles, uuidstr))) {
+        if (!(table = virHashCreate(8, NULL)))
+            goto error;
+        if (virHashAddEntry(priv->hostdevFiles, uuidstr, table) < 0) {
+            virHashFree(table);
+            goto error;
+        }
+    }
+
+    /* Labeled twice without a restore in between, keep the latest */
+    SmackHostdevFilesFree(virHashLookup(table, key));
+    ignore_value(virHashRemoveEntry(table, key));
+
+    if (virHashAddEntry(table, key, files) < 0)
+        goto error;
+
+    virMutexUnlock(&priv->lock);
+    return;
+
+error:
+    virMutexUnlock(&priv->lock);
+    virResetLastError();
+    SmackHostdevFilesFree(files);
+}
+
+
+/*
+ * Take the cached files of the host device @key of @def out of the
+ * cache, or return NULL if there are none.
+ */
+static SmackHostdevFilesPtr
+SmackHostdevFilesTake(virSecurityManagerPtr mgr,
+                      virDomainDefPtr def,
+                      const char *key)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    SmackHostdevFilesPtr files = NULL;
+    virHashTablePtr table;
+
+    virUUIDFormat(def->uuid, uuidstr);
+
+    virMutexLock(&priv->lock);
+    if ((table = virHashLookup(priv->hostdevFiles, uuidstr)) &&
+        (files = virHashLookup(table, key))) {
+        ignore_value(virHashRemoveEntry(table, key));
+        if (virHashSize(table) == 0)
+            ignore_value(virHashRemoveEntry(priv->hostdevFiles, uuidstr));
+    }
+    virMutexUnlock(&priv->lock);
+
+    return files;
+}
+
+
+/*
+ * Resources labeled for a domain are remembered along with the label
+ * they were given, so that a change of the domain definition only
+ * touches the resources it actually adds, removes or relabels. The
+ * set is kept by the per-device entry points too, and losing track of
+ * a resource only means it gets relabeled.
+ */
+static void
+SmackAppliedEntryFree(void *payload,
+                      const void *name ATTRIBUTE_UNUSED)
+{
+    SmackLabelRelease((intptr_t) payload - 1);
+}
+
+
+static void
+SmackAppliedTableFree(void *payload,
+                      const void *name ATTRIBUTE_UNUSED)
+{
+    virHashFree(payload);
+}
+
+
+/*
+ * Format the key of @disk into @key, or set it to NULL if the disk is
+ * not labeled by the driver.
+ */
+static int
+SmackDiskResourceKey(virDomainDiskDefPtr disk,
+                     char **key)
+{
+    *key = NULL;
+
+    if (disk->type == VIR_DOMAIN_DISK_TYPE_NETWORK || !disk->src)
+        return 0;
+
+    return virAsprintf(key, "disk:%s", disk->src);
+}
+
+
+static int
+SmackHostdevResourceKey(virDomainHostdevDefPtr dev,
+                        const char *vroot,
+                        char **key)
+{
+    char *devkey;
+    int ret;
+
+    *key = NULL;
+
+    switch (dev->mode) {
+    case VIR_DOMAIN_HOSTDEV_MODE_SUBSYS:
+        if (!(devkey = SmackHostdevKey(dev, vroot)))
+            return -1;
+        ret = virAsprintf(key, "hostdev:%s", devkey);
+        VIR_FREE(devkey);
+        return ret;
+
+    case VIR_DOMAIN_HOSTDEV_MODE_CAPABILITIES:
+        switch (dev->source.caps.type) {
+        case VIR_DOMAIN_HOSTDEV_CAPS_TYPE_STORAGE:
+            return virAsprintf(key, "caps:%s/%s", NULLSTR(vroot),
+                               dev->source.caps.u.storage.block);
+        case VIR_DOMAIN_HOSTDEV_CAPS_TYPE_MISC:
+            return virAsprintf(key, "caps:%s/%s", NULLSTR(vroot),
+                               dev->source.caps.u.misc.chardev);
+        default:
+            return 0;
+        }
+
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * Note that the resource @key of @def now carries @label.
+ */
+static void
+SmackAppliedRecord(virSecurityManagerPtr mgr,
+                   virDomainDefPtr def,
+                   const char *key,
+                   const char *label)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    virHashTablePtr table;
+    int id;
+
+    if (!key || !label || (id = SmackLabelIntern(label)) < 0)
+        return;
+
+    virUUIDFormat(def->uuid, uuidstr);
+
+    virMutexLock(&priv->lock);
+    if (!(table = virHashLookup(priv->applied, uuidstr))) {
+        if (!(table = virHashCreate(32, SmackAppliedEntryFree)))
+            goto error;
+        if (virHashAddEntry(priv->applied, uuidstr, table) < 0) {
+            virHashFree(table);
+            goto error;
+        }
+    }
+
+    if (virHashUpdateEntry(table, key, (void *) (intptr_t) (id + 1)) < 0)
+        goto error;
+
+    virMutexUnlock(&priv->lock);
+    return;
+
+error:
+    virMutexUnlock(&priv->lock);
+    virResetLastError();
+    SmackLabelRelease(id);
+}
+
+
+static void
+SmackAppliedForget(virSecurityManagerPtr mgr,
+                   virDomainDefPtr def,
+                   const char *key)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    virHashTablePtr table;
+
+    if (!key)
+        return;
+
+    virUUIDFormat(def->uuid, uuidstr);
+
+    virMutexLock(&priv->lock);
+    if ((table = virHashLookup(priv->applied, uuidstr))) {
+        ignore_value(virHashRemoveEntry(table, key));
+        if (virHashSize(table) == 0)
+            ignore_value(virHashRemoveEntry(priv->applied, uuidstr));
+    }
+    virMutexUnlock(&priv->lock);
+}
+
+
+static void
+SmackAppliedForgetDomain(virSecurityManagerPtr mgr,
+                         virDomainDefPtr def)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+
+    virUUIDFormat(def->uuid, uuidstr);
+
+    virMutexLock(&priv->lock);
+    ignore_value(virHashRemoveEntry(priv->applied, uuidstr));
+    virMutexUnlock(&priv->lock);
+}
+
+
+/*
+ * Make @def hold a reference on its image label @label until
+ * SmackDomainLabelDrop(). The id is kept here rather than looked up by
+ * name when dropping it, as the domain definition may carry a label it
+ * never took a reference on, e.g. one filled in for mount options.
+ */
+static int
+SmackDomainLabelHold(virSecurityManagerPtr mgr,
+                     virDomainDefPtr def,
+                     const char *label)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    int id;
+    int ret;
+
+    if ((id = SmackLabelIntern(label)) < 0) {
+        virReportSystemError(errno, _("unable to intern label '%s'"),
+                             label);
+        return -1;
+    }
+
+    virUUIDFormat(def->uuid, uuidstr);
+
+    /* Held twice, e.g. reserved again, keeps a single reference */
+    virMutexLock(&priv->lock);
+    ret = virHashUpdateEntry(priv->domainLabels, uuidstr,
+                             (void *) (intptr_t) (id + 1));
+    virMutexUnlock(&priv->lock);
+
+    if (ret < 0)
+        SmackLabelRelease(id);
+    return ret;
+}
+
+
+static void
+SmackDomainLabelDrop(virSecurityManagerPtr mgr,
+                     virDomainDefPtr def)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+
+    virUUIDFormat(def->uuid, uuidstr);
+
+    virMutexLock(&priv->lock);
+    ignore_value(virHashRemoveEntry(priv->domainLabels, uuidstr));
+    virMutexUnlock(&priv->lock);
+}
+
+
+static int
+SmackSetSecurityHostdevLabelHelper(const char *file,void *opaque)
+{
+    virSecurityLabelDefPtr seclabel;
+    SmackCallbackDataPtr data = opaque;
+    virDomainDefPtr def = data->def;
+
+    seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
+    if (seclabel == NULL)
+	return -1;
+
+    if (data->plan)
+        return SmackRelabelPlanAdd(data->plan, file, seclabel->imagelabel);
+
+    return SmackSetFileLabel(data->manager, file, seclabel->imagelabel);
+}
+
+
+static int
+SmackCollectUSBFile(virUSBDevicePtr dev ATTRIBUTE_UNUSED,
+                    const char *file, void *opaque)
+{
+    return SmackHostdevFilesAdd(opaque, file);
+}
+
+
+static int
+SmackCollectPCIFile(virPCIDevicePtr dev ATTRIBUTE_UNUSED,
+                    const char *file, void *opaque)
+{
+    return SmackHostdevFilesAdd(opaque, file);
+}
+
+static int
+SmackCollectSCSIFile(virSCSIDevicePtr dev ATTRIBUTE_UNUSED,
+                     const char *file, void *opaque)
+{
+    return SmackHostdevFilesAdd(opaque, file);
+}
+
+
+static int
+SmackRestoreSecurityFileLabelHandle(virSecurityManagerPtr mgr,
+                                    SmackFileHandlePtr fh)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    const char *label = SECURITY_SMACK_UNUSED_LABEL;
+    char orig[SMACK_LABEL_LEN + 1];
+    bool journaled;
+
+    journaled = priv->journal &&
+                SmackJournalLookup(priv->journal, fh, orig);
+
+    /* Files which had no label get the unused one */
+    if (journaled && orig[0])
+        label = orig;
+
+    VIR_INFO("Restoring Smack label '%s' on '%s'", label, fh->path);
+
+    if (SmackSetFileLabelHandle(mgr, fh, label) < 0)
+        return -1;
+
+    if (journaled)
+        SmackJournalForget(priv->journal, &fh->sb);
+    return 0;
+}
+
+
+static int
+SmackRestoreSecurityFileLabelInt(virSecurityManagerPtr mgr,
+                                 const char *path)
+{
+    SmackFileHandle fh;
+    char ebuf[1024];
+    int ret;
+
+    if (SmackFileOpen(path, &fh) < 0) {
+        VIR_WARN("cannot resolve %s: %s", path,
+                 virStrerror(errno, ebuf, sizeof(ebuf)));
+        return -1;
+    }
+
+    ret = SmackRestoreSecurityFileLabelHandle(mgr, &fh);
+    SmackFileClose(&fh);
+    return ret;
+}
+
+
+static int
+SmackRestoreSecurityFileLabel(virSecurityManagerPtr mgr,
+		              const char *path)
+{
+    SmackStatsProbe probe;
+    int ret;
+
+    SmackStatsBegin(&probe);
+    ret = SmackRestoreSecurityFileLabelInt(mgr, path);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_RESTORE_FILE_LABEL, &probe);
+    return ret;
+}
+
+
+static int
+SmackRestoreSecurityHostdevLabelHelper(const char *file, void *opaque)
+{
+    SmackCallbackDataPtr data = opaque;
+
+    if (data->plan)
+        return SmackRelabelPlanAdd(data->plan, file,
+                                   SECURITY_SMACK_UNUSED_LABEL);
+
+    return SmackRestoreSecurityFileLabel(data->manager, file);
+}
+
+
+
+
+
+
+static void
+SmackSharedImageFree(void *payload, const void *name ATTRIBUTE_UNUSED)
+{
+    virSmackSharedImagePtr image = payload;
+
+    if (!image)
+        return;
+
+    virHashFree(image->users);
+    VIR_FREE(image);
+}
+
+
+/*
+ * Make domain @def a user of the shared read-only image @path, putting
+ * the shared label on it if it is the first user and @relabel is set.
+ * Referencing the same image twice from one domain is a no-op.
+ */
+static int
+SmackRefSharedImage(virSecurityManagerPtr mgr,
+                    virDomainDefPtr def,
+                    const char *path,
+                    bool relabel)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    virSmackSharedImagePtr image;
+    char key[SMACK_INODE_KEY_BUFLEN];
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    SmackFileHandle fh;
+    int ret = -1;
+
+    if (SmackFileOpen(path, &fh) < 0) {
+        virReportSystemError(errno,
+                             _("unable to set security context '%s' on '%s'"),
+                             SECURITY_SMACK_SHARED_LABEL, path);
+        return -1;
+    }
+
+    SmackFormatInodeKey(&fh.sb, key);
+    virUUIDFormat(def->uuid, uuidstr);
+
+    virMutexLock(&priv->sharedLock);
+
+    while ((image = virHashLookup(priv->sharedImages, key)) && image->busy)
+        ignore_value(virCondWait(&priv->sharedCond, &priv->sharedLock));
+
+    if (!image) {
+        if (VIR_ALLOC(image) < 0)
+            goto cleanup;
+        if (!(image->users = virHashCreate(8, NULL)) ||
+            virHashAddEntry(priv->sharedImages, key, image) < 0) {
+            SmackSharedImageFree(image, NULL);
+            image = NULL;
+            goto cleanup;
+        }
+    }
+
+    if (virHashLookup(image->users, uuidstr)) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    if (relabel && virHashSize(image->users) == 0) {
+        int rc;
+
+        /* Labeling a slow image must not hold up domains using others */
+        image->busy = true;
+        virMutexUnlock(&priv->sharedLock);
+
+        SmackJournalNote(mgr, &fh, SECURITY_SMACK_SHARED_LABEL);
+        rc = SmackSetFileLabelHandle(mgr, &fh, SECURITY_SMACK_SHARED_LABEL);
+
+        virMutexLock(&priv->sharedLock);
+        image->busy = false;
+        virCondBroadcast(&priv->sharedCond);
+        if (rc < 0)
+            goto cleanup;
+    }
+
+    if (virHashAddEntry(image->users, uuidstr, (void *) 1) < 0)
+        goto cleanup;
+
+    VIR_DEBUG("Shared image %s now used by %zd domains",
+              path, virHashSize(image->users));
+    ret = 0;
+
+cleanup:
+    if (image && virHashSize(image->users) == 0)
+        virHashRemoveEntry(priv->sharedImages, key);
+    virMutexUnlock(&priv->sharedLock);
+    SmackFileClose(&fh);
+    return ret;
+}
+
+
+/*
+ * Drop the reference domain @def holds on the shared image @path.
+ * When it was the last one, the image label is restored unless
+ * @restore is false.
+ */
+static int
+SmackUnrefSharedImage(virSecurityManagerPtr mgr,
+                      virDomainDefPtr def,
+                      const char *path,
+                      bool restore)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    virSmackSharedImagePtr image;
+    char key[SMACK_INODE_KEY_BUFLEN];
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    char ebuf[1024];
+    SmackFileHandle fh;
+    int ret = 0;
+
+    if (SmackFileOpen(path, &fh) < 0) {
+        VIR_WARN("cannot resolve %s: %s", path,
+                 virStrerror(errno, ebuf, sizeof(ebuf)));
+        return -1;
+    }
+
+    SmackFormatInodeKey(&fh.sb, key);
+    virUUIDFormat(def->uuid, uuidstr);
+
+    virMutexLock(&priv->sharedLock);
+
+    while ((image = virHashLookup(priv->sharedImages, key)) && image->busy)
+        ignore_value(virCondWait(&priv->sharedCond, &priv->sharedLock));
+
+    /* Not referenced by this domain, other users may still rely on
+     * the shared label, so leave the image alone. */
+    if (!image || virHashRemoveEntry(image->users, uuidstr) < 0) {
+        VIR_DEBUG("Shared image %s not used by %s", path, def->name);
+        goto cleanup;
+    }
+
+    if (virHashSize(image->users) > 0) {
+        VIR_DEBUG("Shared image %s still used by %zd domains",
+                  path, virHashSize(image->users));
+        goto cleanup;
+    }
+
+    if (restore) {
+        /* Users showing up meanwhile wait and label it again */
+        image->busy = true;
+        virMutexUnlock(&priv->sharedLock);
+        ret = SmackRestoreSecurityFileLabelHandle(mgr, &fh);
+        virMutexLock(&priv->sharedLock);
+        image->busy = false;
+        virCondBroadcast(&priv->sharedCond);
+    }
+    virHashRemoveEntry(priv->sharedImages, key);
+
+cleanup:
+    virMutexUnlock(&priv->sharedLock);
+    SmackFileClose(&fh);
+    return ret;
+}
+
+
+/*
+ * Directory tree relabeling, used for directory backed disks and
+ * container root filesystems which can hold hundreds of thousands of
+ * files. The tree is walked by a pool of threads with getdents64 on
+ * one descriptor per directory, entries are labeled relative to the
+ * descriptor of their parent so no full path is ever built. Each
+ * walker has its own stack of directories to read and steals from the
+ * bottom of the others' stacks once its own runs dry. The walk stays
+ * on the filesystem of the tree root, leaving alone whatever is mounted
+ * in the tree, directories and bind mounted files alike, and skips
+ * entries which already carry the label or can't carry any.
+ */
+
+#define SMACK_TREE_WORKERS_DEFAULT      4
+#define SMACK_TREE_WORKERS_MAX          64
+#define SMACK_TREE_DIRENT_BUFLEN        (32 * 1024)
+
+/* struct linux_dirent64 of getdents64(2) */
+struct SmackDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct _SmackTreeWalker SmackTreeWalker;
+typedef SmackTreeWalker *SmackTreeWalkerPtr;
+
+typedef struct _SmackTreeRelabel SmackTreeRelabel;
+typedef SmackTreeRelabel *SmackTreeRelabelPtr;
+
+struct _SmackTreeWalker {
+    SmackTreeRelabelPtr tree;
+
+    virMutex lock;
+    /* descriptors of directories to read, grown as needed */
+    int *dirs;
+    size_t ndirs;
+    size_t ndirs_max;
+
+    unsigned long long nlabeled;
+    unsigned long long nskipped;
+    unsigned long long nunsupported;
+};
+
+struct _SmackTreeRelabel {
+    const char *root;
+    const char *label;
+    dev_t dev;
+
+    SmackTreeWalkerPtr walkers;
+    size_t nwalkers;
+
+    virMutex lock;
+    virCond cond;
+    /* directories queued or being read */
+    size_t pending;
+    /* directories sitting in the walkers' stacks */
+    ssize_t queued;
+    bool abort;
+    int err;
+    char errname[NAME_MAX + 1];
+};
+
+
+static void
+SmackTreeSetError(SmackTreeRelabelPtr tree,
+                  int err,
+                  const char *name)
+{
+    virMutexLock(&tree->lock);
+    if (!tree->abort) {
+        tree->abort = true;
+        tree->err = err;
+        ignore_value(virStrcpyStatic(tree->errname, name));
+        virCondBroadcast(&tree->cond);
+    }
+    virMutexUnlock(&tree->lock);
+}
+
+
+/*
+ * Label the entry @name of directory @dirfd, or the already open
+ * @fd if it is not -1. Returns 1 if the label was changed, 0 if it
+ * was already there, -1 with errno set on failure.
+ */
+static int
+SmackTreeLabelEntry(SmackTreeRelabelPtr tree,
+                    int dirfd,
+                    const char *name,
+                    int fd)
+{
+    char path[sizeof("/proc/self/fd//") + VIR_INT64_STR_BUFLEN + NAME_MAX];
+    char cur[SMACK_LABEL_LEN + 1];
+    SmackLabelTarget target = { .fd = fd, .path = path, .nofollow = true };
+    ssize_t rc;
+
+    if (fd >= 0)
+        goto label;
+
+#ifdef SMACK_HAVE_XATTRAT
+    /* Straight to the kernel, bypassing the backend */
+    if (smackBackend == &smackKernelBackend && smackHaveXattrat) {
+        size_t len = strlen(tree->label) + 1;
+        struct SmackXattrArgs args = {
+            .value = (uintptr_t) cur,
+            .size = sizeof(cur) - 1,
+        };
+
+        rc = syscall(SYS_getxattrat, dirfd, name, AT_SYMLINK_NOFOLLOW,
+                     smackXattrName, &args, sizeof(args));
+        if (rc >= 0 || errno != ENOSYS) {
+            if (rc > 0) {
+                cur[rc] = '\0';
+                if (STREQ(cur, tree->label))
+                    return 0;
+            }
+
+            args.value = (uintptr_t) tree->label;
+            args.size = len;
+            return syscall(SYS_setxattrat, dirfd, name, AT_SYMLINK_NOFOLLOW,
+                           smackXattrName, &args, sizeof(args)) < 0 ?
+                -1 : 1;
+        }
+    }
+#endif
+
+    /* Only the /proc entry of the parent and the last component are
+     * looked up, never the path from the tree root */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", dirfd, name);
+
+label:
+    if ((rc = SmackLabelGet(&target, cur, sizeof(cur))) > 0 &&
+        STREQ(cur, tree->label))
+        return 0;
+    return SmackLabelSet(&target, tree->label) < 0 ? -1 : 1;
+}
+
+
+/*
+ * Account for the result @rc of SmackTreeLabelEntry(). Returns -1 if
+ * it is an error the walk must stop at, with errno set.
+ */
+static int
+SmackTreeCount(SmackTreeWalkerPtr walker, int rc)
+{
+    if (rc > 0) {
+        walker->nlabeled++;
+    } else if (rc == 0) {
+        walker->nskipped++;
+    } else if (errno == ENOTSUP || errno == EOPNOTSUPP) {
+        /* Single entries, e.g. special files, may refuse labels */
+        walker->nunsupported++;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+static bool
+SmackTreeAborted(SmackTreeRelabelPtr tree)
+{
+    bool ret;
+
+    virMutexLock(&tree->lock);
+    ret = tree->abort;
+    virMutexUnlock(&tree->lock);
+    return ret;
+}
+
+
+/*
+ * Queue the directory @fd on @walker's stack. Returns -1 if the stack
+ * can't grow, leaving @fd to the caller.
+ */
+static int
+SmackTreePush(SmackTreeWalkerPtr walker, int fd)
+{
+    SmackTreeRelabelPtr tree = walker->tree;
+    int ret = -1;
+
+    virMutexLock(&walker->lock);
+    if (VIR_RESIZE_N(walker->dirs, walker->ndirs_max,
+                     walker->ndirs, 1) == 0) {
+        walker->dirs[walker->ndirs++] = fd;
+        ret = 0;
+    }
+    virMutexUnlock(&walker->lock);
+
+    if (ret == 0) {
+        virMutexLock(&tree->lock);
+        tree->pending++;
+        tree->queued++;
+        virCondSignal(&tree->cond);
+        virMutexUnlock(&tree->lock);
+    }
+
+    return ret;
+}
+
+
+/*
+ * Take a directory from the top of @walker's own stack, or steal the
+ * oldest one queued by another walker. Returns -1 if there is none.
+ */
+static int
+SmackTreePop(SmackTreeWalkerPtr walker)
+{
+    SmackTreeRelabelPtr tree = walker->tree;
+    size_t self = walker - tree->walkers;
+    int fd = -1;
+    size_t i;
+
+    virMutexLock(&walker->lock);
+    if (walker->ndirs > 0)
+        fd = walker->dirs[--walker->ndirs];
+    virMutexUnlock(&walker->lock);
+
+    for (i = 1; fd < 0 && i < tree->nwalkers; i++) {
+        SmackTreeWalkerPtr victim = &tree->walkers[(self + i) % tree->nwalkers];
+
+        virMutexLock(&victim->lock);
+        if (victim->ndirs > 0) {
+            fd = victim->dirs[0];
+            memmove(victim->dirs, victim->dirs + 1,
+                    sizeof(victim->dirs[0]) * --victim->ndirs);
+        }
+        virMutexUnlock(&victim->lock);
+    }
+
+    if (fd >= 0) {
+        virMutexLock(&tree->lock);
+        tree->queued--;
+        virMutexUnlock(&tree->lock);
+    }
+
+    return fd;
+}
+
+
+/*
+ * Label every entry of the directory @dirfd, queueing subdirectories
+ * for later. Consumes @dirfd.
+ */
+static void
+SmackTreeReadDir(SmackTreeWalkerPtr walker, int dirfd)
+{
+    SmackTreeRelabelPtr tree = walker->tree;
+    char *buf = NULL;
+    ssize_t nread;
+    ssize_t off;
+
+    if (VIR_ALLOC_N(buf, SMACK_TREE_DIRENT_BUFLEN) < 0) {
+        SmackTreeSetError(tree, ENOMEM, ".");
+        goto cleanup;
+    }
+
+    while ((nread = syscall(SYS_getdents64, dirfd, buf,
+                            SMACK_TREE_DIRENT_BUFLEN)) > 0) {
+        if (SmackTreeAborted(tree))
+            goto cleanup;
+
+        for (off = 0; off < nread; ) {
+            struct SmackDirent64 *ent = (struct SmackDirent64 *)(buf + off);
+            unsigned char type = ent->d_type;
+            struct stat sb;
+            int fd;
+            int rc;
+
+            off += ent->d_reclen;
+
+            if (STREQ(ent->d_name, ".") || STREQ(ent->d_name, ".."))
+                continue;
+
+            /* Directories are checked once open, anything else here:
+             * a file bind mounted in the tree has the st_dev of the
+             * filesystem it comes from */
+            if (type != DT_DIR) {
+                if (fstatat(dirfd, ent->d_name, &sb,
+                            AT_SYMLINK_NOFOLLOW) < 0) {
+                    if (errno == ENOENT)
+                        continue;
+                    SmackTreeSetError(tree, errno, ent->d_name);
+                    goto cleanup;
+                }
+                if (sb.st_dev != tree->dev)
+                    continue;
+                type = S_ISDIR(sb.st_mode) ? DT_DIR : DT_REG;
+            }
+
+            if (type != DT_DIR) {
+                rc = SmackTreeLabelEntry(tree, dirfd, ent->d_name, -1);
+                if (rc < 0 && errno == ENOENT)
+                    continue;
+                if (SmackTreeCount(walker, rc) < 0) {
+                    SmackTreeSetError(tree, errno, ent->d_name);
+                    goto cleanup;
+                }
+                continue;
+            }
+
+            if ((fd = openat(dirfd, ent->d_name,
+                             O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                             O_CLOEXEC)) < 0) {
+                if (errno == ENOENT)
+                    continue;
+                SmackTreeSetError(tree, errno, ent->d_name);
+                goto cleanup;
+            }
+
+            /* Don't wander into other filesystems mounted in the tree */
+            if (fstat(fd, &sb) < 0 || sb.st_dev != tree->dev) {
+                VIR_FORCE_CLOSE(fd);
+                continue;
+            }
+
+            rc = SmackTreeLabelEntry(tree, -1, NULL, fd);
+            if (SmackTreeCount(walker, rc) < 0) {
+                SmackTreeSetError(tree, errno, ent->d_name);
+                VIR_FORCE_CLOSE(fd);
+                goto cleanup;
+            }
+
+            if (SmackTreePush(walker, fd) < 0) {
+                SmackTreeSetError(tree, ENOMEM, ent->d_name);
+                VIR_FORCE_CLOSE(fd);
+                goto cleanup;
+            }
+        }
+    }
+
+    if (nread < 0)
+        SmackTreeSetError(tree, errno, ".");
+
+cleanup:
+    VIR_FREE(buf);
+    VIR_FORCE_CLOSE(dirfd);
+}
+
+
+static void
+SmackTreeWalkerRun(void *opaque)
+{
+    SmackTreeWalkerPtr walker = opaque;
+    SmackTreeRelabelPtr tree = walker->tree;
+    int fd;
+
+    for (;;) {
+        if ((fd = SmackTreePop(walker)) < 0) {
+            virMutexLock(&tree->lock);
+            while (tree->queued <= 0 && tree->pending > 0 && !tree->abort)
+                ignore_value(virCondWait(&tree->cond, &tree->lock));
+            if (tree->pending == 0 || tree->abort) {
+                virMutexUnlock(&tree->lock);
+                return;
+            }
+            virMutexUnlock(&tree->lock);
+            continue;
+        }
+
+        SmackTreeReadDir(walker, fd);
+
+        virMutexLock(&tree->lock);
+        if (--tree->pending == 0)
+            virCondBroadcast(&tree->cond);
+        virMutexUnlock(&tree->lock);
+    }
+}
+
+
+/*
+ * Set @label on the directory @root and everything below it on the
+ * same filesystem, using up to the configured number of walkers.
+ */
+static int
+SmackRelabelTree(virSecurityManagerPtr mgr,
+                 const char *root,
+                 const char *label)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    SmackTreeRelabel tree = { .root = root, .label = label };
+    virThreadPtr threads = NULL;
+    size_t nthreads = 0;
+    unsigned long long nlabeled = 0;
+    unsigned long long nskipped = 0;
+    unsigned long long nunsupported = 0;
+    struct stat sb;
+    size_t i;
+    int rootfd;
+    int rc;
+    int ret = -1;
+
+    VIR_INFO("Setting Smack label '%s' on directory tree '%s'", label, root);
+
+    if ((rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+        fstat(rootfd, &sb) < 0) {
+        virReportSystemError(errno,
+                             _("unable to open directory tree '%s'"), root);
+        VIR_FORCE_CLOSE(rootfd);
+        return -1;
+    }
+    tree.dev = sb.st_dev;
+
+    /* The root refusing labels doesn't mean everything below does */
+    if ((rc = SmackTreeLabelEntry(&tree, -1, NULL, rootfd)) < 0 &&
+        errno != ENOTSUP && errno != EOPNOTSUPP) {
+        virReportSystemError(errno,
+                             _("unable to set security context '%s' on '%s'"),
+                             label, root);
+        VIR_FORCE_CLOSE(rootfd);
+        return -1;
+    }
+
+    virMutexLock(&priv->lock);
+    tree.nwalkers = priv->treeWorkers;
+    virMutexUnlock(&priv->lock);
+
+    if (VIR_ALLOC_N(tree.walkers, tree.nwalkers) < 0) {
+        VIR_FORCE_CLOSE(rootfd);
+        return -1;
+    }
+
+    if (virMutexInit(&tree.lock) < 0 || virCondInit(&tree.cond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize tree relabel state"));
+        VIR_FORCE_CLOSE(rootfd);
+        VIR_FREE(tree.walkers);
+        return -1;
+    }
+
+    for (i = 0; i < tree.nwalkers; i++) {
+        tree.walkers[i].tree = &tree;
+        if (virMutexInit(&tree.walkers[i].lock) < 0) {
+            virReportSystemError(errno, "%s",
+                                 _("unable to initialize tree walker"));
+            while (i-- > 0)
+                virMutexDestroy(&tree.walkers[i].lock);
+            VIR_FORCE_CLOSE(rootfd);
+            goto cleanup;
+        }
+    }
+    if (rc < 0)
+        tree.walkers[0].nunsupported++;
+    else
+        ignore_value(SmackTreeCount(&tree.walkers[0], rc));
+
+    if (SmackTreePush(&tree.walkers[0], rootfd) < 0) {
+        VIR_FORCE_CLOSE(rootfd);
+        SmackTreeSetError(&tree, ENOMEM, ".");
+    }
+
+    if (tree.nwalkers > 1 && VIR_ALLOC_N(threads, tree.nwalkers - 1) == 0) {
+        for (nthreads = 0; nthreads < tree.nwalkers - 1; nthreads++) {
+            if (virThreadCreate(&threads[nthreads], true, SmackTreeWalkerRun,
+                                &tree.walkers[nthreads + 1]) < 0)
+                break;
+        }
+    }
+
+    SmackTreeWalkerRun(&tree.walkers[0]);
+
+    for (i = 0; i < nthreads; i++)
+        virThreadJoin(&threads[i]);
+
+    for (i = 0; i < tree.nwalkers; i++) {
+        /* Left over after an abort */
+        while (tree.walkers[i].ndirs > 0)
+            VIR_FORCE_CLOSE(tree.walkers[i].dirs[--tree.walkers[i].ndirs]);
+        VIR_FREE(tree.walkers[i].dirs);
+        nlabeled += tree.walkers[i].nlabeled;
+        nskipped += tree.walkers[i].nskipped;
+        nunsupported += tree.walkers[i].nunsupported;
+        virMutexDestroy(&tree.walkers[i].lock);
+    }
+
+    VIR_DEBUG("Directory tree '%s': %llu entries labeled, %llu skipped, "
+              "%zu walkers", root, nlabeled, nskipped, nthreads + 1);
+    if (nunsupported > 0)
+        VIR_INFO("Setting security context '%s' not supported on %llu "
+                 "entries of '%s'", label, nunsupported, root);
+
+    /* Only a walk that went through the whole tree succeeded */
+    if (!tree.abort) {
+        ret = 0;
+    } else {
+        virReportSystemError(tree.err,
+                             _("unable to set security context '%s' on '%s' "
+                               "in directory tree '%s'"),
+                             label, tree.errname, root);
+    }
+
+cleanup:
+    VIR_FREE(threads);
+    VIR_FREE(tree.walkers);
+    virCondDestroy(&tree.cond);
+    virMutexDestroy(&tree.lock);
+    return ret;
+}
+
+
+typedef struct _SmackImageChainData SmackImageChainData;
+typedef SmackImageChainData *SmackImageChainDataPtr;
+
+struct _SmackImageChainData {
+    virSecurityManagerPtr mgr;
+    virDomainDefPtr def;
+    /* labels live on a shared FS and are owned by the migration target */
+    bool skipRestore;
+    /* if set, top layer restores are queued here */
+    SmackRelabelPlanPtr plan;
+};
+
+
+/*
+ * Only the writable top layer of a disk gets the domain's own image
+ * label. Readonly disks and every backing file below the top are
+ * shared read-only bases and are refcounted across domains.
+ */
+static int
+SmackSetSecurityImageChainLabel(virDomainDiskDefPtr disk,
+                                const char *path,
+                                size_t depth,
+                                void *opaque)
+{
+    SmackImageChainDataPtr data = opaque;
+    virSecurityLabelDefPtr seclabel;
+
+    if (depth == 0 && !disk->readonly) {
+        seclabel = virDomainDefGetSecurityLabelDef(data->def,
+                                                   SECURITY_SMACK_NAME);
+        if (seclabel == NULL)
+            return -1;
+        return SmackSetFileLabel(data->mgr, path, seclabel->imagelabel);
+    }
+
+    return SmackRefSharedImage(data->mgr, data->def, path, true);
+}
+
+
+static int
+SmackRestoreSecurityImageChainLabel(virDomainDiskDefPtr disk,
+                                    const char *path,
+                                    size_t depth,
+                                    void *opaque)
+{
+    SmackImageChainDataPtr data = opaque;
+
+    if (depth == 0 && !disk->readonly) {
+        if (disk->shared || data->skipRestore)
+            return 0;
+        if (data->plan)
+            return SmackRelabelPlanAdd(data->plan, path,
+                                       SECURITY_SMACK_UNUSED_LABEL);
+        return SmackRestoreSecurityFileLabel(data->mgr, path);
+    }
+
+    return SmackUnrefSharedImage(data->mgr, data->def, path,
+                                 !data->skipRestore);
+}
+
+
+static int
+SmackRestoreSecurityImageLabelInt(virSecurityManagerPtr mgr,
+		                  virDomainDefPtr def,
+				  virDomainDiskDefPtr disk,
+				  int migrated,
+				  SmackRelabelPlanPtr plan)
+{
+	virSecurityLabelDefPtr seclabel;
+	SmackImageChainData data = { .mgr = mgr, .def = def, .plan = plan };
+
+	seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
+
+        if (seclabel == NULL)
+		return -1;
+
+	if (seclabel->norelabel) 
+		return 0;
+
+	if (!disk->src || disk->type == VIR_DOMAIN_DISK_TYPE_NETWORK)
+		return 0;
+
+	if (migrated) {
+	    int ret = SmackFsIsShared(mgr, disk->src);
+	    if (ret < 0)
+	        return -1;
+	    if (ret == 1) {
+	        VIR_DEBUG("Skipping image label restore on %s because FS is shared",disk->src);
+	        data.skipRestore = true;
+            }
+
+        }
+
+	if (disk->type == VIR_DOMAIN_DISK_TYPE_DIR) {
+	    if (data.skipRestore || disk->readonly || disk->shared)
+	        return 0;
+	    return SmackRelabelTree(mgr, disk->src, SECURITY_SMACK_UNUSED_LABEL);
+	}
+
+	return virDomainDiskDefForeachPath(disk, true,
+	                                   SmackRestoreSecurityImageChainLabel,
+	                                   &data);
+}
+
+
+
+static int
+SmackFSetFileLabel(virSecurityManagerPtr mgr, int fd, char *tlabel)
+{
+     SmackLabelTarget target = { .fd = fd };
+     char elabel[SMACK_LABEL_LEN + 1];
+
+     if (SmackFsLabelsUnsupported(mgr, NULL, fd)) {
+         VIR_DEBUG("Not labeling fd %d, its filesystem does not support it",
+                   fd);
+         return 0;
+     }
+
+     VIR_INFO("Setting Smack label on fd %d to '%s'",fd,tlabel);
+
+     /* Not fsetfilelabel(), which would read the label back itself */
+     if (SmackLabelSet(&target, tlabel) < 0) {
+	 int fsetfilelabel_errno = errno;
+
+         /* It's alright, there's nothing to change anyway. */
+         if (fgetfilelabel_r(fd, elabel, sizeof(elabel)) >= 0 &&
+             STREQ(tlabel, elabel))
+             goto done;
+
+       /* if the error complaint is related to an image hosted on
+        * an nfs mount, or a usbfs/sysfs filesystem not supporting
+        * labelling, then just ignore it & hope for the best.
+        */
+        if (fsetfilelabel_errno != EOPNOTSUPP) {
+             virReportSystemError(fsetfilelabel_errno,
+   		                  _("unable to set security context '%s' on fd %d"), tlabel, fd);
+               return -1;
+         } else {
+            struct stat sb;
+
+            SMACK_COUNT_EVENT(VIR_SMACK_COUNTER_ENOTSUP_FALLBACK);
+            if (SMACK_SYSCALL(fstat(fd, &sb)) < 0 ||
+                SmackFsNoteNoLabels(mgr, &sb, fd, NULL))
+                VIR_INFO("Setting security label '%s' on fd %d not supported",
+                         tlabel, fd);
+            return 0;
+         }
+     }
+
+done:
+     SmackFsNoteLabels(mgr, NULL, fd);
+     return 0;
+}
+
+
+/*
+ * Resolve the subsystem host device @dev below @vroot into the device
+ * nodes and sysfs files it is made of.
+ */
+static int
+SmackCollectHostdevFiles(virDomainHostdevDefPtr dev,
+                         const char *vroot,
+                         SmackHostdevFilesPtr files)
+{
+    int ret = -1;
+
+    switch (dev->source.subsys.type) {
+    case VIR_DOMAIN_HOSTDEV_SUBSYS_TYPE_USB: {
+        virUSBDevicePtr usb;
+
+        if (dev->missing)
+            return 0;
+
+        usb = virUSBDeviceNew(dev->source.subsys.u.usb.bus,
+                              dev->source.subsys.u.usb.device,
+                              vroot);
+        if (!usb)
+            return -1;
+
+        ret = virUSBDeviceFileIterate(usb, SmackCollectUSBFile, files);
+        virUSBDeviceFree(usb);
+
+        break;
+    }
+
+    case VIR_DOMAIN_HOSTDEV_SUBSYS_TYPE_PCI: {
+        virPCIDevicePtr pci =
+            virPCIDeviceNew(dev->source.subsys.u.pci.addr.domain,
+                            dev->source.subsys.u.pci.addr.bus,
+                            dev->source.subsys.u.pci.addr.slot,
+                            dev->source.subsys.u.pci.addr.function);
+
+        if (!pci)
+            return -1;
+
+        if (dev->source.subsys.u.pci.backend
+            == VIR_DOMAIN_HOSTDEV_PCI_BACKEND_VFIO) {
+            char *vfioGroupDev = virPCIDeviceGetIOMMUGroupDev(pci);
+
+            if (!vfioGroupDev) {
+                virPCIDeviceFree(pci);
+                return -1;
+            }
+            ret = SmackCollectPCIFile(pci, vfioGroupDev, files);
+            VIR_FREE(vfioGroupDev);
+        } else {
+            ret = virPCIDeviceFileIterate(pci, SmackCollectPCIFile, files);
+        }
+        virPCIDeviceFree(pci);
+        break;
+    }
+
+    case VIR_DOMAIN_HOSTDEV_SUBSYS_TYPE_SCSI: {
+        virSCSIDevicePtr scsi =
+            virSCSIDeviceNew(dev->source.subsys.u.scsi.adapter,
+                             dev->source.subsys.u.scsi.bus,
+                             dev->source.subsys.u.scsi.target,
+                             dev->source.subsys.u.scsi.unit,
+                             dev->readonly);
+
+            if (!scsi)
+                return -1;
+
+            ret = virSCSIDeviceFileIterate(scsi, SmackCollectSCSIFile, files);
+            virSCSIDeviceFree(scsi);
+
+            break;
+       }
+
+    default:
+        ret = 0;
+        break;
+    }
+
+    return ret;
+}
+
+
+/*
+ * Host device nodes can be shared by several host devices, typically
+ * the /dev/vfio/<group> node of all the functions in one IOMMU group.
+ * Every node is labeled when its first user shows up and restored when
+ * the last one is gone. Returns 1 if @file had no user yet, 0 if it
+ * had, -1 with an error reported if it can't be tracked.
+ */
+static int
+SmackHostdevNodeRef(virSecurityManagerPtr mgr,
+                    const char *file)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    unsigned int *refs;
+    int ret = -1;
+
+    virMutexLock(&priv->lock);
+    if ((refs = virHashLookup(priv->hostdevNodes, file))) {
+        (*refs)++;
+        ret = 0;
+    } else if (VIR_ALLOC(refs) == 0) {
+        *refs = 1;
+        if (virHashAddEntry(priv->hostdevNodes, file, refs) < 0)
+            VIR_FREE(refs);
+        else
+            ret = 1;
+    }
+    virMutexUnlock(&priv->lock);
+
+    return ret;
+}
+
+
+/*
+ * Drop a user of @file. Returns true if it was the last one, or if
+ * @file was not tracked at all. Called with lock held.
+ */
+static bool
+SmackHostdevNodeUnrefLocked(virSmackSecurityDataPtr priv,
+                            const char *file)
+{
+    unsigned int *refs;
+
+    if (!(refs = virHashLookup(priv->hostdevNodes, file)))
+        return true;
+
+    if (--(*refs) > 0)
+        return false;
+
+    ignore_value(virHashRemoveEntry(priv->hostdevNodes, file));
+    return true;
+}
+
+
+static bool
+SmackHostdevNodeUnref(virSecurityManagerPtr mgr,
+                      const char *file)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    bool last;
+
+    virMutexLock(&priv->lock);
+    last = SmackHostdevNodeUnrefLocked(priv, file);
+    virMutexUnlock(&priv->lock);
+
+    return last;
+}
+
+
+static void
+SmackHostdevFilesUnrefNodes(void *payload,
+                            const void *name ATTRIBUTE_UNUSED,
+                            void *opaque)
+{
+    SmackHostdevFilesPtr files = payload;
+    size_t i;
+
+    for (i = 0; i < files->nfiles; i++)
+        ignore_value(SmackHostdevNodeUnrefLocked(opaque, files->files[i]));
+}
+
+
+static int
+SmackSetSecurityHostdevSubsysLabelInt(SmackCallbackDataPtr data,
+                                      virDomainHostdevDefPtr dev,
+                                      const char *vroot)
+{
+    SmackHostdevFilesPtr files = NULL;
+    char *key;
+    size_t i;
+    int ret = -1;
+
+    if (!(key = SmackHostdevKey(dev, vroot)))
+        return -1;
+
+    if (VIR_ALLOC(files) < 0 ||
+        SmackCollectHostdevFiles(dev, vroot, files) < 0)
+        goto cleanup;
+
+    for (i = 0; i < files->nfiles; i++) {
+        const char *file = files->files[i];
+        int rc;
+
+        if ((rc = SmackHostdevNodeRef(data->manager, file)) < 0)
+            goto error;
+
+        if (rc == 0) {
+            VIR_DEBUG("'%s' is already labeled for another host device",
+                      file);
+            continue;
+        }
+
+        if (SmackSetSecurityHostdevLabelHelper(file, data) < 0) {
+            ignore_value(SmackHostdevNodeUnref(data->manager, file));
+            goto error;
+        }
+    }
+
+    if (files->nfiles > 0) {
+        SmackHostdevFilesStore(data->manager, data->def, key, files);
+        files = NULL;
+    }
+    ret = 0;
+
+cleanup:
+    SmackHostdevFilesFree(files);
+    VIR_FREE(key);
+    return ret;
+
+error:
+    /* Drop the nodes referenced so far, restoring those nobody else
+     * uses; labels still queued in the plan are never applied */
+    while (i-- > 0) {
+        if (SmackHostdevNodeUnref(data->manager, files->files[i]) &&
+            !data->plan)
+            ignore_value(SmackRestoreSecurityHostdevLabelHelper(
+                             files->files[i], data));
+    }
+    goto cleanup;
+}
+
+
+static int
+SmackSetSecurityHostdevSubsysLabel(virSecurityManagerPtr mgr,
+                                   virDomainDefPtr def,
+		                   virDomainHostdevDefPtr dev,
+				   const char *vroot)
+{
+    SmackCallbackData data = { .manager = mgr, .def = def };
+    int ret;
+
+    if (SmackRelabelPlanWanted(mgr) && !(data.plan = SmackRelabelPlanNew()))
+        return -1;
+
+    ret = SmackSetSecurityHostdevSubsysLabelInt(&data, dev, vroot);
+    if (ret == 0)
+        ret = SmackRelabelPlanRun(mgr, data.plan);
+    SmackRelabelPlanFree(data.plan);
+    return ret;
+}
+
+static int
+SmackSetSecurityHostdevCapsLabel(virSecurityManagerPtr mgr,
+                                 virDomainDefPtr def,
+		                 virDomainHostdevDefPtr dev,
+				 const char *vroot)
+{
+    int ret = -1;
+    virSecurityLabelDefPtr seclabel;
+    char *path;
+
+    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+    if (seclabel == NULL)
+        return -1;
+
+    switch (dev->source.caps.type) {
+    case VIR_DOMAIN_HOSTDEV_CAPS_TYPE_STORAGE: {
+        if (vroot) {
+            if (virAsprintf(&path, "%s/%s", vroot,
+                            dev->source.caps.u.storage.block) < 0)
+                return -1;
+        } else {
+            if (VIR_STRDUP(path, dev->source.caps.u.storage.block) < 0)
+                return -1;
+        }
+        ret = SmackSetFileLabel(mgr, path, seclabel->imagelabel);
+        VIR_FREE(path);
+        break;
+    }
+
+    case VIR_DOMAIN_HOSTDEV_CAPS_TYPE_MISC: {
+        if (vroot) {
+            if (virAsprintf(&path, "%s/%s", vroot,
+                            dev->source.caps.u.misc.chardev) < 0)
+                return -1;
+        } else {
+            if (VIR_STRDUP(path, dev->source.caps.u.misc.chardev) < 0)
+                return -1;
+        }
+        ret = SmackSetFileLabel(mgr, path, seclabel->imagelabel);
+        VIR_FREE(path);
+        break;
+    }
+
+    default:
+        ret = 0;
+        break;
+    }
+
+    return ret;
+
+}
+
+static int
+SmackRestoreSecurityHostdevSubsysLabelInt(SmackCallbackDataPtr data,
+                                          virDomainHostdevDefPtr dev,
+                                          const char *vroot)
+{
+    SmackHostdevFilesPtr files;
+    char *key;
+    size_t i;
+    int ret = 0;
+
+    if (!(key = SmackHostdevKey(dev, vroot)))
+        return -1;
+
+    if ((files = SmackHostdevFilesTake(data->manager, data->def, key))) {
+        VIR_DEBUG("Restoring %zu cached files of host device %s",
+                  files->nfiles, key);
+    } else if (VIR_ALLOC(files) < 0) {
+        ret = -1;
+        goto cleanup;
+    } else if (SmackCollectHostdevFiles(dev, vroot, files) < 0) {
+        /* Restore whatever was found, but report the failure */
+        ret = -1;
+    }
+
+    for (i = 0; i < files->nfiles; i++) {
+        const char *file = files->files[i];
+
+        if (!SmackHostdevNodeUnref(data->manager, file)) {
+            VIR_DEBUG("'%s' is still used by another host device", file);
+            continue;
+        }
+
+        /* A device unplugged in the meantime has nothing to restore */
+        if (dev->missing)
+            continue;
+
+        if (SmackRestoreSecurityHostdevLabelHelper(file, data) < 0)
+            ret = -1;
+    }
+
+cleanup:
+    SmackHostdevFilesFree(files);
+    VIR_FREE(key);
+    return ret;
+}
+
+
+static int
+SmackRestoreSecurityHostdevSubsysLabel(virSecurityManagerPtr mgr,
+                                       virDomainDefPtr def,
+		                       virDomainHostdevDefPtr dev,
+				       const char *vroot)
+{
+    SmackCallbackData data = { .manager = mgr, .def = def };
+    int ret;
+
+    if (SmackRelabelPlanWanted(mgr) && !(data.plan = SmackRelabelPlanNew()))
+        return -1;
+
+    ret = SmackRestoreSecurityHostdevSubsysLabelInt(&data, dev, vroot);
+
+    /* Restore whatever was collected, even after a failure */
+    if (SmackRelabelPlanRun(mgr, data.plan) < 0)
+        ret = -1;
+    SmackRelabelPlanFree(data.plan);
+    return ret;
+}
+
+
+
+static int
+SmackRestoreSecurityHostdevCapsLabel(virSecurityManagerPtr mgr,
+				     virDomainHostdevDefPtr dev,
+				     const char *vroot)
+{
+    int ret = -1;
+    char *path;
+
+    switch (dev->source.caps.type) {
+    case VIR_DOMAIN_HOSTDEV_CAPS_TYPE_STORAGE: {
+        if (vroot) {
+            if (virAsprintf(&path, "%s/%s", vroot,
+                            dev->source.caps.u.storage.block) < 0)
+                return -1;
+        } else {
+            if (VIR_STRDUP(path, dev->source.caps.u.storage.block) < 0)
+                return -1;
+        }
+        ret = SmackRestoreSecurityFileLabel(mgr, path);
+        VIR_FREE(path);
+        break;
+    }
+
+    case VIR_DOMAIN_HOSTDEV_CAPS_TYPE_MISC: {
+        if (vroot) {
+            if (virAsprintf(&path, "%s/%s", vroot,
+                            dev->source.caps.u.misc.chardev) < 0)
+                return -1;
+        } else {
+            if (VIR_STRDUP(path, dev->source.caps.u.misc.chardev) < 0)
+                return -1;
+        }
+        ret = SmackRestoreSecurityFileLabel(mgr, path);
+        VIR_FREE(path);
+        break;
+    }
+
+    default:
+        ret = 0;
+        break;
+    }
+
+    return ret;
+}
+
+
+/*Called on libvirtd startup to see if Smack is available*/
+static int
+SmackSecurityDriverProbe(const char *virtDriver)
+{
+	if(!smack_smackfs_path())
+		return SECURITY_DRIVER_DISABLE;
+        if (virtDriver && STREQ(virtDriver, "LXC")) {
+#if HAVE_SELINUX_LXC_CONTEXTS_PATH
+           if (!virFileExists(selinux_lxc_contexts_path()))
+#endif
+        return SECURITY_DRIVER_DISABLE;
+        }
+
+	return SECURITY_DRIVER_ENABLE;
+
+}
+
+/*Security dirver initialization .*/
+static int
+SmackSecurityDriverOpen(virSecurityManagerPtr mgr)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+
+    if (virMutexInit(&priv->lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize smack driver mutex"));
+        return -1;
+    }
+
+    if (virMutexInit(&priv->sharedLock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize smack driver mutex"));
+        virMutexDestroy(&priv->lock);
+        return -1;
+    }
+
+    if (virCondInit(&priv->sharedCond) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize smack driver condition"));
+        virMutexDestroy(&priv->sharedLock);
+        virMutexDestroy(&priv->lock);
+        return -1;
+    }
+
+    if (virMutexInit(&priv->fsLock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize smack driver mutex"));
+        virCondDestroy(&priv->sharedCond);
+        virMutexDestroy(&priv->sharedLock);
+        virMutexDestroy(&priv->lock);
+        return -1;
+    }
+
+    priv->mountinfoFd = -1;
+
+    if (SmackLabelCacheInit(priv) < 0)
+        goto error;
+
+    if (!(priv->sharedImages = virHashCreate(64, SmackSharedImageFree)))
+        goto error;
+
+    if (!(priv->fsCache = virHashCreate(16, virHashValueFree)))
+        goto error;
+
+    if (!(priv->hostdevFiles = virHashCreate(32, SmackDomainHostdevsFree)))
+        goto error;
+
+    if (!(priv->hostdevNodes = virHashCreate(32, virHashValueFree)))
+        goto error;
+
+    if (!(priv->applied = virHashCreate(32, SmackAppliedTableFree)))
+        goto error;
+
+    if (!(priv->domainLabels = virHashCreate(32, SmackAppliedEntryFree)))
+        goto error;
+
+    /* Not fatal, the filesystem cache is then just not used */
+    if ((priv->mountinfoFd = open("/proc/self/mountinfo",
+                                  O_RDONLY | O_CLOEXEC)) < 0) {
+        char ebuf[1024];
+        VIR_DEBUG("cannot watch mount table: %s",
+                  virStrerror(errno, ebuf, sizeof(ebuf)));
+    }
+
+    priv->reconcileDeadline = SmackNowMs() + SMACK_RECONCILE_BUDGET_DEFAULT;
+    priv->relabelWorkers = SMACK_RELABEL_WORKERS_DEFAULT;
+    priv->treeWorkers = SMACK_TREE_WORKERS_DEFAULT;
+    /* Opt-in until measured against synchronous relabels on the host */
+    priv->useUring = false;
+
+    if (SmackLabelBackendActivate() < 0)
+        goto error;
+
+    if (SmackSyscallsInitialize() < 0)
+        goto error;
+
+    if (virSmackSecuritySetRuleTemplates(mgr, NULL, 0) < 0)
+        goto error;
+
+    /* Not fatal, restores then fall back to the unused label */
+    if (!(priv->journal = SmackJournalOpen())) {
+        VIR_WARN("Unable to open the original label journal");
+        virResetLastError();
+    }
+
+    /* Not fatal either, restores are then never deferred. Its thread
+     * resumes pending restores right away, so this comes last, once
+     * the label backend, syscall probes and journal are set up */
+    if (!(priv->restoreQueue = SmackRestoreQueueNew(mgr))) {
+        VIR_WARN("Unable to set up deferred label restores");
+        virResetLastError();
+    }
+
+    return 0;
+
+error:
+    VIR_FORCE_CLOSE(priv->mountinfoFd);
+    virHashFree(priv->domainLabels);
+    virHashFree(priv->applied);
+    virHashFree(priv->hostdevNodes);
+    virHashFree(priv->hostdevFiles);
+    virHashFree(priv->fsCache);
+    virHashFree(priv->sharedImages);
+    SmackLabelCacheFree(priv);
+    virMutexDestroy(&priv->fsLock);
+    virCondDestroy(&priv->sharedCond);
+    virMutexDestroy(&priv->sharedLock);
+    virMutexDestroy(&priv->lock);
+    return -1;
+}
+
+static int
+SmackSecurityDriverClose(virSecurityManagerPtr mgr)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+
+    if (!priv)
+        return 0;
+
+    VIR_DEBUG("label cache: hits=%llu misses=%llu invalidations=%llu",
+              priv->cacheHits, priv->cacheMisses, priv->cacheInvalidations);
+
+    SmackRestoreQueueFree(priv->restoreQueue);
+    SmackJournalFree(priv->journal);
+    VIR_FORCE_CLOSE(priv->mountinfoFd);
+    SmackRuleTemplatesFree(priv->rules, priv->nrules);
+    virHashFree(priv->domainLabels);
+    virHashFree(priv->applied);
+    virHashFree(priv->hostdevNodes);
+    virHashFree(priv->hostdevFiles);
+    virHashFree(priv->fsCache);
+    virMutexDestroy(&priv->fsLock);
+    virHashFree(priv->sharedImages);
+    virCondDestroy(&priv->sharedCond);
+    virMutexDestroy(&priv->sharedLock);
+    SmackLabelCacheFree(priv);
+    virMutexDestroy(&priv->lock);
+
+    return 0;
+}
+
+static const char *
+SmackSecurityDriverGetModel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED)
+{
+	return SECURITY_SMACK_NAME;
+}
+
+static const char *
+SmackSecurityDriverGetDOI(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED)
+{
+	return SECURITY_SMACK_VOID_DOI;
+}
+
+static int
+SmackSecurityVerifyInt(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
+		    virDomainDefPtr def)
+{
+        virSecurityLabelDefPtr seclabel;        
+        seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+	if (seclabel == NULL)
+		return -1;
 
 	if (!STREQ(SECURITY_SMACK_NAME, seclabel->model)) {
 	    virReportError(VIR_ERR_INTERNAL_ERROR,
@@ -888,625 +5902,2758 @@ SmackSecurityVerify(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
 	        return -1;
 	}
 
-	if(seclabel->type == VIR_DOMAIN_SECLABEL_STATIC){
-       	   if (smack_label_length(seclabel->label) < 0) {
-	    virReportError(VIR_ERR_XML_ERROR,
-			   _("Invalid security label %s"), seclabel->label);
-		return -1;
-	   }
-	}
+	if(seclabel->type == VIR_DOMAIN_SECLABEL_STATIC){
+       	   if (smack_label_length(seclabel->label) < 0) {
+	    virReportError(VIR_ERR_XML_ERROR,
+			   _("Invalid security label %s"), seclabel->label);
+		return -1;
+	   }
+	}
+
+    return 0;
+
+}
+
+
+static int
+SmackSecurityVerify(virSecurityManagerPtr mgr,
+                    virDomainDefPtr def)
+{
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainSecurityVerify", def, NULL);
+    ret = SmackSecurityVerifyInt(mgr, def);
+    SMACK_TRACE_RETURN("domainSecurityVerify", def, ret);
+    return ret;
+}
+
+
+static int
+SmackSetSecurityImageLabelInt(virSecurityManagerPtr mgr,
+			   virDomainDefPtr def,
+			   virDomainDiskDefPtr disk)
+{
+	virSecurityLabelDefPtr seclabel;
+	SmackImageChainData data = { .mgr = mgr, .def = def };
+	char *key = NULL;
+	int ret;
+
+	seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
+
+	if (seclabel == NULL)
+	    return -1;
+
+	if (seclabel->norelabel)
+	    return 0;
+
+	if (disk->type == VIR_DOMAIN_DISK_TYPE_NETWORK)
+	    return 0;
+
+	if (!disk->src)
+	    return 0;
+
+	SmackRestoreQueueBarrier(mgr, disk->src);
+
+	if (disk->type == VIR_DOMAIN_DISK_TYPE_DIR) {
+	    ret = SmackRelabelTree(mgr, disk->src, seclabel->imagelabel);
+	} else {
+	    VIR_DEBUG("Setting labels on disk image %s and its backing chain",
+	              disk->src);
+
+	    ret = virDomainDiskDefForeachPath(disk, true,
+	                                      SmackSetSecurityImageChainLabel,
+	                                      &data);
+	}
+
+	/* Losing track of the disk only costs a relabel later on */
+	if (ret == 0) {
+	    if (SmackDiskResourceKey(disk, &key) == 0)
+	        SmackAppliedRecord(mgr, def, key, seclabel->imagelabel);
+	    else
+	        virResetLastError();
+	}
+	VIR_FREE(key);
+
+	return ret;
+}
+
+
+static int
+SmackSetSecurityImageLabel(virSecurityManagerPtr mgr,
+                           virDomainDefPtr def,
+                           virDomainDiskDefPtr disk)
+{
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainSetSecurityImageLabel", def, disk->src);
+    ret = SmackSetSecurityImageLabelInt(mgr, def, disk);
+    SMACK_TRACE_RETURN("domainSetSecurityImageLabel", def, ret);
+    return ret;
+}
+
+static int
+SmackRestoreSecurityImageLabel(virSecurityManagerPtr mgr,
+			   virDomainDefPtr def,
+			   virDomainDiskDefPtr disk)
+{
+     char *key = NULL;
+     int ret;
+
+     SMACK_TRACE_ENTRY("domainRestoreSecurityImageLabel", def, disk->src);
+
+     if (SmackDiskResourceKey(disk, &key) == 0)
+         SmackAppliedForget(mgr, def, key);
+     VIR_FREE(key);
+
+     ret = SmackRestoreSecurityImageLabelInt(mgr, def, disk, 0, NULL);
+     SMACK_TRACE_RETURN("domainRestoreSecurityImageLabel", def, ret);
+     return ret;
+
+}
+
+/*
+ *
+ *static int
+ *SmackSetSecurityDaemonSocketLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,virDomainDefPtr def)
+ *{
+ *
+ *    virSecurityLabelDefPtr seclabel;
+ *
+ *    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+ *    if (seclabel == NULL)
+ *        return -1;
+ *
+ *    if (seclabel->label == NULL)
+ *        return 0;
+ *
+ *    if (!STREQ(SECURITY_SMACK_NAME, seclabel->model)) {
+ *        virReportError(VIR_ERR_INTERNAL_ERROR,
+ *                       _("security label driver mismatch: "
+ *                         "'%s' model configured for domain, but "
+ *                         "hypervisor driver is '%s'."),
+ *                       seclabel->model, SECURITY_SMACK_NAME);
+ *        return -1;
+ *    }
+ *
+ *
+ *    VIR_DEBUG("Setting VM %s socket context %s", def->name, seclabel->label);
+ *    if (setselfsocklabel("security.SMACK64IPIN",seclabel->label) == -1) {
+ *        virReportSystemError(errno,
+ *                             _("unable to set socket smack label '%s'"), seclabel->label);
+ *        return -1;
+ *    }
+ *
+ *    return 0;
+ *}
+ *
+ */
+
+static int
+SmackSetSecurityDaemonSocketLabelInt(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED, virDomainDefPtr vm)
+{
+
+
+	//return 0;
+
+    virSecurityLabelDefPtr seclabel;  
+    char label[SMACK_LABEL_LEN + 1];
+    int ret = -1;
+
+    seclabel = virDomainDefGetSecurityLabelDef(vm, SECURITY_SMACK_NAME);
+    if (seclabel == NULL)
+	return -1;
+
+    if (seclabel->label == NULL)
+	return 0;
+
+    if (!STREQ(SECURITY_SMACK_NAME, seclabel->model)) {
+	virReportError(VIR_ERR_INTERNAL_ERROR,
+		       _("security label driver mismatch: "
+			 "'%s' model configured for domain, but "
+			 "hypervisor driver is '%s'."),
+		       seclabel->model, SECURITY_SMACK_NAME);
+	    return -1;
+    }
+
+    if (SmackGetSelfLabel(label, sizeof(label)) < 0) {
+	virReportSystemError(errno,
+			     _("unable to get current process context '%s'"), seclabel->label);
+	 goto done; 
+    }
+	
+    VIR_DEBUG("label from self %s",label);
+
+    
+    VIR_DEBUG("Setting VM %s socket label %s", vm->name, seclabel->label);
+    if (setsockcreate(seclabel->label,"sockincreate") == -1) {
+	virReportSystemError(errno,
+			     _("unable to set socket smack label '%s'"), seclabel->label);
+	 goto done; 
+    }
+
+    ret = 0;
+done:
+
+    return ret;
+    
+}
+
+
+static int
+SmackSetSecurityDaemonSocketLabel(virSecurityManagerPtr mgr,
+                                  virDomainDefPtr vm)
+{
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainSetSecurityDaemonSocketLabel", vm, NULL);
+    ret = SmackSetSecurityDaemonSocketLabelInt(mgr, vm);
+    SMACK_TRACE_RETURN("domainSetSecurityDaemonSocketLabel", vm, ret);
+    return ret;
+}
+
+
+
+static int
+SmackSetSecuritySocketLabelInt(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
+		            virDomainDefPtr vm)
+{
+
+    virSecurityLabelDefPtr seclabel;
+
+    seclabel = virDomainDefGetSecurityLabelDef(vm, SECURITY_SMACK_NAME);
+    if (seclabel == NULL)
+	return -1;
+
+    if (seclabel->label == NULL)
+	return 0;
+
+    if (!STREQ(SECURITY_SMACK_NAME, seclabel->model)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("security label driver mismatch: "
+                         "'%s' model configured for domain, but "
+                         "hypervisor driver is '%s'."),
+                       seclabel->model, SECURITY_SMACK_NAME);
+            return -1;
+    }
+
+    VIR_DEBUG("Setting VM %s socket label %s", vm->name, seclabel->label);
+
+    if (setsockcreate(seclabel->label,"sockoutcreate") == -1) {
+        virReportSystemError(errno,
+                             _("unable to set socket smack label '%s'"),
+                             seclabel->label);
+            return -1; 
+    }
+
+
+    return 0;
+    
+}
+
+
+static int
+SmackSetSecuritySocketLabel(virSecurityManagerPtr mgr,
+                            virDomainDefPtr vm)
+{
+    SmackStatsProbe probe;
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainSetSecuritySocketLabel", vm, NULL);
+    SmackStatsBegin(&probe);
+    ret = SmackSetSecuritySocketLabelInt(mgr, vm);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_SET_SOCKET_LABEL, &probe);
+    SMACK_TRACE_RETURN("domainSetSecuritySocketLabel", vm, ret);
+    return ret;
+}
+
+
+static int
+SmackClearSecuritySocketLabelInt(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
+		              virDomainDefPtr def)
+{
+
+    virSecurityLabelDefPtr seclabel;
+
+    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+    if (seclabel == NULL)
+        return -1;
+
+    if (seclabel->label == NULL)
+        return 0;
+
+    if (!STREQ(SECURITY_SMACK_NAME, seclabel->model)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("security label driver mismatch: "
+                         "'%s' model configured for domain, but "
+                         "hypervisor driver is '%s'."),
+                       seclabel->model, SECURITY_SMACK_NAME);
+            return -1;
+    }
+
+    VIR_DEBUG("clear sock label");
+
+    if (setsockcreate(NULL,"sockincreate") == -1 || setsockcreate(NULL,"sockoutcreate") == -1) {
+        virReportSystemError(errno,
+                             _("unable to clear socket smack label '%s'"),
+                             seclabel->label);
+
+            return -1;
+    } 
+
+    return 0;
+}
+
+
+static int
+SmackClearSecuritySocketLabel(virSecurityManagerPtr mgr,
+                              virDomainDefPtr def)
+{
+    SmackStatsProbe probe;
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainClearSecuritySocketLabel", def, NULL);
+    SmackStatsBegin(&probe);
+    ret = SmackClearSecuritySocketLabelInt(mgr, def);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_CLEAR_SOCKET_LABEL, &probe);
+    SMACK_TRACE_RETURN("domainClearSecuritySocketLabel", def, ret);
+    return ret;
+}
+
+
+
+/*
+ * Access rules of a domain are expanded from the rule templates, a
+ * NULL subject or object standing for the domain's label, and written
+ * to smackfs in one go. Rules the domain is the subject of go away
+ * with a single write to revoke-subject, the others are deleted by
+ * rewriting them with no access.
+ */
+static void
+SmackRuleTemplatesFree(virSmackRuleTemplatePtr rules,
+                       size_t nrules)
+{
+    size_t i;
+
+    for (i = 0; i < nrules; i++) {
+        VIR_FREE(rules[i].subject);
+        VIR_FREE(rules[i].object);
+        VIR_FREE(rules[i].access);
+    }
+    VIR_FREE(rules);
+}
+
+
+/*
+ * Rules every dynamically labeled domain gets, in front of those set
+ * with virSmackSecuritySetRuleTemplates().
+ */
+static const virSmackRuleTemplate smackDefaultRules[] = {
+    /* Read the images it shares with other domains */
+    { NULL, (char *) SECURITY_SMACK_SHARED_LABEL, (char *) "r" },
+};
+
+
+/*
+ * Expand the rule templates for @label into @buf. Without @install,
+ * only the rules @label is not the subject of are expanded, with no
+ * access. Returns the number of rules.
+ */
+static size_t
+SmackRulesFormat(virSmackSecurityDataPtr priv,
+                 const char *label,
+                 bool install,
+                 virBufferPtr buf)
+{
+    size_t n = 0;
+    size_t i;
+
+    virMutexLock(&priv->lock);
+    for (i = 0; i < priv->nrules; i++) {
+        virSmackRuleTemplatePtr rule = &priv->rules[i];
+
+        if (!install && !rule->subject)
+            continue;
+
+        virBufferAsprintf(buf, "%s %s %s\n",
+                          rule->subject ? rule->subject : label,
+                          rule->object ? rule->object : label,
+                          install ? rule->access : "-");
+        n++;
+    }
+    virMutexUnlock(&priv->lock);
+
+    return n;
+}
+
+
+/*
+ * Writing several rules at once to load2 and friends came with Linux
+ * 3.12; older kernels parse the first rule of a write only, or fail
+ * it with EINVAL. Neither can be told apart from a successful write
+ * without leaving probe rules behind in the kernel, and the version
+ * says nothing about backports, so rules go one per write unless
+ * virSmackSecuritySetRulesMulti() says otherwise.
+ */
+static bool smackRulesMulti;
+
+
+/*
+ * Write @rules, @len bytes of whole lines, to @fd, in as few writes as
+ * the kernel takes: smackfs reads at most a page less one byte of
+ * rules per write.
+ */
+static int
+SmackRulesWriteChunks(int fd,
+                      const char *rules,
+                      size_t len)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t max = pagesize > 1 ? pagesize - 1 : 4095;
+
+    while (len > 0) {
+        size_t chunk = len;
+
+        if (chunk > max) {
+            /* Cut after the last rule that fits */
+            chunk = max;
+            while (chunk > 0 && rules[chunk - 1] != '\n')
+                chunk--;
+            if (chunk == 0) {
+                errno = EINVAL;
+                return -1;
+            }
+        }
+
+        if (SMACK_SYSCALL(safewrite(fd, rules, chunk)) != (ssize_t) chunk)
+            return -1;
+        rules += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Write @rules to the smackfs file @name. Kernels taking a single rule
+ * per write get them one by one.
+ */
+static int
+SmackRulesWrite(const char *name,
+                const char *rules,
+                size_t nrules)
+{
+    const char *smackfs = smack_smackfs_path();
+    char *path = NULL;
+    int fd = -1;
+    int ret = -1;
+
+    if (!smackfs) {
+        VIR_DEBUG("Smack is not active, not writing %zu rules to %s",
+                  nrules, name);
+        return 0;
+    }
+
+    if (virAsprintf(&path, "%s/%s", smackfs, name) < 0)
+        return -1;
+
+    if ((fd = SMACK_SYSCALL(open(path, O_WRONLY | O_CLOEXEC))) < 0) {
+        virReportSystemError(errno, _("unable to open '%s'"), path);
+        goto cleanup;
+    }
+
+    if (smackRulesMulti || nrules < 2) {
+        if (SmackRulesWriteChunks(fd, rules, strlen(rules)) < 0) {
+            virReportSystemError(errno,
+                                 _("unable to write %zu rules to '%s'"),
+                                 nrules, path);
+            goto cleanup;
+        }
+    } else {
+        const char *rule = rules;
+
+        while (*rule) {
+            const char *end = strchr(rule, '\n') + 1;
+
+            if (SMACK_SYSCALL(safewrite(fd, rule, end - rule)) !=
+                end - rule) {
+                virReportSystemError(errno,
+                                     _("unable to write rule '%.*s' to '%s'"),
+                                     (int) (end - rule - 1), rule, path);
+                goto cleanup;
+            }
+            rule = end;
+        }
+    }
+
+    VIR_DEBUG("Wrote %zu rules to %s", nrules, path);
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    VIR_FREE(path);
+    return ret;
+}
+
+
+static int
+SmackInstallDomainRules(virSecurityManagerPtr mgr,
+                        const char *label)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    size_t nrules;
+    int ret;
+
+    if ((nrules = SmackRulesFormat(priv, label, true, &buf)) == 0)
+        return 0;
+
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&buf);
+        virReportOOMError();
+        return -1;
+    }
+
+    ret = SmackRulesWrite("load2", virBufferCurrentContent(&buf), nrules);
+    virBufferFreeAndReset(&buf);
+    return ret;
+}
+
+
+/* Failures are only logged, the domain is going away anyway */
+static void
+SmackRevokeDomainRules(virSecurityManagerPtr mgr,
+                       const char *label)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    size_t nrules;
+
+    if (SmackRulesWrite("revoke-subject", label, 1) < 0) {
+        VIR_WARN("Unable to revoke rules of %s", label);
+        virResetLastError();
+    }
+
+    if ((nrules = SmackRulesFormat(priv, label, false, &buf)) > 0 &&
+        !virBufferError(&buf) &&
+        SmackRulesWrite("load2", virBufferCurrentContent(&buf),
+                        nrules) < 0) {
+        VIR_WARN("Unable to delete rules on %s", label);
+        virResetLastError();
+    }
+    virBufferFreeAndReset(&buf);
+}
+
+
+/*
+ * Running domains are reserved again when the daemon restarts, at
+ * which point the driver's label cache, labeled resources and host
+ * device references are rebuilt from what the domains actually carry.
+ * Disks of a domain are scanned by a pool of threads, and everything
+ * stops once the reconciliation budget set at Open is spent: state
+ * not rebuilt only costs redundant relabels later on. The budget is
+ * only checked between disks, so it is best effort: reading the label
+ * of an image on a hung filesystem blocks its worker regardless.
+ */
+typedef struct _SmackReconcileBatch SmackReconcileBatch;
+typedef SmackReconcileBatch *SmackReconcileBatchPtr;
+
+struct _SmackReconcileBatch {
+    virSecurityManagerPtr mgr;
+    virDomainDefPtr def;
+    const char *label;
+    unsigned long long deadline;
+
+    virMutex lock;
+    size_t next;
+    unsigned long long resources;
+    unsigned long long stale;
+    bool expired;
+};
+
+
+/*
+ * Rebuild the state of one image of the chain of a disk: the writable
+ * top layer is expected to carry the domain's label, every other layer
+ * the shared one and the domain is made a user of it again.
+ */
+static int
+SmackReconcileImage(virDomainDiskDefPtr disk,
+                    const char *path,
+                    size_t depth,
+                    void *opaque)
+{
+    SmackReconcileBatchPtr batch = opaque;
+    virSmackSecurityDataPtr priv =
+        virSecurityManagerGetPrivateData(batch->mgr);
+    bool top = depth == 0 && !disk->readonly;
+    const char *want = top ? batch->label : SECURITY_SMACK_SHARED_LABEL;
+    char cur[SMACK_LABEL_LEN + 1];
+    SmackFileHandle fh;
+    char *key = NULL;
+    bool match;
+
+    if (SmackFileOpen(path, &fh) < 0)
+        return 0;
+
+    match = SmackFileGetXattr(&fh, cur, sizeof(cur)) > 0 &&
+        STREQ(cur, want);
+    if (match)
+        SmackLabelCacheUpdate(priv, &fh.sb, want);
+    else
+        VIR_DEBUG("%s of %s does not carry %s", path,
+                  batch->def->name, want);
+    SmackFileClose(&fh);
+
+    if (!top) {
+        /* Whatever it carries, the domain still uses it */
+        if (SmackRefSharedImage(batch->mgr, batch->def, path, false) < 0)
+            virResetLastError();
+    } else if (match) {
+        if (SmackDiskResourceKey(disk, &key) == 0 && key)
+            SmackAppliedRecord(batch->mgr, batch->def, key, want);
+        virResetLastError();
+        VIR_FREE(key);
+    }
+
+    virMutexLock(&batch->lock);
+    batch->resources++;
+    if (!match)
+        batch->stale++;
+    virMutexUnlock(&batch->lock);
+
+    return 0;
+}
+
+
+static void
+SmackReconcileDisk(SmackReconcileBatchPtr batch,
+                   virDomainDiskDefPtr disk)
+{
+    if (disk->type == VIR_DOMAIN_DISK_TYPE_DIR)
+        return;
+
+    if (virDomainDiskDefForeachPath(disk, true, SmackReconcileImage,
+                                    batch) < 0)
+        virResetLastError();
+}
+
+
+static void
+SmackReconcileWorker(void *opaque)
+{
+    SmackReconcileBatchPtr batch = opaque;
+    size_t i;
+
+    for (;;) {
+        virMutexLock(&batch->lock);
+        if (!batch->expired && SmackNowMs() >= batch->deadline)
+            batch->expired = true;
+        i = batch->expired ? batch->def->ndisks : batch->next++;
+        virMutexUnlock(&batch->lock);
+
+        if (i >= batch->def->ndisks)
+            break;
+
+        SmackReconcileDisk(batch, batch->def->disks[i]);
+    }
+}
+
+
+/*
+ * Take back the references of the host devices of @def on the nodes
+ * they use.
+ */
+static void
+SmackReconcileHostdevs(virSecurityManagerPtr mgr,
+                       virDomainDefPtr def)
+{
+    size_t i, j;
+
+    for (i = 0; i < def->nhostdevs; i++) {
+        virDomainHostdevDefPtr dev = def->hostdevs[i];
+        SmackHostdevFilesPtr files = NULL;
+        char *key = NULL;
+
+        if (dev->mode != VIR_DOMAIN_HOSTDEV_MODE_SUBSYS)
+            continue;
+
+        if (!(key = SmackHostdevKey(dev, NULL)) ||
+            VIR_ALLOC(files) < 0 ||
+            SmackCollectHostdevFiles(dev, NULL, files) < 0) {
+            virResetLastError();
+            goto next;
+        }
+
+        for (j = 0; j < files->nfiles; j++) {
+            if (SmackHostdevNodeRef(mgr, files->files[j]) < 0)
+                break;
+        }
+
+        /* Untracked nodes would be restored while still in use, so the
+         * device is left untracked as a whole */
+        if (j < files->nfiles) {
+            VIR_WARN("Unable to track the nodes of a host device of %s",
+                     def->name);
+            virResetLastError();
+            while (j-- > 0)
+                ignore_value(SmackHostdevNodeUnref(mgr, files->files[j]));
+            goto next;
+        }
+
+        if (files->nfiles > 0) {
+            SmackHostdevFilesStore(mgr, def, key, files);
+            files = NULL;
+        }
+
+    next:
+        SmackHostdevFilesFree(files);
+        VIR_FREE(key);
+    }
+}
+
+
+static void
+SmackReconcileDomain(virSecurityManagerPtr mgr,
+                     virDomainDefPtr def,
+                     virSecurityLabelDefPtr seclabel,
+                     pid_t pid)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    SmackReconcileBatch batch = {
+        .mgr = mgr, .def = def, .label = seclabel->imagelabel,
+    };
+    virThreadPtr threads = NULL;
+    size_t nthreads = 0;
+    size_t nworkers;
+    unsigned long long start = SmackNowMs();
+    unsigned long long domains;
+    char cur[SMACK_LABEL_LEN + 1];
+    size_t i;
+
+    virMutexLock(&priv->lock);
+    batch.deadline = priv->reconcileDeadline;
+    nworkers = MIN(priv->relabelWorkers, def->ndisks);
+    if (start >= batch.deadline)
+        priv->reconcile.skipped++;
+    virMutexUnlock(&priv->lock);
+
+    if (start >= batch.deadline) {
+        VIR_DEBUG("Out of time, not reconciling labels of %s", def->name);
+        return;
+    }
+
+    if (pid > 0 && seclabel->label &&
+        (getpidlabel_r(pid, cur, sizeof(cur)) < 0 ||
+         STRNEQ(cur, seclabel->label)))
+        VIR_WARN("Process %lld of domain %s does not run as %s",
+                 (long long) pid, def->name, seclabel->label);
+
+    if (!seclabel->norelabel) {
+        SmackReconcileHostdevs(mgr, def);
+
+        if (def->ndisks > 0 && virMutexInit(&batch.lock) == 0) {
+            if (nworkers > 1 &&
+                VIR_ALLOC_N_QUIET(threads, nworkers - 1) == 0) {
+                for (nthreads = 0; nthreads < nworkers - 1; nthreads++) {
+                    if (virThreadCreate(&threads[nthreads], true,
+                                        SmackReconcileWorker, &batch) < 0)
+                        break;
+                }
+            }
+
+            SmackReconcileWorker(&batch);
+
+            for (i = 0; i < nthreads; i++)
+                virThreadJoin(&threads[i]);
+            VIR_FREE(threads);
+            virMutexDestroy(&batch.lock);
+        }
+    }
+
+    virMutexLock(&priv->lock);
+    domains = ++priv->reconcile.domains;
+    priv->reconcile.resources += batch.resources;
+    priv->reconcile.stale += batch.stale;
+    if (batch.expired)
+        priv->reconcile.skipped++;
+    virMutexUnlock(&priv->lock);
+
+    VIR_DEBUG("Reconciled %llu resources of %s in %llu ms, %llu stale%s",
+              batch.resources, def->name, SmackNowMs() - start, batch.stale,
+              batch.expired ? ", out of time" : "");
+    if (domains % 50 == 0)
+        VIR_INFO("Reconciled labels of %llu domains", domains);
+}
+
+
+/*
+ *Current called in qemuStartVMDaemon to setup a 'label'. We make the 
+ *label based on UUID.
+ *this is called on 'start'with RestoreSecurityLabel being called on 
+ *shutdown
+ */
+
+/*
+ * With @rules, the access rules of a dynamic label are appended there
+ * and counted in @nrules instead of being installed.
+ */
+static int
+SmackGenSecurityLabelInt(virSecurityManagerPtr mgr,
+		      virDomainDefPtr def,
+		      virBufferPtr rules,
+		      size_t *nrules)
+{
+    int ret = -1;
+    char label_name[SMACK_DOMAIN_LABEL_BUFLEN];
+    virSecurityLabelDefPtr seclabel; 
+    
+    seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
+    if(seclabel == NULL)
+	    return ret;
+    
+    VIR_DEBUG("label=%s",virSecurityManagerGetDriver(mgr));
+    if (seclabel->type == VIR_DOMAIN_SECLABEL_DYNAMIC &&
+        seclabel->label) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("security label already defined for VM"));
+        return ret;
+    }    
+
+    if (seclabel->imagelabel) {
+        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("security image label already defined for VM"));
+        return ret;
+    } 
+
+    if (seclabel->model &&
+        STRNEQ(seclabel->model, SECURITY_SMACK_NAME)) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                       _("security label model %s is not supported with smack"),
+                       seclabel->model);
+         return ret;
+    }
+
+    VIR_DEBUG("type=%d", seclabel->type);
+
+    get_label_name(def, label_name);
+   
+    if (seclabel->type == VIR_DOMAIN_SECLABEL_DYNAMIC){
+
+        /*set process label*/
+       if (VIR_STRDUP(seclabel->label,label_name) < 0)
+	 goto cleanup;
+    }
+
+    /*set imagelabel the same as label*/
+    if (VIR_STRDUP(seclabel->imagelabel,label_name) < 0)
+	 goto cleanup;
+    
+    if (!seclabel->model &&
+        VIR_STRDUP(seclabel->model, SECURITY_SMACK_NAME) < 0)
+         goto cleanup;
+
+    /* The domain keeps its label interned until it is released; the
+     * copies above are owned and freed by the domain definition */
+    if (SmackDomainLabelHold(mgr, def, seclabel->imagelabel) < 0)
+        goto cleanup;
+
+    if (seclabel->type == VIR_DOMAIN_SECLABEL_DYNAMIC) {
+        if (rules) {
+            *nrules += SmackRulesFormat(virSecurityManagerGetPrivateData(mgr),
+                                        seclabel->label, true, rules);
+        } else if (SmackInstallDomainRules(mgr, seclabel->label) < 0) {
+            SmackDomainLabelDrop(mgr, def);
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+
+    if(ret != 0){
+       if (seclabel->type == VIR_DOMAIN_SECLABEL_DYNAMIC)
+           VIR_FREE(seclabel->label);
+	   VIR_FREE(seclabel->imagelabel);
+       if (seclabel->type == VIR_DOMAIN_SECLABEL_DYNAMIC &&
+           !seclabel->baselabel)
+	   VIR_FREE(seclabel->model);
+    }
+
+    VIR_DEBUG("model=%s label=%s imagelabel=%s",
+              NULLSTR(seclabel->model),
+              NULLSTR(seclabel->label),
+              NULLSTR(seclabel->imagelabel));
+    
+    return ret;
+
+}
+
+
+static int
+SmackGenSecurityLabel(virSecurityManagerPtr mgr,
+                      virDomainDefPtr def)
+{
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainGenSecurityLabel", def, NULL);
+    ret = SmackGenSecurityLabelInt(mgr, def, NULL, NULL);
+    SMACK_TRACE_RETURN("domainGenSecurityLabel", def, ret);
+    return ret;
+}
+
+
+/* Drop the labels SmackGenSecurityLabelInt() generated for @def */
+static void
+SmackGenSecurityLabelUndo(virSecurityManagerPtr mgr,
+                          virDomainDefPtr def)
+{
+    virSecurityLabelDefPtr seclabel;
+
+    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+    if (!seclabel || !seclabel->imagelabel)
+        return;
+
+    SmackDomainLabelDrop(mgr, def);
+    VIR_FREE(seclabel->imagelabel);
+    if (seclabel->type == VIR_DOMAIN_SECLABEL_DYNAMIC) {
+        VIR_FREE(seclabel->label);
+        if (!seclabel->baselabel)
+            VIR_FREE(seclabel->model);
+    }
+}
+
+
+
+static int
+SmackReserveSecurityLabelInt(virSecurityManagerPtr mgr,
+	                  virDomainDefPtr def,
+	                  pid_t pid)
+{
+    virSecurityLabelDefPtr seclabel;
+
+    /*Security label is based UUID, only take the reference
+     * SmackGenSecurityLabel would have taken*/
+    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+    if (seclabel == NULL || !seclabel->imagelabel)
+        return 0;
+
+    if (SmackDomainLabelHold(mgr, def, seclabel->imagelabel) < 0)
+        return -1;
+
+    SmackReconcileDomain(mgr, def, seclabel, pid);
+    return 0;
+}
+
+
+static int
+SmackReserveSecurityLabel(virSecurityManagerPtr mgr,
+                          virDomainDefPtr def,
+                          pid_t pid)
+{
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainReserveSecurityLabel", def, NULL);
+    ret = SmackReserveSecurityLabelInt(mgr, def, pid);
+    SMACK_TRACE_RETURN("domainReserveSecurityLabel", def, ret);
+    return ret;
+}
+
+/*
+ *Called on VM shutdown and destroy.
+ */
+
+static int
+SmackReleaseSecurityLabelInt(virSecurityManagerPtr mgr,
+		          virDomainDefPtr def)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
+    virSecurityLabelDefPtr seclabel;
+    virHashTablePtr hostdevs;
+
+    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+    if (seclabel == NULL)
+	    return -1;
+
+    /* Host devices never restored, e.g. after a failed start */
+    virUUIDFormat(def->uuid, uuidstr);
+    virMutexLock(&priv->lock);
+    if ((hostdevs = virHashLookup(priv->hostdevFiles, uuidstr))) {
+        virHashForEach(hostdevs, SmackHostdevFilesUnrefNodes, priv);
+        ignore_value(virHashRemoveEntry(priv->hostdevFiles, uuidstr));
+    }
+    ignore_value(virHashRemoveEntry(priv->applied, uuidstr));
+    virMutexUnlock(&priv->lock);
+
+    if (seclabel->type == VIR_DOMAIN_SECLABEL_DYNAMIC) {
+        if (seclabel->label)
+            SmackRevokeDomainRules(mgr, seclabel->label);
+        VIR_FREE(seclabel->label);
+        VIR_FREE(seclabel->model);
+    }
+    SmackDomainLabelDrop(mgr, def);
+    VIR_FREE(seclabel->imagelabel);
+
+    return 0;
+
+}
+
+
+static int
+SmackReleaseSecurityLabel(virSecurityManagerPtr mgr,
+                          virDomainDefPtr def)
+{
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainReleaseSecurityLabel", def, NULL);
+    ret = SmackReleaseSecurityLabelInt(mgr, def);
+    SMACK_TRACE_RETURN("domainReleaseSecurityLabel", def, ret);
+    return ret;
+}
+
+
+
+/* Seen with 'virsh dominfo <vm>'. This function only called if the VM is
+ * running.
+ */
+static int
+SmackGetSecurityProcessLabelInt(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
+	                     virDomainDefPtr def ATTRIBUTE_UNUSED,
+	                     pid_t pid,
+			     virSecurityLabelPtr sec)
+{
+	 ssize_t len;
+
+	 if ((len = getpidlabel_r(pid, sec->label, sizeof(sec->label))) < 0) {
+             virReportSystemError(errno,
+	                        _("unable to get PID %d security label"),
+	                        pid);
+             return -1;
+	 }
+
+	 if (len > SMACK_LABEL_LEN) {
+    	     virReportError(VIR_ERR_INTERNAL_ERROR,
+	                    _("security label exceeds "
+	                      "maximum length: %d"),
+	                    SMACK_LABEL_LEN);
+	     return -1;
+	 }
+
+	 /*Smack default enforced*/
+	 sec->enforcing = 1;
+
+	 return 0;
+}
+
+
+static int
+SmackGetSecurityProcessLabel(virSecurityManagerPtr mgr,
+                             virDomainDefPtr def,
+                             pid_t pid,
+                             virSecurityLabelPtr sec)
+{
+    SmackStatsProbe probe;
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainGetSecurityProcessLabel", def, NULL);
+    SmackStatsBegin(&probe);
+    ret = SmackGetSecurityProcessLabelInt(mgr, def, pid, sec);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_GET_PROCESS_LABEL, &probe);
+    SMACK_TRACE_RETURN("domainGetSecurityProcessLabel", def, ret);
+    return ret;
+}
+
+
+static int
+SmackSetSecurityProcessLabelInt(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
+	                     virDomainDefPtr def)
+{
+    virSecurityLabelDefPtr seclabel;
+
+    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+
+    if (seclabel == NULL)
+        return -1;
+
+    if (seclabel->label == NULL)
+        return 0;
+
+    if (STRNEQ(SECURITY_SMACK_NAME, seclabel->model)) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                      _("security label driver mismatch: "
+                        "\'%s\' model configured for domain, but "
+                        "hypervisor driver is \'%s\'."),
+                      seclabel->model, SECURITY_SMACK_NAME);
+
+               return -1;
+	}
+
+    if (SmackSetSelfLabel(seclabel->label) < 0) {
+	 virReportSystemError(errno,
+		        _("unable to set security label '%s'"),
+		        seclabel->label);
+	    
+	    return -1;
+        }
+
+    return 0;
+
+}
+
+
+static int
+SmackSetSecurityProcessLabel(virSecurityManagerPtr mgr,
+                             virDomainDefPtr def)
+{
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainSetSecurityProcessLabel", def, NULL);
+    ret = SmackSetSecurityProcessLabelInt(mgr, def);
+    SMACK_TRACE_RETURN("domainSetSecurityProcessLabel", def, ret);
+    return ret;
+}
+
+
+
+static int
+SmackSetSecurityChildProcessLabelInt(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED, 
+	                   	  virDomainDefPtr def,
+				  virCommandPtr cmd)
+{
+       virSecurityLabelDefPtr seclabel;
+
+       seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+
+       if (seclabel == NULL)
+	   return -1;
+
+       if (seclabel->label == NULL)
+	   return 0;
+
+       if (STRNEQ(SECURITY_SMACK_NAME, seclabel->model)) {
+           virReportError(VIR_ERR_INTERNAL_ERROR,
+                          _("security label driver mismatch: "
+                            "\'%s\' model configured for domain, but "
+                            "hypervisor driver is \'%s\'."),
+                          seclabel->model, SECURITY_SMACK_NAME);
+
+	   return -1;
+       }
+
+       /*
+        *get_label_name(def, label_name);
+	*/
+
+    /* save in cmd to be set after fork/before child process is exec'ed */
+       virCommandSetSmackLabel(cmd,seclabel->label);
+       VIR_DEBUG("save smack label in cmd %s",seclabel->label);
+
+       return 0;
+
+}
+
+
+static int
+SmackSetSecurityChildProcessLabel(virSecurityManagerPtr mgr,
+                                  virDomainDefPtr def,
+                                  virCommandPtr cmd)
+{
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainSetSecurityChildProcessLabel", def, NULL);
+    ret = SmackSetSecurityChildProcessLabelInt(mgr, def, cmd);
+    SMACK_TRACE_RETURN("domainSetSecurityChildProcessLabel", def, ret);
+    return ret;
+}
+
+
+
+/*
+ * Disks of a domain are relabeled by a small pool of threads, the
+ * calling thread being one of them. Each disk records its own result
+ * so that errors can be reported in disk order once all of them are
+ * done, no matter which worker finished first.
+ */
+typedef struct _SmackDiskJob SmackDiskJob;
+typedef SmackDiskJob *SmackDiskJobPtr;
+
+struct _SmackDiskJob {
+    int ret;
+    virErrorPtr err;
+};
+
+typedef struct _SmackDiskBatch SmackDiskBatch;
+typedef SmackDiskBatch *SmackDiskBatchPtr;
+
+struct _SmackDiskBatch {
+    virSecurityManagerPtr mgr;
+    virDomainDefPtr def;
+    bool restore;
+    int migrated;
+    SmackRelabelPlanPtr plan;
+
+    virMutex lock;
+    size_t next;
+    SmackDiskJobPtr jobs;
+};
+
+
+static int
+SmackRelabelDisk(SmackDiskBatchPtr batch,
+                 virDomainDiskDefPtr disk)
+{
+    if (batch->restore)
+        return SmackRestoreSecurityImageLabelInt(batch->mgr, batch->def,
+                                                 disk, batch->migrated,
+                                                 batch->plan);
+
+    return SmackSetSecurityImageLabel(batch->mgr, batch->def, disk);
+}
+
+
+static void
+SmackRelabelDiskWorker(void *opaque)
+{
+    SmackDiskBatchPtr batch = opaque;
+    size_t i;
+
+    for (;;) {
+        virMutexLock(&batch->lock);
+        i = batch->next++;
+        virMutexUnlock(&batch->lock);
+
+        if (i >= batch->def->ndisks)
+            break;
+
+        virResetLastError();
+        if ((batch->jobs[i].ret = SmackRelabelDisk(batch,
+                                                   batch->def->disks[i])) < 0)
+            batch->jobs[i].err = virSaveLastError();
+    }
+}
+
+
+static int
+SmackRelabelAllDisks(virSecurityManagerPtr mgr,
+                     virDomainDefPtr def,
+                     bool restore,
+                     int migrated)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    SmackDiskBatch batch = {
+        .mgr = mgr, .def = def, .restore = restore, .migrated = migrated,
+    };
+    virThreadPtr threads = NULL;
+    size_t nthreads = 0;
+    size_t nworkers;
+    size_t nfailed = 0;
+    virErrorPtr firstErr = NULL;
+    bool deferred;
+    char ebuf[1024];
+    size_t i;
+    int ret = -1;
+
+    if (def->ndisks == 0)
+        return 0;
+
+    virMutexLock(&priv->lock);
+    deferred = restore && priv->deferRestore && priv->restoreQueue;
+    nworkers = MIN(priv->relabelWorkers, def->ndisks);
+    virMutexUnlock(&priv->lock);
+
+    if (VIR_ALLOC_N(batch.jobs, def->ndisks) < 0)
+        return -1;
+
+    if (virMutexInit(&batch.lock) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("unable to initialize relabel mutex"));
+        VIR_FREE(batch.jobs);
+        return -1;
+    }
+
+    /* Plain top layer restores are collected and run as one batch
+     * once the workers are done, or deferred */
+    if (restore && (deferred || SmackRelabelPlanWanted(mgr)) &&
+        !(batch.plan = SmackRelabelPlanNew())) {
+        virMutexDestroy(&batch.lock);
+        VIR_FREE(batch.jobs);
+        return -1;
+    }
+
+    /* Failing to spawn helpers is not fatal, the caller
+     * thread works through whatever is left on its own. */
+    if (nworkers > 1 && VIR_ALLOC_N(threads, nworkers - 1) == 0) {
+        for (nthreads = 0; nthreads < nworkers - 1; nthreads++) {
+            if (virThreadCreate(&threads[nthreads], true,
+                                SmackRelabelDiskWorker, &batch) < 0) {
+                VIR_WARN("Unable to spawn disk relabel worker: %s",
+                         virStrerror(errno, ebuf, sizeof(ebuf)));
+                break;
+            }
+        }
+    }
+
+    VIR_DEBUG("%s labels on %zu disks of %s using %zu threads",
+              restore ? "Restoring" : "Setting",
+              def->ndisks, def->name, nthreads + 1);
+
+    SmackRelabelDiskWorker(&batch);
+
+    for (i = 0; i < nthreads; i++)
+        virThreadJoin(&threads[i]);
+
+    /* Run synchronously if queueing fails */
+    if (deferred && SmackRestoreQueuePush(mgr, batch.plan) == 0) {
+        SmackRelabelPlanFree(batch.plan);
+        batch.plan = NULL;
+    } else if (deferred) {
+        virResetLastError();
+    }
+
+    for (i = 0; i < def->ndisks; i++) {
+        if (batch.jobs[i].ret >= 0)
+            continue;
+
+        if (nfailed++ == 0) {
+            firstErr = batch.jobs[i].err;
+            batch.jobs[i].err = NULL;
+        } else {
+            VIR_WARN("Unable to %s label of disk %s of domain %s: %s",
+                     restore ? "restore" : "set",
+                     NULLSTR(def->disks[i]->src), def->name,
+                     batch.jobs[i].err && batch.jobs[i].err->message ?
+                     batch.jobs[i].err->message : _("unknown error"));
+        }
+    }
+
+    if (nfailed == 0) {
+        ret = SmackRelabelPlanRun(mgr, batch.plan);
+    } else if (nfailed == 1) {
+        ignore_value(SmackRelabelPlanRun(mgr, batch.plan));
+        if (firstErr)
+            virSetError(firstErr);
+        else
+            virReportError(VIR_ERR_OPERATION_FAILED,
+                           _("unable to %s label of a disk of domain '%s'"),
+                           restore ? "restore" : "set", def->name);
+    } else {
+        ignore_value(SmackRelabelPlanRun(mgr, batch.plan));
+        virReportError(VIR_ERR_OPERATION_FAILED,
+                       _("unable to %s label of %zu out of %zu disks "
+                         "of domain '%s': %s"),
+                       restore ? "restore" : "set",
+                       nfailed, def->ndisks, def->name,
+                       firstErr && firstErr->message ?
+                       firstErr->message : _("unknown error"));
+    }
+
+    virFreeError(firstErr);
+    for (i = 0; i < def->ndisks; i++)
+        virFreeError(batch.jobs[i].err);
+    SmackRelabelPlanFree(batch.plan);
+    VIR_FREE(batch.jobs);
+    VIR_FREE(threads);
+    virMutexDestroy(&batch.lock);
+    return ret;
+}
+
+
+static int
+SmackSetSecurityAllLabelInt(virSecurityManagerPtr mgr,
+		         virDomainDefPtr def,
+			 const char *stdin_path)
+{
+   virSecurityLabelDefPtr seclabel;
+
+   seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+
+   if (seclabel == NULL)
+	   return -1;
+
+   if (seclabel->norelabel)
+	   return 0;
+
+   VIR_DEBUG("set image security label before");
+
+   if (SmackRelabelAllDisks(mgr, def, false, 0) < 0)
+       return -1;
+
+   VIR_DEBUG("set image security label after");
+
+   if (stdin_path &&
+       SmackSetFileLabel(mgr, stdin_path, seclabel->imagelabel) < 0)
+       return -1;
+
+    return 0;
+
+}
+
+
+static int
+SmackSetSecurityAllLabel(virSecurityManagerPtr mgr,
+                         virDomainDefPtr def,
+                         const char *stdin_path)
+{
+    SmackStatsProbe probe;
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainSetSecurityAllLabel", def, stdin_path);
+    SmackStatsBegin(&probe);
+    ret = SmackSetSecurityAllLabelInt(mgr, def, stdin_path);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_SET_ALL_LABEL, &probe);
+    SMACK_TRACE_RETURN("domainSetSecurityAllLabel", def, ret);
+    return ret;
+}
+
+static int
+SmackRestoreSecurityAllLabelInt(virSecurityManagerPtr mgr,
+                             virDomainDefPtr def,
+                             int migrated)
+{
+   virSecurityLabelDefPtr seclabel;
+
+   VIR_DEBUG("Restoring security label on %s", def->name);
+
+   seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+
+   if (seclabel == NULL)
+	   return -1;
+
+   if (seclabel->norelabel)
+	   return 0;
+
+   SmackAppliedForgetDomain(mgr, def);
+
+   return SmackRelabelAllDisks(mgr, def, true, migrated);
+
+}
+
+
+static int
+SmackRestoreSecurityAllLabel(virSecurityManagerPtr mgr,
+                             virDomainDefPtr def,
+                             int migrated)
+{
+    SmackStatsProbe probe;
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainRestoreSecurityAllLabel", def, NULL);
+    SmackStatsBegin(&probe);
+    ret = SmackRestoreSecurityAllLabelInt(mgr, def, migrated);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_RESTORE_ALL_LABEL, &probe);
+    SMACK_TRACE_RETURN("domainRestoreSecurityAllLabel", def, ret);
+    return ret;
+}
+
+
+
+static int
+SmackSetSecurityHostdevLabelInt(virSecurityManagerPtr mgr,
+		             virDomainDefPtr def,
+			     virDomainHostdevDefPtr dev,
+			     const char *vroot)
+{
+	virSecurityLabelDefPtr seclabel;
+	char *key = NULL;
+	int ret;
+
+	seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
+	if (seclabel == NULL)
+            return -1;
+
+	if (seclabel->norelabel)
+            return 0;
+
+	switch (dev->mode) {
+        case VIR_DOMAIN_HOSTDEV_MODE_SUBSYS:
+	    ret = SmackSetSecurityHostdevSubsysLabel(mgr,def,dev,vroot);
+	    break;
+
+        case VIR_DOMAIN_HOSTDEV_MODE_CAPABILITIES:
+	    ret = SmackSetSecurityHostdevCapsLabel(mgr,def,dev,vroot);
+	    break;
+
+        default:
+	    return 0;
+
+	}
+
+	/* Losing track of the device only costs a relabel later on */
+	if (ret == 0) {
+	    if (SmackHostdevResourceKey(dev, vroot, &key) == 0)
+	        SmackAppliedRecord(mgr, def, key, seclabel->imagelabel);
+	    else
+	        virResetLastError();
+	}
+	VIR_FREE(key);
+
+	return ret;
+}
+
+
+static int
+SmackSetSecurityHostdevLabel(virSecurityManagerPtr mgr,
+                             virDomainDefPtr def,
+                             virDomainHostdevDefPtr dev,
+                             const char *vroot)
+{
+    SmackStatsProbe probe;
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainSetSecurityHostdevLabel", def, NULL);
+    SmackStatsBegin(&probe);
+    ret = SmackSetSecurityHostdevLabelInt(mgr, def, dev, vroot);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_SET_HOSTDEV_LABEL, &probe);
+    SMACK_TRACE_RETURN("domainSetSecurityHostdevLabel", def, ret);
+    return ret;
+}
+
+
+static int
+SmackRestoreSecurityHostdevLabelInt(virSecurityManagerPtr mgr,
+		                 virDomainDefPtr def,
+				 virDomainHostdevDefPtr dev,
+				 const char *vroot)
+{
+    virSecurityLabelDefPtr seclabel;	
+    char *key = NULL;
+
+    seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
+    if (seclabel == NULL)
+	return -1;
+
+    if (seclabel->norelabel)
+	return 0;
+
+    if (SmackHostdevResourceKey(dev, vroot, &key) == 0)
+        SmackAppliedForget(mgr, def, key);
+    VIR_FREE(key);
+
+    switch (dev->mode) {
+    case VIR_DOMAIN_HOSTDEV_MODE_SUBSYS:
+        return SmackRestoreSecurityHostdevSubsysLabel(mgr, def, dev, vroot);
+
+    case VIR_DOMAIN_HOSTDEV_MODE_CAPABILITIES:
+        return SmackRestoreSecurityHostdevCapsLabel(mgr, dev, vroot);
+
+    default:
+        return 0;
+    }
+}
+
+
+static int
+SmackRestoreSecurityHostdevLabel(virSecurityManagerPtr mgr,
+                                 virDomainDefPtr def,
+                                 virDomainHostdevDefPtr dev,
+                                 const char *vroot)
+{
+    SmackStatsProbe probe;
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainRestoreSecurityHostdevLabel", def, NULL);
+    SmackStatsBegin(&probe);
+    ret = SmackRestoreSecurityHostdevLabelInt(mgr, def, dev, vroot);
+    SmackStatsEnd(VIR_SMACK_PRIMITIVE_RESTORE_HOSTDEV_LABEL, &probe);
+    SMACK_TRACE_RETURN("domainRestoreSecurityHostdevLabel", def, ret);
+    return ret;
+}
+	
+
+static int
+SmackSetSavedStateLabelInt(virSecurityManagerPtr mgr,
+	                virDomainDefPtr def,
+                        const char *savefile) 
+{
+	 virSecurityLabelDefPtr seclabel;
 
-    return 0;
+         seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+         if (seclabel == NULL)
+             return -1;
 
+         if (seclabel->norelabel)
+             return 0;
+
+         return SmackSetFileLabel(mgr, savefile, seclabel->imagelabel);
 }
 
 
 static int
-SmackSetSecurityImageLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-			   virDomainDefPtr def,
-			   virDomainDiskDefPtr disk)
+SmackSetSavedStateLabel(virSecurityManagerPtr mgr,
+                        virDomainDefPtr def,
+                        const char *savefile)
 {
-	virSecurityLabelDefPtr seclabel;
-	seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
+    int ret;
 
-	if (seclabel == NULL)
-	    return -1;
+    SMACK_TRACE_ENTRY("domainSetSavedStateLabel", def, savefile);
+    ret = SmackSetSavedStateLabelInt(mgr, def, savefile);
+    SMACK_TRACE_RETURN("domainSetSavedStateLabel", def, ret);
+    return ret;
+}
 
-	if (seclabel->norelabel)
-	    return 0;
 
-	if (disk->type == VIR_DOMAIN_DISK_TYPE_NETWORK)
-	    return 0;
+static int
+SmackRestoreSavedStateLabelInt(virSecurityManagerPtr mgr,
+		            virDomainDefPtr def,
+			    const char *savefile)
+{
+    virSecurityLabelDefPtr seclabel;
 
-   VIR_DEBUG("set disk image security label before");
+    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+    if (seclabel == NULL)
+        return -1;
 
-        if (setxattr(disk->src,"security.SMACK64",seclabel->imagelabel,strlen(seclabel->imagelabel) + 1,0)< 0)
-	    return -1;
+    if (seclabel->norelabel)
+        return 0;
+
+    return SmackRestoreSecurityFileLabel(mgr, savefile);
+}
 
-   VIR_DEBUG("disk image %s",disk->src);
-   VIR_DEBUG("set disk image security label after");
 
-	return 0;
+static int
+SmackRestoreSavedStateLabel(virSecurityManagerPtr mgr,
+                            virDomainDefPtr def,
+                            const char *savefile)
+{
+    int ret;
 
+    SMACK_TRACE_ENTRY("domainRestoreSavedStateLabel", def, savefile);
+    ret = SmackRestoreSavedStateLabelInt(mgr, def, savefile);
+    SMACK_TRACE_RETURN("domainRestoreSavedStateLabel", def, ret);
+    return ret;
 }
 
 static int
-SmackRestoreSecurityImageLabel(virSecurityManagerPtr mgr,
-			   virDomainDefPtr def,
-			   virDomainDiskDefPtr disk)
+SmackSetImageFDLabelInt(virSecurityManagerPtr mgr,
+	             virDomainDefPtr def,
+                     int fd) 
 {
-     return SmackRestoreSecurityImageLabelInt(mgr, def,disk,0);
+    virSecurityLabelDefPtr seclabel;
+
+    seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
+
+    if (seclabel == NULL)
+	return -1;
+
+    if (seclabel->imagelabel == NULL)
+	return 0;
 
+    return SmackFSetFileLabel(mgr, fd, seclabel->imagelabel);
+      
 }
 
-/*
- *
- *static int
- *SmackSetSecurityDaemonSocketLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,virDomainDefPtr def)
- *{
- *
- *    virSecurityLabelDefPtr seclabel;
- *
- *    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
- *    if (seclabel == NULL)
- *        return -1;
- *
- *    if (seclabel->label == NULL)
- *        return 0;
- *
- *    if (!STREQ(SECURITY_SMACK_NAME, seclabel->model)) {
- *        virReportError(VIR_ERR_INTERNAL_ERROR,
- *                       _("security label driver mismatch: "
- *                         "'%s' model configured for domain, but "
- *                         "hypervisor driver is '%s'."),
- *                       seclabel->model, SECURITY_SMACK_NAME);
- *        return -1;
- *    }
- *
- *
- *    VIR_DEBUG("Setting VM %s socket context %s", def->name, seclabel->label);
- *    if (setselfsocklabel("security.SMACK64IPIN",seclabel->label) == -1) {
- *        virReportSystemError(errno,
- *                             _("unable to set socket smack label '%s'"), seclabel->label);
- *        return -1;
- *    }
- *
- *    return 0;
- *}
- *
- */
 
 static int
-SmackSetSecurityDaemonSocketLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED, virDomainDefPtr vm)
+SmackSetImageFDLabel(virSecurityManagerPtr mgr,
+                     virDomainDefPtr def,
+                     int fd)
 {
+    int ret;
 
+    SMACK_TRACE_ENTRY("domainSetSecurityImageFDLabel", def, NULL);
+    ret = SmackSetImageFDLabelInt(mgr, def, fd);
+    SMACK_TRACE_RETURN("domainSetSecurityImageFDLabel", def, ret);
+    return ret;
+}
 
-	//return 0;
 
-    virSecurityLabelDefPtr seclabel;  
-    char *label = NULL;
-    int ret = -1;
+static int
+SmackSetTapFDLabelInt(virSecurityManagerPtr mgr,
+	           virDomainDefPtr def,
+                   int fd) 
+{
+    struct stat buf;
+    virSecurityLabelDefPtr seclabel;
 
-    seclabel = virDomainDefGetSecurityLabelDef(vm, SECURITY_SMACK_NAME);
+    seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
     if (seclabel == NULL)
-	return -1;
+	    return -1;
 
     if (seclabel->label == NULL)
-	return 0;
+	    return 0;
+    
 
-    if (!STREQ(SECURITY_SMACK_NAME, seclabel->model)) {
-	virReportError(VIR_ERR_INTERNAL_ERROR,
-		       _("security label driver mismatch: "
-			 "'%s' model configured for domain, but "
-			 "hypervisor driver is '%s'."),
-		       seclabel->model, SECURITY_SMACK_NAME);
+    if (fstat(fd, &buf) < 0) {
+        virReportSystemError(errno, _("cannot stat tap fd %d"), fd);
 	    return -1;
     }
+   
+    if ((buf.st_mode & S_IFMT) != S_IFCHR) {
+        virReportError(VIR_ERR_INTERNAL_ERROR,
+                      _("tap fd %d is not character device"), fd);
+	    return -1;
+    }
+       
+    return SmackFSetFileLabel(mgr, fd, seclabel->label);
+      
+}
 
-    if (smack_new_label_from_self(&label) == -1){
-	virReportSystemError(errno,
-			     _("unable to get current process context '%s'"), seclabel->label);
-	 goto done; 
+
+static int
+SmackSetTapFDLabel(virSecurityManagerPtr mgr,
+                   virDomainDefPtr def,
+                   int fd)
+{
+    int ret;
+
+    SMACK_TRACE_ENTRY("domainSetSecurityTapFDLabel", def, NULL);
+    ret = SmackSetTapFDLabelInt(mgr, def, fd);
+    SMACK_TRACE_RETURN("domainSetSecurityTapFDLabel", def, ret);
+    return ret;
+}
+
+
+static char *
+SmackGetMountOptionsInt(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
+		     virDomainDefPtr def)
+{
+	char *opts = NULL;
+	char label_name[SMACK_DOMAIN_LABEL_BUFLEN];
+	virSecurityLabelDefPtr seclabel;
+	
+	if ((seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME))) {
+              if (!seclabel->imagelabel) {
+                 get_label_name(def, label_name);
+                 if (VIR_STRDUP(seclabel->imagelabel, label_name) < 0)
+                     return NULL;
+              }
+
+
+	      if (seclabel->imagelabel &&
+                  virAsprintf(&opts,
+			      ",smack_label=\"%s\"",
+			      (const char*) seclabel->imagelabel) < 0) 
+		  return NULL;
+     }
+
+        if (!opts && VIR_STRDUP(opts,"") < 0)
+		return NULL;
+
+	return opts;
+
+}
+
+
+static char *
+SmackGetMountOptions(virSecurityManagerPtr mgr,
+                     virDomainDefPtr def)
+{
+    char *ret;
+
+    SMACK_TRACE_ENTRY("domainGetSecurityMountOptions", def, NULL);
+    ret = SmackGetMountOptionsInt(mgr, def);
+    SMACK_TRACE_RETURN("domainGetSecurityMountOptions", def, ret ? 0 : -1);
+    return ret;
+}
+
+static const char *
+SmackGetBaseLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
+                  int virtType ATTRIBUTE_UNUSED)
+{
+   return NULL;
+}
+
+/*
+ * Report the label cache counters of a manager driven by this driver.
+ */
+int
+virSmackSecurityGetLabelCacheStats(virSecurityManagerPtr mgr,
+                                   unsigned long long *hits,
+                                   unsigned long long *misses,
+                                   unsigned long long *invalidations)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+
+    if (!priv)
+        return -1;
+
+    *hits = __sync_fetch_and_add(&priv->cacheHits, 0);
+    *misses = __sync_fetch_and_add(&priv->cacheMisses, 0);
+    *invalidations = __sync_fetch_and_add(&priv->cacheInvalidations, 0);
+
+    return 0;
+}
+
+
+/*
+ * Set how many disks of a single domain may be relabeled concurrently.
+ * Passing 0 restores the default, 1 makes relabeling sequential.
+ */
+int
+virSmackSecuritySetRelabelWorkers(virSecurityManagerPtr mgr,
+                                  unsigned int workers)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+
+    if (!priv)
+        return -1;
+
+    if (workers > SMACK_RELABEL_WORKERS_MAX) {
+        virReportError(VIR_ERR_INVALID_ARG,
+                       _("relabel workers %u exceeds maximum %d"),
+                       workers, SMACK_RELABEL_WORKERS_MAX);
+        return -1;
+    }
+
+    virMutexLock(&priv->lock);
+    priv->relabelWorkers = workers ? workers : SMACK_RELABEL_WORKERS_DEFAULT;
+    virMutexUnlock(&priv->lock);
+
+    return 0;
+}
+
+
+/*
+ * Set how many threads may walk a single directory tree being
+ * relabeled. Passing 0 restores the default.
+ */
+int
+virSmackSecuritySetTreeWorkers(virSecurityManagerPtr mgr,
+                               unsigned int workers)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+
+    if (!priv)
+        return -1;
+
+    if (workers > SMACK_TREE_WORKERS_MAX) {
+        virReportError(VIR_ERR_INVALID_ARG,
+                       _("tree relabel workers %u exceeds maximum %d"),
+                       workers, SMACK_TREE_WORKERS_MAX);
+        return -1;
+    }
+
+    virMutexLock(&priv->lock);
+    priv->treeWorkers = workers ? workers : SMACK_TREE_WORKERS_DEFAULT;
+    virMutexUnlock(&priv->lock);
+
+    return 0;
+}
+
+
+/*
+ * Enable or disable io_uring submission of bulk relabel operations. It
+ * is only used if built with liburing and the kernel supports it, and
+ * stays disabled by default until it has been measured against the
+ * synchronous path on real storage.
+ */
+int
+virSmackSecuritySetUseIOUring(virSecurityManagerPtr mgr,
+                              bool enable)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+
+    if (!priv)
+        return -1;
+
+    virMutexLock(&priv->lock);
+    priv->useUring = enable;
+    virMutexUnlock(&priv->lock);
+
+    return 0;
+}
+
+
+/*
+ * Select the extended attribute labels are stored in, either
+ * SECURITY_SMACK_XATTR or SECURITY_SMACK_USER_XATTR; NULL restores the
+ * default. It applies process wide and is meant to be set before any
+ * label is touched.
+ */
+int
+virSmackSecuritySetXattrName(const char *name)
+{
+    if (!name)
+        name = SECURITY_SMACK_XATTR;
+
+    if (STREQ(name, SECURITY_SMACK_XATTR)) {
+        smackXattrName = SECURITY_SMACK_XATTR;
+    } else if (STREQ(name, SECURITY_SMACK_USER_XATTR)) {
+        smackXattrName = SECURITY_SMACK_USER_XATTR;
+    } else {
+        virReportError(VIR_ERR_INVALID_ARG,
+                       _("unsupported Smack label attribute '%s'"), name);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Declare that smackfs on this host takes several rules per write
+ * (Linux 3.12 or a kernel with that change backported), so that the
+ * rules of a domain are loaded in as few writes as possible. Disabled
+ * by default, which works on any kernel. It applies process wide and
+ * is meant to be set before the first domain is started.
+ */
+int
+virSmackSecuritySetRulesMulti(bool enable)
+{
+    smackRulesMulti = enable;
+    VIR_DEBUG("smackfs %s several rules per write",
+              enable ? "takes" : "does not take");
+    return 0;
+}
+
+
+/*
+ * Choose where labels are stored from the next driver open on: the
+ * kernel, or an in-memory table for running the driver without Smack.
+ * If @getFault or @setFault is given, the label reads or writes of
+ * that backend are additionally delayed and failed as described.
+ */
+int
+virSmackSecuritySetLabelBackend(int backend,
+                                const virSmackLabelFault *getFault,
+                                const virSmackLabelFault *setFault)
+{
+    if (backend < 0 || backend >= VIR_SMACK_LABEL_BACKEND_LAST) {
+        virReportError(VIR_ERR_INVALID_ARG,
+                       _("unknown Smack label backend %d"), backend);
+        return -1;
     }
-	
-    VIR_DEBUG("SmackSetSecurityDaemonSocketLabel is in %d",getpid());
-    VIR_DEBUG("label from self %s",label);
 
-    
-    VIR_DEBUG("Setting VM %s socket label %s", vm->name, seclabel->label);
-    if (setsockcreate(seclabel->label,"sockincreate") == -1) {
-	virReportSystemError(errno,
-			     _("unable to set socket smack label '%s'"), seclabel->label);
-	 goto done; 
+    if ((getFault && getFault->error < 0) ||
+        (setFault && setFault->error < 0)) {
+        virReportError(VIR_ERR_INVALID_ARG, "%s",
+                       _("injected error must be a positive errno"));
+        return -1;
     }
 
-    ret = 0;
-done:
+    smackBackendType = backend;
+    memset(smackFaultsWant, 0, sizeof(smackFaultsWant));
+    if (getFault)
+        smackFaultsWant[SMACK_FAULT_GET] = *getFault;
+    if (setFault)
+        smackFaultsWant[SMACK_FAULT_SET] = *setFault;
+    smackFaultsWanted = getFault || setFault;
 
-    free(label);
-    return ret;
-    
+    return 0;
 }
 
 
+/*
+ * Turn the instrumentation of the label primitives on or off; it is
+ * off until first turned on, as timing every call isn't free. The
+ * counters are kept until virSmackSecurityResetPrimitiveStats().
+ */
+int
+virSmackSecuritySetPrimitiveStats(bool enable)
+{
+    /* The probe key must exist before any primitive looks at it */
+    if (enable && SmackStatsInitialize() < 0)
+        return -1;
+
+    __atomic_store_n(&smackStatsEnabled, enable, __ATOMIC_RELEASE);
+    return 0;
+}
 
-static int
-SmackSetSecuritySocketLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-		            virDomainDefPtr vm)
+
+int
+virSmackSecurityGetPrimitiveStats(int prim,
+                                  virSmackPrimitiveStatsPtr stats)
 {
+    virSmackPrimitiveStatsPtr cur;
+    size_t i;
 
-    virSecurityLabelDefPtr seclabel;
+    if (prim < 0 || prim >= VIR_SMACK_PRIMITIVE_LAST) {
+        virReportError(VIR_ERR_INVALID_ARG,
+                       _("unknown Smack primitive %d"), prim);
+        return -1;
+    }
 
-    seclabel = virDomainDefGetSecurityLabelDef(vm, SECURITY_SMACK_NAME);
-    if (seclabel == NULL)
-	return -1;
+    cur = &smackPrimitiveStats[prim];
+    stats->calls = __sync_fetch_and_add(&cur->calls, 0);
+    stats->ns = __sync_fetch_and_add(&cur->ns, 0);
+    stats->syscalls = __sync_fetch_and_add(&cur->syscalls, 0);
+    stats->allocs = __sync_fetch_and_add(&cur->allocs, 0);
+    for (i = 0; i < VIR_SMACK_STATS_HIST_BUCKETS; i++)
+        stats->hist[i] = __sync_fetch_and_add(&cur->hist[i], 0);
 
-    if (seclabel->label == NULL)
-	return 0;
+    return 0;
+}
 
-    if (!STREQ(SECURITY_SMACK_NAME, seclabel->model)) {
-        virReportError(VIR_ERR_INTERNAL_ERROR,
-                       _("security label driver mismatch: "
-                         "'%s' model configured for domain, but "
-                         "hypervisor driver is '%s'."),
-                       seclabel->model, SECURITY_SMACK_NAME);
-            return -1;
+
+void
+virSmackSecurityResetPrimitiveStats(void)
+{
+    size_t i, j;
+
+    for (i = 0; i < VIR_SMACK_PRIMITIVE_LAST; i++) {
+        virSmackPrimitiveStatsPtr cur = &smackPrimitiveStats[i];
+
+        __sync_and_and_fetch(&cur->calls, 0);
+        __sync_and_and_fetch(&cur->ns, 0);
+        __sync_and_and_fetch(&cur->syscalls, 0);
+        __sync_and_and_fetch(&cur->allocs, 0);
+        for (j = 0; j < VIR_SMACK_STATS_HIST_BUCKETS; j++)
+            __sync_and_and_fetch(&cur->hist[j], 0);
     }
 
-    VIR_DEBUG("Setting VM %s socket label %s", vm->name, seclabel->label);
+    for (i = 0; i < VIR_SMACK_COUNTER_LAST; i++)
+        __sync_and_and_fetch(&smackCounters[i], 0);
+}
 
-    if (setsockcreate(seclabel->label,"sockoutcreate") == -1) {
-        virReportSystemError(errno,
-                             _("unable to set socket smack label '%s'"),
-                             seclabel->label);
-            return -1; 
+
+/*
+ * Return every statistic gathered so far as typed parameters:
+ * "<call>.calls", "<call>.ns", "<call>.syscalls", "<call>.allocs" and
+ * "<call>.hist.<bucket>" for each non empty histogram bucket of each
+ * instrumented call, and "counter.<event>" for each counted event.
+ * Nothing is gathered unless virSmackSecuritySetPrimitiveStats()
+ * turned it on, everything reads as zero until then.
+ */
+int
+virSmackSecurityGetStats(virTypedParameterPtr *params,
+                         int *nparams)
+{
+    virSmackPrimitiveStats stats;
+    char field[VIR_TYPED_PARAM_FIELD_LENGTH];
+    int maxparams = 0;
+    size_t i, j;
+
+    *params = NULL;
+    *nparams = 0;
+
+#define SMACK_STATS_ADD(value, ...)                                     \
+    do {                                                                \
+        snprintf(field, sizeof(field), __VA_ARGS__);                    \
+        if (virTypedParamsAddULLong(params, nparams, &maxparams,        \
+                                    field, value) < 0)                  \
+            goto error;                                                 \
+    } while (0)
+
+    for (i = 0; i < VIR_SMACK_PRIMITIVE_LAST; i++) {
+        const char *name = virSmackPrimitiveTypeToString(i);
+
+        ignore_value(virSmackSecurityGetPrimitiveStats(i, &stats));
+        SMACK_STATS_ADD(stats.calls, "%s.calls", name);
+        SMACK_STATS_ADD(stats.ns, "%s.ns", name);
+        SMACK_STATS_ADD(stats.syscalls, "%s.syscalls", name);
+        SMACK_STATS_ADD(stats.allocs, "%s.allocs", name);
+        for (j = 0; j < VIR_SMACK_STATS_HIST_BUCKETS; j++) {
+            if (stats.hist[j])
+                SMACK_STATS_ADD(stats.hist[j], "%s.hist.%zu", name, j);
+        }
     }
 
+    for (i = 0; i < VIR_SMACK_COUNTER_LAST; i++)
+        SMACK_STATS_ADD(__sync_fetch_and_add(&smackCounters[i], 0),
+                        "counter.%s", virSmackCounterTypeToString(i));
+
+#undef SMACK_STATS_ADD
 
     return 0;
-    
+
+error:
+    virTypedParamsFree(*params, *nparams);
+    *params = NULL;
+    *nparams = 0;
+    return -1;
 }
 
 
-static int
-SmackClearSecuritySocketLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-		              virDomainDefPtr def)
+/*
+ * Batched flavours of SmackSetSecurityHostdevLabel and
+ * SmackRestoreSecurityHostdevLabel for domains with many host devices,
+ * e.g. dozens of SR-IOV functions attached through VFIO. All @ndevs
+ * devices of @def go through a single relabel plan, and nodes shared
+ * between them, like the VFIO node of an IOMMU group, are labeled once
+ * and restored when their last device goes away. Setting stops at the
+ * first failure and restores the devices labeled before it; restoring
+ * tries every device and reports the first error.
+ */
+int
+virSmackSecuritySetHostdevLabels(virSecurityManagerPtr mgr,
+                                 virDomainDefPtr def,
+                                 virDomainHostdevDefPtr *devs,
+                                 size_t ndevs,
+                                 const char *vroot)
 {
-
+    SmackCallbackData data = { .manager = mgr, .def = def };
     virSecurityLabelDefPtr seclabel;
+    size_t i;
+    int ret = 0;
 
     seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
     if (seclabel == NULL)
         return -1;
 
-    if (seclabel->label == NULL)
+    if (seclabel->norelabel)
         return 0;
 
-    if (!STREQ(SECURITY_SMACK_NAME, seclabel->model)) {
-        virReportError(VIR_ERR_INTERNAL_ERROR,
-                       _("security label driver mismatch: "
-                         "'%s' model configured for domain, but "
-                         "hypervisor driver is '%s'."),
-                       seclabel->model, SECURITY_SMACK_NAME);
-            return -1;
-    }
+    if (SmackRelabelPlanWanted(mgr) && !(data.plan = SmackRelabelPlanNew()))
+        return -1;
 
-    VIR_DEBUG("clear sock label");
+    for (i = 0; i < ndevs && ret == 0; i++) {
+        switch (devs[i]->mode) {
+        case VIR_DOMAIN_HOSTDEV_MODE_SUBSYS:
+            ret = SmackSetSecurityHostdevSubsysLabelInt(&data, devs[i], vroot);
+            break;
 
-    if (setsockcreate(NULL,"sockincreate") == -1 || setsockcreate(NULL,"sockoutcreate") == -1) {
-        virReportSystemError(errno,
-                             _("unable to clear socket smack label '%s'"),
-                             seclabel->label);
+        case VIR_DOMAIN_HOSTDEV_MODE_CAPABILITIES:
+            ret = SmackSetSecurityHostdevCapsLabel(mgr, def, devs[i], vroot);
+            break;
 
-            return -1;
-    } 
+        default:
+            break;
+        }
+    }
 
-    return 0;
-}
+    if (ret == 0 && SmackRelabelPlanRun(mgr, data.plan) < 0) {
+        ret = -1;
+        i = ndevs;
+    } else if (ret < 0) {
+        /* The failed device cleaned up after itself */
+        i--;
+    }
+    SmackRelabelPlanFree(data.plan);
 
+    if (ret < 0 && i > 0) {
+        /* Drop the node references and stored files of the devices
+         * completed so far and put their labels back */
+        virErrorPtr err = virSaveLastError();
 
+        ignore_value(virSmackSecurityRestoreHostdevLabels(mgr, def, devs,
+                                                          i, vroot));
+        virSetError(err);
+        virFreeError(err);
+    }
+    return ret;
+}
 
-/*
- *Current called in qemuStartVMDaemon to setup a 'label'. We make the 
- *label based on UUID.
- *this is called on 'start'with RestoreSecurityLabel being called on 
- *shutdown
- */
 
-static int
-SmackGenSecurityLabel(virSecurityManagerPtr mgr,
-		      virDomainDefPtr def)
+int
+virSmackSecurityRestoreHostdevLabels(virSecurityManagerPtr mgr,
+                                     virDomainDefPtr def,
+                                     virDomainHostdevDefPtr *devs,
+                                     size_t ndevs,
+                                     const char *vroot)
 {
-    int ret = -1;
-    char *label_name = NULL;
-    virSecurityLabelDefPtr seclabel; 
-    
-    seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
-    if(seclabel == NULL)
-	    return ret;
-    
-    VIR_DEBUG("label=%s",virSecurityManagerGetDriver(mgr));
-    if (seclabel->type == VIR_DOMAIN_SECLABEL_DYNAMIC &&
-        seclabel->label) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("security label already defined for VM"));
-        return ret;
-    }    
-
-    if (seclabel->imagelabel) {
-        virReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                       _("security image label already defined for VM"));
-        return ret;
-    } 
+    SmackCallbackData data = { .manager = mgr, .def = def };
+    virSecurityLabelDefPtr seclabel;
+    virErrorPtr err = NULL;
+    size_t i;
+    int ret = 0;
 
-    if (seclabel->model &&
-        STRNEQ(seclabel->model, SECURITY_SMACK_NAME)) {
-        virReportError(VIR_ERR_INTERNAL_ERROR,
-                       _("security label model %s is not supported with smack"),
-                       seclabel->model);
-         return ret;
-    }
+    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+    if (seclabel == NULL)
+        return -1;
 
-    VIR_DEBUG("type=%d", seclabel->type);
+    if (seclabel->norelabel)
+        return 0;
 
-    if ((label_name = get_label_name(def)) == NULL)
-	 return ret;
-   
-    if (seclabel->type == VIR_DOMAIN_SECLABEL_DYNAMIC){
+    if (SmackRelabelPlanWanted(mgr) && !(data.plan = SmackRelabelPlanNew()))
+        return -1;
 
-        /*set process label*/
-       if (VIR_STRDUP(seclabel->label,label_name) < 0)
-	 goto cleanup;
-    }
+    for (i = 0; i < ndevs; i++) {
+        int rc = 0;
 
-    /*set imagelabel the same as label*/
-    if (VIR_STRDUP(seclabel->imagelabel,label_name) < 0)
-	 goto cleanup;
-    
-    if (!seclabel->model &&
-        VIR_STRDUP(seclabel->model, SECURITY_SMACK_NAME) < 0)
-         goto cleanup;
+        switch (devs[i]->mode) {
+        case VIR_DOMAIN_HOSTDEV_MODE_SUBSYS:
+            rc = SmackRestoreSecurityHostdevSubsysLabelInt(&data, devs[i],
+                                                           vroot);
+            break;
 
-    ret = 0;
+        case VIR_DOMAIN_HOSTDEV_MODE_CAPABILITIES:
+            rc = SmackRestoreSecurityHostdevCapsLabel(mgr, devs[i], vroot);
+            break;
 
-cleanup:
+        default:
+            break;
+        }
 
-    if(ret != 0){
-       if (seclabel->type == VIR_DOMAIN_SECLABEL_DYNAMIC)
-           VIR_FREE(seclabel->label);
-	   VIR_FREE(seclabel->imagelabel);
-       if (seclabel->type == VIR_DOMAIN_SECLABEL_DYNAMIC &&
-           !seclabel->baselabel)
-	   VIR_FREE(seclabel->model);
+        if (rc < 0 && ret == 0) {
+            err = virSaveLastError();
+            ret = -1;
+        }
     }
 
-    VIR_FREE(label_name);
+    if (SmackRelabelPlanRun(mgr, data.plan) < 0 && ret == 0) {
+        err = virSaveLastError();
+        ret = -1;
+    }
+    SmackRelabelPlanFree(data.plan);
 
-    VIR_DEBUG("model=%s label=%s imagelabel=%s",
-              NULLSTR(seclabel->model),
-              NULLSTR(seclabel->label),
-              NULLSTR(seclabel->imagelabel));
-    
+    if (err) {
+        virSetError(err);
+        virFreeError(err);
+    }
     return ret;
-
 }
 
 
+typedef struct _SmackAppliedCopyData SmackAppliedCopyData;
+typedef SmackAppliedCopyData *SmackAppliedCopyDataPtr;
 
-static int
-SmackReserveSecurityLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-	                  virDomainDefPtr def ATTRIBUTE_UNUSED,
-	                  pid_t pid ATTRIBUTE_UNUSED)
+struct _SmackAppliedCopyData {
+    virHashTablePtr table;
+    bool error;
+};
+
+
+static void
+SmackAppliedCopy(void *payload,
+                 const void *name,
+                 void *opaque)
 {
-       /*Security label is based UUID,*/
-	return 0;
+    SmackAppliedCopyDataPtr data = opaque;
+
+    if (!data->error && virHashAddEntry(data->table, name, payload) < 0)
+        data->error = true;
 }
 
+
 /*
- *Called on VM shutdown and destroy.
+ * Drop @key from @old if the resource it names already carries
+ * @label. A resource carrying another label is dropped as well, it
+ * is going to be relabeled rather than restored.
  */
-
-static int
-SmackReleaseSecurityLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-		          virDomainDefPtr def)
+static bool
+SmackAppliedKeep(virHashTablePtr old,
+                 const char *key,
+                 int label)
 {
-    virSecurityLabelDefPtr seclabel;
-
-    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
-    if (seclabel == NULL)
-	    return -1;
-
-    if (seclabel->type == VIR_DOMAIN_SECLABEL_DYNAMIC) {
-        VIR_FREE(seclabel->label);
-        VIR_FREE(seclabel->model);
-    }
-    VIR_FREE(seclabel->imagelabel);
+    void *applied;
 
-    return 0;
+    if (!(applied = virHashLookup(old, key)))
+        return false;
 
+    ignore_value(virHashRemoveEntry(old, key));
+    return (intptr_t) applied - 1 == label;
 }
 
 
+typedef struct _SmackAppliedForgetData SmackAppliedForgetData;
+typedef SmackAppliedForgetData *SmackAppliedForgetDataPtr;
 
-/* Seen with 'virsh dominfo <vm>'. This function only called if the VM is
- * running.
- */
-static int
-SmackGetSecurityProcessLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-	                     virDomainDefPtr def ATTRIBUTE_UNUSED,
-	                     pid_t pid,
-			     virSecurityLabelPtr sec)
-{
-
-	 char *label_name = NULL;
-
-	 if (getpidlabel(pid,&label_name) == -1){
-             virReportSystemError(errno,
-	                        _("unable to get PID %d security label"),
-	                        pid);
-             return -1;
-	 }
+struct _SmackAppliedForgetData {
+    virSecurityManagerPtr mgr;
+    virDomainDefPtr def;
+};
 
-	 if (strlen(label_name) >= VIR_SECURITY_LABEL_BUFLEN ){
-    	     virReportError(VIR_ERR_INTERNAL_ERROR,
-	                    _("security label exceeds "
-	                      "maximum length: %d"),
-	                    VIR_SECURITY_LABEL_BUFLEN - 1);
-	     free(label_name);
-	     return -1; 
-	 }
 
-         strcpy(sec->label,label_name);
-	 free(label_name);
-	 /*Smack default enforced*/
-	 sec->enforcing = 1;
+static void
+SmackAppliedForgetIterator(void *payload ATTRIBUTE_UNUSED,
+                           const void *name,
+                           void *opaque)
+{
+    SmackAppliedForgetDataPtr data = opaque;
 
-	 return 0;
+    VIR_DEBUG("Forgetting label of unknown resource %s",
+              (const char *) name);
+    SmackAppliedForget(data->mgr, data->def, name);
 }
 
 
-static int
-SmackSetSecurityProcessLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-	                     virDomainDefPtr def)
+/*
+ * Bring the labels of the domain from @oldDef to @newDef, e.g. after a
+ * device was hot plugged, unplugged or updated: resources of @newDef
+ * not labeled yet are labeled, resources no longer in @newDef are
+ * restored using their definition in @oldDef, and everything else is
+ * left alone. What is labeled is tracked by the driver; for a domain
+ * it knows nothing about, all of @oldDef is taken to be labeled.
+ * Every restore is tried, labeling stops at the first failure, and
+ * the first error is reported.
+ */
+int
+virSmackSecurityUpdateLabels(virSecurityManagerPtr mgr,
+                             virDomainDefPtr oldDef,
+                             virDomainDefPtr newDef,
+                             const char *vroot)
 {
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    char uuidstr[VIR_UUID_STRING_BUFLEN];
     virSecurityLabelDefPtr seclabel;
+    SmackAppliedCopyData copy = { .error = false };
+    SmackAppliedForgetData forget = { .mgr = mgr, .def = newDef };
+    virHashTablePtr table;
+    bool *diskNew = NULL;
+    bool *hostdevNew = NULL;
+    bool known;
+    char *key = NULL;
+    void *applied;
+    virErrorPtr err = NULL;
+    size_t nset = 0, nrestored = 0, nkept = 0;
+    size_t i;
+    int label;
+    int ret = -1;
 
-    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
-
+    seclabel = virDomainDefGetSecurityLabelDef(newDef, SECURITY_SMACK_NAME);
     if (seclabel == NULL)
         return -1;
 
-    if (seclabel->label == NULL)
-        return 0;
+    if (seclabel->norelabel)
+        return 0;
+
+    if ((label = SmackLabelIntern(seclabel->imagelabel)) < 0) {
+        virReportSystemError(errno, _("unable to intern label '%s'"),
+                             seclabel->imagelabel);
+        return -1;
+    }
+    applied = (void *) (intptr_t) (label + 1);
+
+    /* What is currently labeled: key -> label id + 1 */
+    if (!(copy.table = virHashCreate(32, NULL)) ||
+        VIR_ALLOC_N(diskNew, newDef->ndisks) < 0 ||
+        VIR_ALLOC_N(hostdevNew, newDef->nhostdevs) < 0)
+        goto cleanup;
+
+    virUUIDFormat(newDef->uuid, uuidstr);
+    virMutexLock(&priv->lock);
+    if ((known = !!(table = virHashLookup(priv->applied, uuidstr))))
+        virHashForEach(table, SmackAppliedCopy, &copy);
+    virMutexUnlock(&priv->lock);
+
+    if (copy.error)
+        goto cleanup;
+
+    if (!known) {
+        for (i = 0; i < oldDef->ndisks; i++) {
+            if (SmackDiskResourceKey(oldDef->disks[i], &key) < 0 ||
+                (key && virHashUpdateEntry(copy.table, key, applied) < 0))
+                goto cleanup;
+            VIR_FREE(key);
+        }
+        for (i = 0; i < oldDef->nhostdevs; i++) {
+            if (SmackHostdevResourceKey(oldDef->hostdevs[i], vroot,
+                                        &key) < 0 ||
+                (key && virHashUpdateEntry(copy.table, key, applied) < 0))
+                goto cleanup;
+            VIR_FREE(key);
+        }
+    }
+
+    /* Sort out what @newDef keeps, leaving the removed resources */
+    for (i = 0; i < newDef->ndisks; i++) {
+        if (SmackDiskResourceKey(newDef->disks[i], &key) < 0)
+            goto cleanup;
+        if (key && SmackAppliedKeep(copy.table, key, label)) {
+            nkept++;
+            if (!known)
+                SmackAppliedRecord(mgr, newDef, key, seclabel->imagelabel);
+        } else {
+            diskNew[i] = !!key;
+        }
+        VIR_FREE(key);
+    }
+
+    for (i = 0; i < newDef->nhostdevs; i++) {
+        if (SmackHostdevResourceKey(newDef->hostdevs[i], vroot, &key) < 0)
+            goto cleanup;
+        if (key && SmackAppliedKeep(copy.table, key, label)) {
+            nkept++;
+            if (!known)
+                SmackAppliedRecord(mgr, newDef, key, seclabel->imagelabel);
+        } else {
+            hostdevNew[i] = !!key;
+        }
+        VIR_FREE(key);
+    }
+
+    /* Restore what went away, as described by @oldDef */
+    ret = 0;
+    for (i = 0; i < oldDef->ndisks; i++) {
+        if (SmackDiskResourceKey(oldDef->disks[i], &key) < 0) {
+            ret = -1;
+            goto cleanup;
+        }
+        if (key && virHashLookup(copy.table, key)) {
+            ignore_value(virHashRemoveEntry(copy.table, key));
+            nrestored++;
+            if (SmackRestoreSecurityImageLabel(mgr, oldDef,
+                                               oldDef->disks[i]) < 0 &&
+                !err)
+                err = virSaveLastError();
+        }
+        VIR_FREE(key);
+    }
+
+    for (i = 0; i < oldDef->nhostdevs; i++) {
+        if (SmackHostdevResourceKey(oldDef->hostdevs[i], vroot, &key) < 0) {
+            ret = -1;
+            goto cleanup;
+        }
+        if (key && virHashLookup(copy.table, key)) {
+            ignore_value(virHashRemoveEntry(copy.table, key));
+            nrestored++;
+            if (SmackRestoreSecurityHostdevLabel(mgr, oldDef,
+                                                 oldDef->hostdevs[i],
+                                                 vroot) < 0 &&
+                !err)
+                err = virSaveLastError();
+        }
+        VIR_FREE(key);
+    }
+
+    /* Labeled once but described by neither definition */
+    virHashForEach(copy.table, SmackAppliedForgetIterator, &forget);
 
-    if (STRNEQ(SECURITY_SMACK_NAME, seclabel->model)) {
-            virReportError(VIR_ERR_INTERNAL_ERROR,
-                      _("security label driver mismatch: "
-                        "\'%s\' model configured for domain, but "
-                        "hypervisor driver is \'%s\'."),
-                      seclabel->model, SECURITY_SMACK_NAME);
+    for (i = 0; i < newDef->ndisks && !err; i++) {
+        if (!diskNew[i])
+            continue;
+        nset++;
+        if (SmackSetSecurityImageLabel(mgr, newDef, newDef->disks[i]) < 0)
+            err = virSaveLastError();
+    }
 
-               return -1;
-	}
+    for (i = 0; i < newDef->nhostdevs && !err; i++) {
+        if (!hostdevNew[i])
+            continue;
+        nset++;
+        if (SmackSetSecurityHostdevLabel(mgr, newDef, newDef->hostdevs[i],
+                                         vroot) < 0)
+            err = virSaveLastError();
+    }
 
-    if (smack_set_label_for_self(seclabel->label) < 0) {
-	 virReportError(errno,
-		        _("unable to set security label '%s'"),
-		        seclabel->label);
-	    
-	    return -1;
-        }
+    VIR_DEBUG("Updated labels of %s: %zu set, %zu restored, %zu unchanged",
+              newDef->name, nset, nrestored, nkept);
 
-    return 0;
+    if (err) {
+        virSetError(err);
+        virFreeError(err);
+        ret = -1;
+    }
 
+cleanup:
+    VIR_FREE(key);
+    VIR_FREE(diskNew);
+    VIR_FREE(hostdevNew);
+    virHashFree(copy.table);
+    SmackLabelRelease(label);
+    return ret;
 }
 
 
-
-static int
-SmackSetSecurityChildProcessLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED, 
-	                   	  virDomainDefPtr def,
-				  virCommandPtr cmd)
+/*
+ * Have SmackRestoreSecurityAllLabel queue the restores of the image
+ * labels of a domain and return rather than wait for them.
+ */
+int
+virSmackSecuritySetDeferredRestore(virSecurityManagerPtr mgr,
+                                   bool enable)
 {
-       virSecurityLabelDefPtr seclabel;
-
-       seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
 
-       if (seclabel == NULL)
-	   return -1;
+    if (enable && !priv->restoreQueue) {
+        virReportError(VIR_ERR_OPERATION_UNSUPPORTED, "%s",
+                       _("deferred label restores are not available"));
+        return -1;
+    }
 
-       if (seclabel->label == NULL)
-	   return 0;
+    virMutexLock(&priv->lock);
+    priv->deferRestore = enable;
+    virMutexUnlock(&priv->lock);
 
-       if (STRNEQ(SECURITY_SMACK_NAME, seclabel->model)) {
-           virReportError(VIR_ERR_INTERNAL_ERROR,
-                          _("security label driver mismatch: "
-                            "\'%s\' model configured for domain, but "
-                            "hypervisor driver is \'%s\'."),
-                          seclabel->model, SECURITY_SMACK_NAME);
+    return 0;
+}
 
-	   return -1;
-       }
 
-       /*
-        *if ((label_name = get_label_name(def)) == NULL)
-	*    goto cleanup;
-	*/
+int
+virSmackSecurityGetRestoreStats(virSecurityManagerPtr mgr,
+                                virSmackDeferredRestoreStatsPtr stats)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    SmackRestoreQueuePtr queue = priv->restoreQueue;
 
-    /* save in cmd to be set after fork/before child process is exec'ed */
-       virCommandSetSmackLabel(cmd,seclabel->label);
-       VIR_DEBUG("save smack label in cmd %s",seclabel->label);
+    memset(stats, 0, sizeof(*stats));
+    if (!queue)
+        return 0;
 
-       return 0;
+    virMutexLock(&queue->lock);
+    *stats = queue->stats;
+    stats->pending = queue->npending;
+    virMutexUnlock(&queue->lock);
 
+    return 0;
 }
 
 
+typedef struct _SmackDeferredRestoreList SmackDeferredRestoreList;
+typedef SmackDeferredRestoreList *SmackDeferredRestoreListPtr;
 
-static int
-SmackSetSecurityAllLabel(virSecurityManagerPtr mgr,
-		         virDomainDefPtr def,
-			 const char *stdin_path)
-{
+struct _SmackDeferredRestoreList {
+    virSmackDeferredRestorePtr entries;
+    size_t n;
+    unsigned long long now;
+    bool error;
+};
 
-   size_t i;
-   virSecurityLabelDefPtr seclabel;
 
-   seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+static void
+SmackDeferredRestoreListAdd(void *payload,
+                            const void *name,
+                            void *opaque)
+{
+    SmackRestoreEntryPtr entry = payload;
+    SmackDeferredRestoreListPtr list = opaque;
+    virSmackDeferredRestorePtr out = &list->entries[list->n];
 
-   if (seclabel == NULL)
-	   return -1;
+    if (list->error)
+        return;
 
-   if (seclabel->norelabel)
-	   return 0;
-    
-   VIR_DEBUG("set image security label before");
+    if (VIR_STRDUP(out->path, name) < 0) {
+        list->error = true;
+        return;
+    }
+    out->ageMs = list->now - entry->queued;
+    out->busy = entry->busy;
+    list->n++;
+}
 
-   /*
-    *for (i = 0; i < def->ndisks; i++) {
-    *    if (def->disks[i]->type == VIR_DOMAIN_DISK_TYPE_DIR) {
-    *        VIR_WARN("Unable to relabel directory tree %s for disk %s",
-    *                 def->disks[i]->src, def->disks[i]->dst);
-    *        continue;
-    *    }
-    */
 
-   VIR_DEBUG("set image security label");
+/*
+ * Return the restores still queued in @entries, along with how long
+ * each has been waiting. The caller frees them with
+ * virSmackDeferredRestoreFree().
+ */
+int
+virSmackSecurityGetDeferredRestores(virSecurityManagerPtr mgr,
+                                    virSmackDeferredRestorePtr *entries,
+                                    size_t *nentries)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    SmackRestoreQueuePtr queue = priv->restoreQueue;
+    SmackDeferredRestoreList list = { .now = SmackNowMs() };
 
-       if (SmackSetSecurityImageLabel(mgr,
-			       def,def->disks[0]) < 0)
-	   return -1;
-    /*
-     *}
-     */
+    *entries = NULL;
+    *nentries = 0;
+    if (!queue)
+        return 0;
 
-   VIR_DEBUG("set image security label after");
+    virMutexLock(&queue->lock);
+    if (queue->npending &&
+        VIR_ALLOC_N(list.entries, queue->npending) < 0)
+        list.error = true;
+    else
+        virHashForEach(queue->entries, SmackDeferredRestoreListAdd, &list);
+    virMutexUnlock(&queue->lock);
 
-   if (stdin_path) {
-       if (setxattr(def->disks[i]->src,"security.SMACK64",seclabel->imagelabel,strlen(seclabel->imagelabel) + 1,0)< 0 &&
-           virStorageFileIsSharedFSType(stdin_path,
-                                        VIR_STORAGE_FILE_SHFS_NFS) != 1)
-           return -1;
+    if (list.error) {
+        virSmackDeferredRestoreFree(list.entries, list.n);
+        return -1;
     }
 
+    *entries = list.entries;
+    *nentries = list.n;
     return 0;
-
 }
 
-static int
-SmackRestoreSecurityAllLabel(virSecurityManagerPtr mgr,
-                             virDomainDefPtr def,
-                             int migrated ATTRIBUTE_UNUSED)
-{
-   size_t i;
-   virSecurityLabelDefPtr seclabel;
 
-   VIR_DEBUG("Restoring security label on %s", def->name);
+void
+virSmackDeferredRestoreFree(virSmackDeferredRestorePtr entries,
+                            size_t nentries)
+{
+    size_t i;
 
-   seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
+    for (i = 0; i < nentries; i++)
+        VIR_FREE(entries[i].path);
+    VIR_FREE(entries);
+}
 
-   if (seclabel == NULL)
-	   return -1;
 
-   if (seclabel->norelabel)
-	   return 0;
+/*
+ * Give reconciliation of running domains @budget ms from now, 0
+ * stopping it altogether. The budget is best effort: it is checked
+ * between disks, and a disk on a hung filesystem keeps its domain
+ * reconciling past it.
+ */
+int
+virSmackSecuritySetReconcileBudget(virSecurityManagerPtr mgr,
+                                   unsigned int budget)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
 
-   for (i = 0; i < def->ndisks; i++) {
+    virMutexLock(&priv->lock);
+    priv->reconcileDeadline = SmackNowMs() + budget;
+    virMutexUnlock(&priv->lock);
 
-      if (SmackRestoreSecurityImageLabelInt(mgr,
-			                    def,
-					    def->disks[i],
-					    migrated) < 0)
-      /*if (setxattr(def->disks[i]->src,"security.SMACK64","smack-unused",strlen("smack-unused"),0)< 0)*/
+    return 0;
+}
 
-        return -1;
 
-   }
+int
+virSmackSecurityGetReconcileProgress(virSecurityManagerPtr mgr,
+                                     virSmackReconcileProgressPtr progress)
+{
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
 
-   return 0;   
+    virMutexLock(&priv->lock);
+    *progress = priv->reconcile;
+    virMutexUnlock(&priv->lock);
 
+    return 0;
 }
 
 
-
-static int
-SmackSetSecurityHostdevLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-		             virDomainDefPtr def,
-			     virDomainHostdevDefPtr dev,
-			     const char *vroot)
+/*
+ * Replace the access rules installed for every dynamically labeled
+ * domain started from now on by the @nrules @rules, which come after
+ * the built-in ones letting it read shared images. A NULL subject or
+ * object stands for the domain's label and at least one of them must
+ * be NULL; access is the usual Smack access string, e.g. "rwx".
+ */
+int
+virSmackSecuritySetRuleTemplates(virSecurityManagerPtr mgr,
+                                 const virSmackRuleTemplate *rules,
+                                 size_t nrules)
 {
-	virSecurityLabelDefPtr seclabel;
-	seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
-	if (seclabel == NULL)
+    virSmackSecurityDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+    size_t ndefaults = ARRAY_CARDINALITY(smackDefaultRules);
+    virSmackRuleTemplatePtr copy = NULL;
+    size_t i;
+
+    for (i = 0; i < nrules; i++) {
+        if ((rules[i].subject && rules[i].object) ||
+            (rules[i].subject && strlen(rules[i].subject) > SMACK_LABEL_LEN) ||
+            (rules[i].object && strlen(rules[i].object) > SMACK_LABEL_LEN) ||
+            !rules[i].access || !*rules[i].access ||
+            strspn(rules[i].access, "rwxatlbRWXATLB-") !=
+            strlen(rules[i].access)) {
+            virReportError(VIR_ERR_INVALID_ARG,
+                           _("invalid smack rule template %zu"), i);
             return -1;
+        }
+    }
 
-	if (seclabel->norelabel)
-            return 0;
+    if (VIR_ALLOC_N(copy, ndefaults + nrules) < 0)
+        return -1;
 
-	switch (dev->mode) {
-        case VIR_DOMAIN_HOSTDEV_MODE_SUBSYS:
-	    return SmackSetSecurityHostdevSubsysLabel(def,dev,vroot);
+    for (i = 0; i < ndefaults + nrules; i++) {
+        const virSmackRuleTemplate *rule =
+            i < ndefaults ? &smackDefaultRules[i] : &rules[i - ndefaults];
 
-        case VIR_DOMAIN_HOSTDEV_MODE_CAPABILITIES:
-	    return SmackSetSecurityHostdevCapsLabel(def,dev,vroot);
+        if (VIR_STRDUP(copy[i].subject, rule->subject) < 0 ||
+            VIR_STRDUP(copy[i].object, rule->object) < 0 ||
+            VIR_STRDUP(copy[i].access, rule->access) < 0) {
+            SmackRuleTemplatesFree(copy, ndefaults + nrules);
+            return -1;
+        }
+    }
 
-        default:
-	    return 0;
+    virMutexLock(&priv->lock);
+    SmackRuleTemplatesFree(priv->rules, priv->nrules);
+    priv->rules = copy;
+    priv->nrules = ndefaults + nrules;
+    virMutexUnlock(&priv->lock);
 
-	}
+    return 0;
 }
 
 
-static int
-SmackRestoreSecurityHostdevLabel(virSecurityManagerPtr mgr,
-		                 virDomainDefPtr def,
-				 virDomainHostdevDefPtr dev,
-				 const char *vroot)
+/*
+ * Create the save file @path of @def with @mode and return a writable
+ * descriptor on it, or -1. The file is created unnamed in its
+ * directory with O_TMPFILE, labeled through the descriptor and only
+ * then linked in and renamed over @path, atomically replacing any file
+ * already there: it never exists unlabeled. Where O_TMPFILE is
+ * not available, the file is created by name and labeled through the
+ * descriptor.
+ */
+int
+virSmackSecurityCreateSavedState(virSecurityManagerPtr mgr,
+                                 virDomainDefPtr def,
+                                 const char *path,
+                                 mode_t mode)
 {
-    virSecurityLabelDefPtr seclabel;	
+    virSecurityLabelDefPtr seclabel;
+    char *dir = NULL;
+    char *tmp = NULL;
+    bool unnamed = false;
+    int fd = -1;
 
-    seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
+    seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
     if (seclabel == NULL)
-	return -1;
-
-    if (seclabel->norelabel)
-	return 0;
+        return -1;
 
-    switch (dev->mode) {
-    case VIR_DOMAIN_HOSTDEV_MODE_SUBSYS:
-        return SmackRestoreSecurityHostdevSubsysLabel(mgr, dev, vroot);
+#ifdef O_TMPFILE
+    if (!(dir = mdir_name(path))) {
+        virReportOOMError();
+        return -1;
+    }
 
-    case VIR_DOMAIN_HOSTDEV_MODE_CAPABILITIES:
-        return SmackRestoreSecurityHostdevCapsLabel(mgr, dev, vroot);
+    /* Kernels predating O_TMPFILE see a directory opened for writing */
+    if ((fd = SMACK_SYSCALL(open(dir, O_TMPFILE | O_WRONLY | O_CLOEXEC,
+                                 mode))) >= 0) {
+        unnamed = true;
+    } else if (errno != EISDIR && errno != EOPNOTSUPP && errno != EINVAL) {
+        virReportSystemError(errno,
+                             _("unable to create save file in '%s'"), dir);
+        goto error;
+    }
+#endif
 
-    default:
-        return 0;
+    if (fd < 0 &&
+        (fd = SMACK_SYSCALL(open(path, O_CREAT | O_TRUNC | O_WRONLY |
+                                 O_CLOEXEC, mode))) < 0) {
+        virReportSystemError(errno,
+                             _("unable to create save file '%s'"), path);
+        goto error;
     }
-}
-	
 
-static int
-SmackSetSavedStateLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-	                virDomainDefPtr def,
-                        const char *savefile) 
-{
-	 virSecurityLabelDefPtr seclabel;
+    if (!seclabel->norelabel && seclabel->imagelabel &&
+        SmackFSetFileLabel(mgr, fd, seclabel->imagelabel) < 0)
+        goto error;
+
+    /* linkat() can't replace an existing file, so link the labeled
+     * file under a temporary name next to @path and rename it over
+     * @path, which never leaves @path missing or half written */
+    if (unnamed) {
+        static unsigned int counter;
+        char procpath[64];
+
+        snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
+        if (virAsprintf(&tmp, "%s.%lld.%u.tmp", path, (long long) getpid(),
+                        __sync_fetch_and_add(&counter, 1)) < 0)
+            goto error;
+
+        /* Left behind by a crashed daemon that had our pid */
+        if (SMACK_SYSCALL(linkat(AT_FDCWD, procpath, AT_FDCWD, tmp,
+                                 AT_SYMLINK_FOLLOW)) < 0 &&
+            (errno != EEXIST ||
+             SMACK_SYSCALL(unlink(tmp)) < 0 ||
+             SMACK_SYSCALL(linkat(AT_FDCWD, procpath, AT_FDCWD, tmp,
+                                  AT_SYMLINK_FOLLOW)) < 0)) {
+            virReportSystemError(errno,
+                                 _("unable to link save file '%s'"), tmp);
+            goto error;
+        }
 
-         seclabel = virDomainDefGetSecurityLabelDef(def, SECURITY_SMACK_NAME);
-         if (seclabel == NULL)
-             return -1;
+        if (SMACK_SYSCALL(rename(tmp, path)) < 0) {
+            virReportSystemError(errno,
+                                 _("unable to rename '%s' to '%s'"),
+                                 tmp, path);
+            ignore_value(unlink(tmp));
+            goto error;
+        }
+    }
 
-         if (seclabel->norelabel)
-             return 0;
+    VIR_DEBUG("Created save file %s of %s on fd %d%s", path, def->name, fd,
+              unnamed ? " through O_TMPFILE" : "");
 
-         return SmackSetFileLabel(savefile, seclabel->imagelabel);
+    VIR_FREE(tmp);
+    VIR_FREE(dir);
+    return fd;
+
+error:
+    VIR_FORCE_CLOSE(fd);
+    VIR_FREE(tmp);
+    VIR_FREE(dir);
+    return -1;
 }
 
 
-static int
-SmackRestoreSavedStateLabel(virSecurityManagerPtr mgr,
-		            virDomainDefPtr def,
-			    const char *savefile)
+/*
+ * Counterpart of SmackRestoreSavedStateLabel for a save file the
+ * caller still has open as @fd, sparing the path lookup.
+ */
+int
+virSmackSecurityRestoreSavedStateFD(virSecurityManagerPtr mgr,
+                                    virDomainDefPtr def,
+                                    int fd)
 {
     virSecurityLabelDefPtr seclabel;
 
@@ -1517,96 +8664,142 @@ SmackRestoreSavedStateLabel(virSecurityManagerPtr mgr,
     if (seclabel->norelabel)
         return 0;
 
-    return SmackRestoreSecurityFileLabel(mgr, savefile);
+    VIR_INFO("Restoring Smack label on fd %d", fd);
+
+    return SmackFSetFileLabel(mgr, fd, (char *) SECURITY_SMACK_UNUSED_LABEL);
 }
 
-static int
-SmackSetImageFDLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-	             virDomainDefPtr def,
-                     int fd) 
+
+/*
+ * Generate the labels of @ndefs domains in one go, e.g. when they are
+ * all started after boot. Labels are validated as by
+ * SmackGenSecurityLabel and must be distinct, and the access rules of
+ * all domains are installed with a single write. Either every domain
+ * gets its labels or, on error, none does.
+ */
+int
+virSmackSecurityGenLabels(virSecurityManagerPtr mgr,
+                          virDomainDefPtr *defs,
+                          size_t ndefs)
 {
-    virSecurityLabelDefPtr seclabel;
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    virHashTablePtr seen = NULL;
+    size_t nrules = 0;
+    size_t i = 0;
+    int ret = -1;
 
-    seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
+    if (!(seen = virHashCreate(MAX(ndefs, 1), NULL)))
+        goto cleanup;
 
-    if (seclabel == NULL)
-	return -1;
+    for (i = 0; i < ndefs; i++) {
+        virSecurityLabelDefPtr seclabel;
+        virDomainDefPtr other;
 
-    if (seclabel->imagelabel == NULL)
-	return 0;
+        if (SmackGenSecurityLabelInt(mgr, defs[i], &buf, &nrules) < 0)
+            goto cleanup;
 
-    return SmackFSetFileLabel(fd,seclabel->imagelabel);
-      
-}
+        seclabel = virDomainDefGetSecurityLabelDef(defs[i],
+                                                   SECURITY_SMACK_NAME);
+        if ((other = virHashLookup(seen, seclabel->imagelabel))) {
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("domains %s and %s share label '%s'"),
+                           other->name, defs[i]->name, seclabel->imagelabel);
+            i++;
+            goto cleanup;
+        }
 
+        if (virHashAddEntry(seen, seclabel->imagelabel, defs[i]) < 0) {
+            i++;
+            goto cleanup;
+        }
+    }
 
-static int
-SmackSetTapFDLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-	           virDomainDefPtr def,
-                   int fd) 
-{
-    struct stat buf;
-    virSecurityLabelDefPtr seclabel;
+    if (virBufferError(&buf)) {
+        virReportOOMError();
+        goto cleanup;
+    }
 
-    seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME);
-    if (seclabel == NULL)
-	    return -1;
+    if (nrules > 0 &&
+        SmackRulesWrite("load2", virBufferCurrentContent(&buf), nrules) < 0)
+        goto cleanup;
 
-    if (seclabel->label == NULL)
-	    return 0;
-    
+    VIR_DEBUG("Generated labels of %zu domains, %zu rules", ndefs, nrules);
+    ret = 0;
 
-    if (fstat(fd, &buf) < 0) {
-        virReportSystemError(errno, _("cannot stat tap fd %d"), fd);
-	    return -1;
-    }
-   
-    if ((buf.st_mode & S_IFMT) != S_IFCHR) {
-        virReportError(VIR_ERR_INTERNAL_ERROR,
-                      _("tap fd %d is not character device"), fd);
-	    return -1;
+cleanup:
+    virHashFree(seen);
+    if (ret < 0) {
+        while (i-- > 0)
+            SmackGenSecurityLabelUndo(mgr, defs[i]);
     }
-       
-    return SmackFSetFileLabel(fd,seclabel->label);
-      
+    virBufferFreeAndReset(&buf);
+    return ret;
 }
 
 
-static char *
-SmackGetMountOptions(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-		     virDomainDefPtr def)
+/*
+ * Batched flavour of SmackGetSecurityProcessLabel, meant for pollers
+ * querying many running domains at once: fills @secs[i] with the label
+ * of @pids[i] using a single /proc directory descriptor, reading each
+ * label straight into its virSecurityLabel. @starttimes[i] is the
+ * start time the caller recorded for @pids[i] when it started it, in
+ * clock ticks since boot as in /proc/<pid>/stat; a process started at
+ * another time is not the one asked for and fails with ESRCH. Every
+ * pid is tried even if some of them fail; failed entries get an empty
+ * label and the error of the first one is reported. Returns 0 if all
+ * labels were read, -1 otherwise.
+ */
+int
+virSmackSecurityGetProcessLabels(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
+                                 const pid_t *pids,
+                                 const unsigned long long *starttimes,
+                                 size_t npids,
+                                 virSecurityLabelPtr secs)
 {
-	char *opts = NULL;
-	virSecurityLabelDefPtr seclabel;
-	
-	if ((seclabel = virDomainDefGetSecurityLabelDef(def,SECURITY_SMACK_NAME))) {
-              if (!seclabel->imagelabel)
-		 seclabel->imagelabel = get_label_name(def); 
+    int procfd;
+    bool reported = false;
+    ssize_t len;
+    size_t i;
 
-	      if (seclabel->imagelabel &&
-                  virAsprintf(&opts,
-			      ",smack_label=\"%s\"",
-			      (const char*) seclabel->imagelabel) < 0) 
-		  return NULL;
-     }
+    if ((procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        virReportSystemError(errno, "%s", _("unable to open /proc"));
+        return -1;
+    }
 
-        if (!opts && VIR_STRDUP(opts,"") < 0)
-		return NULL;
+    for (i = 0; i < npids; i++) {
+        secs[i].enforcing = 0;
 
-	return opts;
+        len = getpidlabelat(procfd, pids[i], starttimes[i],
+                            secs[i].label, sizeof(secs[i].label));
+        if (len >= 0 && len <= SMACK_LABEL_LEN) {
+            /*Smack default enforced*/
+            secs[i].enforcing = 1;
+            continue;
+        }
 
-}
+        secs[i].label[0] = '\0';
+        if (reported)
+            continue;
+        reported = true;
 
-static const char *
-SmackGetBaseLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
-                  int virtType ATTRIBUTE_UNUSED)
-{
-   return NULL;
+        if (len < 0)
+            virReportSystemError(errno,
+                                 _("unable to get PID %d security label"),
+                                 pids[i]);
+        else
+            virReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("security label exceeds "
+                             "maximum length: %d"),
+                           SMACK_LABEL_LEN);
+    }
+
+    VIR_FORCE_CLOSE(procfd);
+    return reported ? -1 : 0;
 }
 
 
 virSecurityDriver virSmackSecurityDriver = {
-    .privateDataLen                   = 0,
+    .privateDataLen                   = sizeof(virSmackSecurityData),
     .name                             = SECURITY_SMACK_NAME,
     .probe                            = SmackSecurityDriverProbe,
     .open                             = SmackSecurityDriverOpen,
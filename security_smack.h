@@ -24,13 +24,195 @@
 # define __VIR_SECURITY_SMACK_H__
 
 # include "security_driver.h"
+# include "virutil.h"
 
+/* Label primitives and driver entry points instrumented */
+typedef enum {
+    VIR_SMACK_PRIMITIVE_GETFILELABEL,
+    VIR_SMACK_PRIMITIVE_SETFILELABEL,
+    VIR_SMACK_PRIMITIVE_FGETFILELABEL,
+    VIR_SMACK_PRIMITIVE_FSETFILELABEL,
+    VIR_SMACK_PRIMITIVE_SETSOCKCREATE,
+    VIR_SMACK_PRIMITIVE_SET_FILE_LABEL,
+    VIR_SMACK_PRIMITIVE_RESTORE_FILE_LABEL,
+    VIR_SMACK_PRIMITIVE_SET_ALL_LABEL,
+    VIR_SMACK_PRIMITIVE_RESTORE_ALL_LABEL,
+    VIR_SMACK_PRIMITIVE_SET_HOSTDEV_LABEL,
+    VIR_SMACK_PRIMITIVE_RESTORE_HOSTDEV_LABEL,
+    VIR_SMACK_PRIMITIVE_SET_SOCKET_LABEL,
+    VIR_SMACK_PRIMITIVE_CLEAR_SOCKET_LABEL,
+    VIR_SMACK_PRIMITIVE_GET_PROCESS_LABEL,
+
+    VIR_SMACK_PRIMITIVE_LAST
+} virSmackPrimitive;
+
+VIR_ENUM_DECL(virSmackPrimitive)
+
+typedef struct _virSmackPrimitiveStats virSmackPrimitiveStats;
+typedef virSmackPrimitiveStats *virSmackPrimitiveStatsPtr;
+
+/* Bucket 0 counts calls under 1us, bucket i calls of [2^(i-1), 2^i) us */
+# define VIR_SMACK_STATS_HIST_BUCKETS 24
+
+struct _virSmackPrimitiveStats {
+    unsigned long long calls;
+    unsigned long long ns;          /* total wall clock time */
+    unsigned long long syscalls;
+    unsigned long long allocs;
+    unsigned long long hist[VIR_SMACK_STATS_HIST_BUCKETS];
+};
+
+/* Events counted on their own */
+typedef enum {
+    VIR_SMACK_COUNTER_SETXATTR,
+    VIR_SMACK_COUNTER_GETXATTR,
+    VIR_SMACK_COUNTER_ENOTSUP_FALLBACK, /* labels rejected by the FS */
+    VIR_SMACK_COUNTER_SHARED_FS_PROBE,  /* filesystem type lookups */
+
+    VIR_SMACK_COUNTER_LAST
+} virSmackCounter;
+
+VIR_ENUM_DECL(virSmackCounter)
+
+ssize_t getfilelabel_r(const char *path, char *buf, size_t buflen);
+ssize_t fgetfilelabel_r(int fd, char *buf, size_t buflen);
 int getfilelabel(const char *path, char ** label);
 int setfilelabel(const char *path,const char * label);
 int fgetfilelabel(int fd,char ** label);
 int fsetfilelabel(int fd,const char * label);
 int setsockcreate(const char *label,const char *attr);
 
+/* Where labels are stored */
+typedef enum {
+    VIR_SMACK_LABEL_BACKEND_KERNEL,     /* security.SMACK64 xattrs */
+    VIR_SMACK_LABEL_BACKEND_MEMORY,     /* in-process table, for testing */
+
+    VIR_SMACK_LABEL_BACKEND_LAST
+} virSmackLabelBackendType;
+
+VIR_ENUM_DECL(virSmackLabelBackend)
+
+/* Faults injected into label reads or writes */
+typedef struct _virSmackLabelFault virSmackLabelFault;
+typedef virSmackLabelFault *virSmackLabelFaultPtr;
+
+struct _virSmackLabelFault {
+    unsigned int latencyUs;     /* delay added to every operation */
+    int error;                  /* errno to fail with, e.g. ESTALE */
+    unsigned int errorEvery;    /* fail every Nth operation, 0 never */
+};
+
+/* Access rule installed for each domain, NULL standing for its label */
+typedef struct _virSmackRuleTemplate virSmackRuleTemplate;
+typedef virSmackRuleTemplate *virSmackRuleTemplatePtr;
+
+struct _virSmackRuleTemplate {
+    char *subject;
+    char *object;
+    char *access;
+};
+
+/* Rebuilding of the driver state of running domains after a restart */
+typedef struct _virSmackReconcileProgress virSmackReconcileProgress;
+typedef virSmackReconcileProgress *virSmackReconcileProgressPtr;
+
+struct _virSmackReconcileProgress {
+    unsigned long long domains;     /* domains reconciled */
+    unsigned long long resources;   /* resources whose label was read */
+    unsigned long long stale;       /* ... not carrying the domain's label */
+    unsigned long long skipped;     /* domains cut short by the budget */
+};
+
+/* Restores queued by SmackRestoreSecurityAllLabel in deferred mode */
+typedef struct _virSmackDeferredRestoreStats virSmackDeferredRestoreStats;
+typedef virSmackDeferredRestoreStats *virSmackDeferredRestoreStatsPtr;
+
+struct _virSmackDeferredRestoreStats {
+    unsigned long long pending;       /* still queued */
+    unsigned long long queued;        /* ever queued */
+    unsigned long long completed;
+    unsigned long long failed;
+    unsigned long long cancelled;     /* dropped as the file was relabeled */
+    unsigned long long latencyMs;     /* total time spent queued */
+    unsigned long long maxLatencyMs;
+};
+
+typedef struct _virSmackDeferredRestore virSmackDeferredRestore;
+typedef virSmackDeferredRestore *virSmackDeferredRestorePtr;
+
+struct _virSmackDeferredRestore {
+    char *path;
+    unsigned long long ageMs;         /* time spent queued so far */
+    bool busy;                        /* being restored */
+};
+
+int virSmackSecurityGetLabelCacheStats(virSecurityManagerPtr mgr,
+                                       unsigned long long *hits,
+                                       unsigned long long *misses,
+                                       unsigned long long *invalidations);
+int virSmackSecuritySetRelabelWorkers(virSecurityManagerPtr mgr,
+                                      unsigned int workers);
+int virSmackSecuritySetTreeWorkers(virSecurityManagerPtr mgr,
+                                   unsigned int workers);
+int virSmackSecuritySetUseIOUring(virSecurityManagerPtr mgr,
+                                  bool enable);
+int virSmackSecuritySetXattrName(const char *name);
+int virSmackSecuritySetRulesMulti(bool enable);
+int virSmackSecuritySetLabelBackend(int backend,
+                                    const virSmackLabelFault *getFault,
+                                    const virSmackLabelFault *setFault);
+int virSmackSecuritySetPrimitiveStats(bool enable);
+int virSmackSecurityGetPrimitiveStats(int prim,
+                                      virSmackPrimitiveStatsPtr stats);
+void virSmackSecurityResetPrimitiveStats(void);
+int virSmackSecurityGetStats(virTypedParameterPtr *params,
+                             int *nparams);
+int virSmackSecuritySetHostdevLabels(virSecurityManagerPtr mgr,
+                                     virDomainDefPtr def,
+                                     virDomainHostdevDefPtr *devs,
+                                     size_t ndevs,
+                                     const char *vroot);
+int virSmackSecurityRestoreHostdevLabels(virSecurityManagerPtr mgr,
+                                         virDomainDefPtr def,
+                                         virDomainHostdevDefPtr *devs,
+                                         size_t ndevs,
+                                         const char *vroot);
+int virSmackSecurityUpdateLabels(virSecurityManagerPtr mgr,
+                                 virDomainDefPtr oldDef,
+                                 virDomainDefPtr newDef,
+                                 const char *vroot);
+int virSmackSecuritySetDeferredRestore(virSecurityManagerPtr mgr,
+                                       bool enable);
+int virSmackSecurityGetRestoreStats(virSecurityManagerPtr mgr,
+                                    virSmackDeferredRestoreStatsPtr stats);
+int virSmackSecurityGetDeferredRestores(virSecurityManagerPtr mgr,
+                                        virSmackDeferredRestorePtr *entries,
+                                        size_t *nentries);
+void virSmackDeferredRestoreFree(virSmackDeferredRestorePtr entries,
+                                 size_t nentries);
+int virSmackSecuritySetReconcileBudget(virSecurityManagerPtr mgr,
+                                       unsigned int budget);
+int virSmackSecurityGetReconcileProgress(virSecurityManagerPtr mgr,
+                                         virSmackReconcileProgressPtr progress);
+int virSmackSecuritySetRuleTemplates(virSecurityManagerPtr mgr,
+                                     const virSmackRuleTemplate *rules,
+                                     size_t nrules);
+int virSmackSecurityCreateSavedState(virSecurityManagerPtr mgr,
+                                     virDomainDefPtr def,
+                                     const char *path,
+                                     mode_t mode);
+int virSmackSecurityRestoreSavedStateFD(virSecurityManagerPtr mgr,
+                                        virDomainDefPtr def,
+                                        int fd);
+int virSmackSecurityGenLabels(virSecurityManagerPtr mgr,
+                              virDomainDefPtr *defs,
+                              size_t ndefs);
+int virSmackSecurityGetProcessLabels(virSecurityManagerPtr mgr,
+                                     const pid_t *pids,
+                                     const unsigned long long *starttimes,
+                                     size_t npids,
+                                     virSecurityLabelPtr secs);
+
 
 extern virSecurityDriver virSmackSecurityDriver;
 